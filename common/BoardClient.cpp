@@ -10,6 +10,9 @@
 #include "Poco/Timespan.h"
 #include "Poco/FileStream.h"
 #include "Poco/Net/DNS.h"
+#include <chrono>
+#include <cstring>
+#include <exception>
 #include <iostream>
 
 #ifdef DEBUG_CLIENT
@@ -35,7 +38,10 @@ static void msgdump(const BoardMessage &msg){
 # define msgdump(MSG) do{}while(0)
 #endif
 
-BoardClient::BoardClient()
+BoardClient::BoardClient():
+	stream_compression(true),
+	pixel_bytes(3),
+	reading(false)
 {
 }
 
@@ -43,32 +49,120 @@ BoardClient::~BoardClient(){
 	if(is_connected()){
 		disconnect();
 	}
+	stop_reader();
+}
+
+// No board is larger than this, so an update that claims to be is
+// corrupt, and allocating for it could take all the memory there is
+static const size_t max_update_pixels = 4096*4096;
+
+// Turns an update into METHOD_RAW pixels on the network thread, leaving
+// the render thread only a copy. Sparse updates and fills are left as
+// they are, since they are decoded over the pixels already there.
+// Returns false for an update to drop.
+static bool predecode(BoardMessage &msg){
+	if(msg.size() < 10){ return true; }
+	const unsigned w = msg.gets(0);
+	const unsigned h = msg.gets(2);
+	const unsigned enc = msg.gets(8);
+	if(0 == w || 0 == h){ return true; }
+	if((size_t)w*h > max_update_pixels){ return false; }
+	if(ImageCoder::METHOD_RAW == enc || ImageCoder::METHOD_SPARSE == enc || ImageCoder::METHOD_FILL == enc){ return true; }
+	std::vector<unsigned char> raw(10 + 3*(size_t)w*h);
+	if(0 != ImageCoder::decode(enc, &msg.payload[10], msg.size()-10, &raw[10], w, w, h)){ return true; }
+	memcpy(&raw[0], &msg.payload[0], 8);
+	raw[8] = 0;
+	raw[9] = ImageCoder::METHOD_RAW;
+	msg.payload.swap(raw);
+	return true;
+}
+
+void BoardClient::read_loop(){
+	try{
+		while(reading.load(std::memory_order_acquire)){
+			if(!connection.can_recv()){ continue; }
+			BoardMessage *msg = new BoardMessage();
+			if(!connection.recv(*msg)){
+				delete msg;
+				continue;
+			}
+			if(BoardMessage::BOARD_UPDATED == msg->type()){
+				bool keep;
+				try{
+					keep = predecode(*msg);
+				}catch(std::exception &e){
+					keep = false;
+				}
+				if(!keep){
+					delete msg;
+					continue;
+				}
+			}
+			// When the render thread falls behind, so does reading
+			while(!incoming.push(msg)){
+				if(!reading.load(std::memory_order_acquire)){
+					delete msg;
+					return;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}catch(std::exception &e){
+		// The connection is gone, or sent more than can be taken in, and
+		// nothing more will come
+		reading.store(false, std::memory_order_release);
+	}
+}
+
+void BoardClient::stop_reader(){
+	reading.store(false, std::memory_order_release);
+	if(reader.joinable()){
+		reader.join();
+	}
+	BoardMessage *msg;
+	while(incoming.pop(msg)){
+		delete msg;
+	}
 }
 
 int BoardClient::connect(const std::string &uri, const std::string &name){
+	stop_reader();
 	try{
 		Poco::Timespan span(250000);
 		connection.socket.connect(Poco::Net::SocketAddress(uri), span);
+		connection.zsend.reset();
+		connection.zrecv.reset();
 		BoardMessage msg(BoardMessage::HANDSHAKE_CLIENT, 1);
 		msg.addstring(name);
+		msg.adds(stream_compression ? BoardMessage::CAP_STREAM_COMPRESSION : 0);
 		connection.send(msg);
 		server_uri = uri;
 	}catch(Poco::Exception e){
 		return -1;
 	}
+	reading.store(true, std::memory_order_release);
+	reader = std::thread(&BoardClient::read_loop, this);
 	return 0;
 }
 
 bool BoardClient::is_connected() const{
 	return connection.socket.impl()->initialized();
 }
+void BoardClient::set_stream_compression(bool enable){
+	stream_compression = enable;
+}
 void BoardClient::get_server(std::string &server_id){
 	server_id = server_uri;
 }
 
 int BoardClient::disconnect(){
 	BoardMessage msg(BoardMessage::CLIENT_DISCONNECT, 0);
-	connection.send(msg);
+	try{
+		connection.send(msg);
+	}catch(Poco::Exception &e){
+		// The server has gone already
+	}
+	stop_reader();
 	connection.close();
 	return 0;
 }
@@ -134,51 +228,113 @@ void BoardClient::get_contents(BoardClient::board_index iboard, unsigned char *i
 		process_message(resp); // punt
 	}
 }
+int BoardClient::get_snapshot(BoardClient::board_index iboard, std::vector<unsigned char> &png, unsigned x, unsigned y, unsigned w, unsigned h){
+	BoardMessage msg(BoardMessage::BOARD_GET_SNAPSHOT, iboard);
+	msg.adds(x);
+	msg.adds(y);
+	msg.adds(w);
+	msg.adds(h);
+	connection.send(msg);
+	BoardMessage resp;
+	if(poll(BoardMessage::BOARD_SNAPSHOT, resp)){
+		if(resp.id() == iboard && resp.size() > 8 && resp.gets(0) > 0){
+			png.assign(resp.payload.begin()+8, resp.payload.end());
+			return 0;
+		}
+	}
+	return -1;
+}
 void BoardClient::request_update(BoardClient::board_index iboard){
 	BoardMessage msg(BoardMessage::BOARD_GET_CONTENTS, iboard);
 	connection.send(msg);
 	// We'll let the normal polling process grab the data
 }
-void BoardClient::send_update(BoardClient::board_index iboard, unsigned char *img, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h){
-	int method = 1;
+void BoardClient::send_update(BoardClient::board_index iboard, unsigned char *img, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h, const unsigned char *mask){
+	int method = -1;
+	if(mask){
+		size_t count = 0;
+		for(unsigned j = 0; j < h; ++j){
+			const unsigned char *m = &mask[x+(y+j)*stride];
+			for(unsigned i = 0; i < w; ++i){
+				count += (0 != m[i]);
+			}
+		}
+		if(0 == count){ return; }
+		if(count < (size_t)w*h/2){ method = ImageCoder::METHOD_SPARSE; }
+	}
+	unsigned char *px = &img[pixel_bytes*(x+y*stride)];
+	if(method < 0){
+		method = ImageCoder::choose_method(px, stride, w, h, pixel_bytes);
+	}
 	BoardMessage msg(BoardMessage::BOARD_UPDATE, iboard);
 	msg.adds(w);
 	msg.adds(h);
 	msg.adds(x);
 	msg.adds(y);
 	msg.adds(method);
-	ImageCoder::encode(method,
-		&img[3*(x+y*stride)], stride, w, h,
-		msg.payload
-	);
+	if(ImageCoder::METHOD_SPARSE == method){
+		ImageCoder::encode_sparse(
+			px, stride, w, h,
+			&mask[x+y*stride],
+			msg.payload, pixel_bytes
+		);
+	}else{
+		ImageCoder::encode(method,
+			px, stride, w, h,
+			msg.payload, pixel_bytes
+		);
+	}
+	if(ImageCoder::is_lossy(method)){
+		// Keep our own copy identical to what everyone else decodes
+		ImageCoder::decode(method,
+			&msg.payload[10], msg.payload.size()-10,
+			px, stride, w, h, pixel_bytes
+		);
+	}
+	connection.send(msg);
+}
+void BoardClient::send_fill(BoardClient::board_index iboard, unsigned x, unsigned y, unsigned w, unsigned h, unsigned fill_x, unsigned fill_y, const unsigned char rgb[3], unsigned tolerance){
+	BoardMessage msg(BoardMessage::BOARD_UPDATE, iboard);
+	msg.adds(w);
+	msg.adds(h);
+	msg.adds(x);
+	msg.adds(y);
+	msg.adds(ImageCoder::METHOD_FILL);
+	ImageCoder::encode_fill(fill_x - x, fill_y - y, rgb, tolerance, msg.payload);
 	connection.send(msg);
 }
 
 int BoardClient::poll(){
-	if(connection.can_recv()){
-		BoardMessage msg;
-		connection.recv(msg);
-		process_message(msg);
-		/*
-		int len = connection.socket.available();
-		std::vector<char> buffer(len);
-		connection.socket.receiveBytes(&buffer[0], len, 0);
-		std::string str(buffer.begin(), buffer.end());
-		std::cout << "Received " << str << std::endl;
-		*/
+	BoardMessage *msg;
+	while(incoming.pop(msg)){
+		process_message(*msg);
+		delete msg;
 	}
 	return 1;
 }
 int BoardClient::poll(BoardMessage::Type type, BoardMessage &msg){
 	dbgmsg("Looking for type %02x\n", type);
-	while(1)
-	while(connection.can_recv()){
-		if(connection.recv(msg)){
-			if(msg.type() == type){ return 1; }
-			process_message(msg);
+	while(1){
+		BoardMessage *in;
+		if(!incoming.pop(in)){
+			if(reading.load(std::memory_order_acquire)){
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			// The reader has stopped, but may have left the last few
+			if(!incoming.pop(in)){ return 0; }
+		}
+		const bool found = (in->type() == type);
+		if(found){
+			msg.type_ = in->type_;
+			msg.id_ = in->id_;
+			msg.payload.swap(in->payload);
+		}else{
+			process_message(*in);
 		}
+		delete in;
+		if(found){ return 1; }
 	}
-	return 0;
 }
 
 void BoardClient::process_message(const BoardMessage &msg){
@@ -190,6 +346,9 @@ void BoardClient::process_message(const BoardMessage &msg){
 		unsigned enc = msg.gets(8);
 		on_update(msg.id(), enc, &msg.payload[10], msg.payload.size()-10, x, y, w, h);
 	}else if(msg.type() == BoardMessage::HANDSHAKE_SERVER){
+		if(stream_compression && msg.size() >= 2 && (msg.gets(0) & BoardMessage::CAP_STREAM_COMPRESSION)){
+			connection.enable_compression();
+		}
 	}else if(msg.type() == BoardMessage::BOARD_ENUMERATION){
 		std::vector<std::string> boards;
 		unsigned off = 0;
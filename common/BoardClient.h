@@ -2,15 +2,29 @@
 #define BOARD_CLIENT_H_INCLUDED
 
 #define POCO_WIN32_UTF8
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 #include "Poco/Net/StreamSocket.h"
 #include "BoardServer.h"
+#include "SpscQueue.h"
 
 class BoardClient{
 protected:
 	BoardServer::Connection connection;
 	std::string server_uri;
+	bool stream_compression;
+	unsigned pixel_bytes;
+	// While connected, a thread of its own reads and parses messages, and
+	// decodes updates that do not depend on the pixels already there. They
+	// reach this thread through incoming, which poll() empties. Sending
+	// stays on this thread.
+	std::thread reader;
+	std::atomic<bool> reading;
+	SpscQueue<BoardMessage*> incoming;
+	void read_loop();
+	void stop_reader();
 public:
 	typedef int board_index;
 public:
@@ -19,10 +33,15 @@ public:
 	
 	virtual int connect(const std::string &server_uri, const std::string &name);
 	virtual int disconnect();
+	// Handles every message that has come in since the last call
 	int poll();
+	// Waits for a message of the given type, handling the others on the way.
+	// Returns 0 if the connection went first.
 	int poll(BoardMessage::Type type, BoardMessage &msg);
 	
 	bool is_connected() const;
+	// Whether to offer stream compression at the next connect (default on)
+	void set_stream_compression(bool enable);
 	void get_server(std::string &server_id);
 	
 	void get_boards(std::vector<std::string> &boards);
@@ -32,8 +51,21 @@ public:
 	
 	void get_size(board_index iboard, unsigned &width, unsigned &height);
 	void get_contents(board_index iboard, unsigned char *img);
+	// PNG of a region of a board, encoded by the server. A zero w or h
+	// extends to the edge of the board. Returns 0, or -1 if there is none.
+	int get_snapshot(board_index iboard, std::vector<unsigned char> &png, unsigned x = 0, unsigned y = 0, unsigned w = 0, unsigned h = 0);
 	void request_update(board_index iboard);
-	void send_update(board_index iboard, unsigned char *img, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h);
+	// Bytes per pixel of the images passed to send_update: 3 for RGB (the
+	// default) or 4 for RGBX. They go out as RGB either way.
+	void set_pixel_bytes(unsigned bytes){ pixel_bytes = bytes; }
+	// mask, if given, has a byte per pixel of img, with the same stride,
+	// which is 0 where the pixel is known to be as it was. Updates where
+	// few pixels changed then send only those.
+	void send_update(board_index iboard, unsigned char *img, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h, const unsigned char *mask = NULL);
+	// Sends a flood fill from (fill_x, fill_y) that changed no pixel
+	// outside x, y, w, h, for the server and the other clients to repeat
+	// on their own copies of the board.
+	void send_fill(board_index iboard, unsigned x, unsigned y, unsigned w, unsigned h, unsigned fill_x, unsigned fill_y, const unsigned char rgb[3], unsigned tolerance);
 	
 	virtual void on_update(board_index iboard, int method, const unsigned char *buffer, unsigned buflen, unsigned x, unsigned y, unsigned w, unsigned h){}
 	virtual void on_board_list_update(const std::vector<std::string> &boards){}
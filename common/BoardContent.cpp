@@ -1,8 +1,15 @@
 #include "BoardContent.h"
+#include "PixelOps.h"
+#include "FloodFill.h"
 #include "lodepng.h"
+#include "fastlz.h"
+#include <algorithm>
+#include <climits>
 #include <iostream>
 #include <cstring>
+#include <chrono>
 #include <cmath>
+#include <thread>
 
 
 BoardContent::Region::Region(pixel_coord x_, pixel_coord y_, pixel_coord w_, pixel_coord h_):
@@ -30,12 +37,373 @@ bool BoardContent::Region::contains(int tx, int ty) const{
 	return (x <= tx && tx < x+w && y <= ty && ty < y+h);
 }
 
-BoardContent::BoardContent():drawable_region(0,0,2048,1024), moving(false){
+BoardContent::DirtyTiles::DirtyTiles():
+	width(0), height(0), tiles_x(0)
+{
+}
+void BoardContent::DirtyTiles::resize(unsigned width_, unsigned height_){
+	if(width_ == width && height_ == height){ return; }
+	width = width_;
+	height = height_;
+	tiles_x = (width + TILE-1) / TILE;
+	const Box empty = { 1, 0, 0, 0 };
+	boxes.assign(tiles_x * ((height + TILE-1) / TILE), empty);
+	touched.clear();
+}
+void BoardContent::DirtyTiles::add_span(pixel_coord x0, pixel_coord x1, pixel_coord y){
+	if(x0 < 0){ x0 = 0; }
+	if(x1 >= (pixel_coord)width){ x1 = width-1; }
+	if(x0 > x1 || y < 0 || y >= (pixel_coord)height){ return; }
+	const unsigned row = (y / TILE) * tiles_x;
+	for(unsigned tx = x0 / TILE; tx <= (unsigned)x1 / TILE; ++tx){
+		Box &b = boxes[row + tx];
+		const pixel_coord l = std::max(x0, (pixel_coord)(tx*TILE));
+		const pixel_coord r = std::min(x1, (pixel_coord)(tx*TILE + TILE-1));
+		if(b.x0 > b.x1){
+			touched.push_back(row + tx);
+			b.x0 = l;
+			b.x1 = r;
+			b.y0 = y;
+			b.y1 = y;
+		}else{
+			b.x0 = std::min(b.x0, l);
+			b.x1 = std::max(b.x1, r);
+			b.y0 = std::min(b.y0, y);
+			b.y1 = std::max(b.y1, y);
+		}
+	}
+}
+
+// Pixels that one more rectangle is worth: each costs a message, setting
+// up an encoder and a texture upload.
+static const long long rect_cost = 1024;
+
+static long long area(const BoardContent::Region &r){
+	return (long long)r.w * r.h;
+}
+static BoardContent::Region bounds(const BoardContent::Region &a, const BoardContent::Region &b){
+	const int x = std::min(a.x, b.x), y = std::min(a.y, b.y);
+	return BoardContent::Region(x, y, std::max(a.x+a.w, b.x+b.w) - x, std::max(a.y+a.h, b.y+b.h) - y);
+}
+// Whether covering a and b with one rectangle wastes less than a rectangle costs
+static bool worth_merging(const BoardContent::Region &a, const BoardContent::Region &b){
+	return area(bounds(a, b)) - area(a) - area(b) <= rect_cost;
+}
+
+void BoardContent::DirtyTiles::take(std::vector<Region> &rects){
+	// Join neighbours along each row of tiles first, which is cheap and
+	// leaves few enough rectangles to try every pair of
+	std::sort(touched.begin(), touched.end());
+	std::vector<Region> merged;
+	for(size_t k = 0; k < touched.size(); ++k){
+		const unsigned t = touched[k];
+		Box &b = boxes[t];
+		const Region r(b.x0, b.y0, b.x1-b.x0+1, b.y1-b.y0+1);
+		b.x0 = 1;
+		b.x1 = 0;
+		if(k > 0 && t == touched[k-1]+1 && 0 != t % tiles_x && worth_merging(merged.back(), r)){
+			merged.back() = bounds(merged.back(), r);
+		}else{
+			merged.push_back(r);
+		}
+	}
+	touched.clear();
+	for(size_t i = 0; i < merged.size(); ++i){
+		for(size_t j = i+1; j < merged.size(); ++j){
+			if(worth_merging(merged[i], merged[j])){
+				merged[i] = bounds(merged[i], merged[j]);
+				merged.erase(merged.begin()+j);
+				// The bigger rectangle may now be worth joining to others
+				i = (size_t)-1;
+				break;
+			}
+		}
+	}
+	rects.insert(rects.end(), merged.begin(), merged.end());
+}
+
+// Enough for several clears of a full board, which is the worst case
+static const size_t default_history_budget = 16u << 20;
+
+BoardContent::History::History():
+	budget(default_history_budget), used(0), waiting(0), width(0), height(0), tiles_x(0), tiles_y(0)
+{
+}
+
+void BoardContent::History::set_budget(size_t bytes){
+	budget = bytes;
+	trim();
+}
+
+void BoardContent::History::clear(){
+	// Jobs still running leave the counts alone when they finish
+	std::deque<Step> *steps[2] = { &undo_steps, &redo_steps };
+	for(int k = 0; k < 2; ++k){
+		for(size_t s = 0; s < steps[k]->size(); ++s){
+			const Step &step = (*steps[k])[s];
+			for(size_t i = 0; i < step.tiles.size(); ++i){
+				step.tiles[i].layers->dropped = true;
+			}
+		}
+	}
+	undo_steps.clear();
+	redo_steps.clear();
+	open.tiles.clear();
+	saved.assign(tiles_x * tiles_y, 0);
+	used = 0;
+	waiting = 0;
+}
+
+// A tile is kept as its background rows, then a byte telling whether it
+// has ink, then the ink tile if so. The image follows from those.
+void BoardContent::History::copy(const BoardContent &board, unsigned index, std::vector<unsigned char> &bytes){
+	static_assert((int)TILE == (int)INK_TILE, "history tiles are ink tiles");
+	const unsigned x0 = (index % tiles_x) * TILE, y0 = (index / tiles_x) * TILE;
+	const unsigned w = std::min((unsigned)TILE, width - x0), h = std::min((unsigned)TILE, height - y0);
+	const std::vector<unsigned char> &ink = board.ink[index];
+	bytes.clear();
+	bytes.reserve(std::max(3*(size_t)w*h + 1 + ink.size(), (size_t)16));
+	for(unsigned y = y0; y < y0 + h; ++y){
+		const unsigned char *row = &board.background[3*(x0 + (size_t)y*width)];
+		bytes.insert(bytes.end(), row, row + 3*w);
+	}
+	bytes.push_back(ink.empty() ? 0 : 1);
+	bytes.insert(bytes.end(), ink.begin(), ink.end());
+	if(bytes.size() < 16){ bytes.resize(16); } // fastlz needs that much
+}
+
+// Hands the step's copied tiles to the worker. They stay usable as they
+// are in the meantime. The completion only visits the tiles of its own
+// job, so the cost of a step does not grow with the history behind it.
+void BoardContent::History::compress_later(const Step &step){
+	std::shared_ptr<std::vector<std::shared_ptr<Layers> > > todo(new std::vector<std::shared_ptr<Layers> >());
+	for(size_t i = 0; i < step.tiles.size(); ++i){
+		todo->push_back(step.tiles[i].layers);
+	}
+	if(todo->empty()){ return; }
+	jobs.post([this, todo]() -> JobQueue::Completion{
+		for(size_t i = 0; i < todo->size(); ++i){
+			Layers &layers = *(*todo)[i];
+			layers.packed.resize(layers.bytes.size() + layers.bytes.size()/20 + 66);
+			const int n = fastlz_compress_level(1, &layers.bytes[0], layers.bytes.size(), &layers.packed[0]);
+			layers.packed.resize(n);
+			layers.packed.shrink_to_fit();
+		}
+		return [this, todo](){
+			for(size_t i = 0; i < todo->size(); ++i){
+				Layers &layers = *(*todo)[i];
+				if(layers.dropped){ continue; }
+				const size_t before = layers.size();
+				layers.compressed = true;
+				std::vector<unsigned char>().swap(layers.bytes);
+				used = used - before + layers.size();
+				waiting -= before;
+			}
+		};
+	});
+}
+
+void BoardContent::History::collect(){
+	const unsigned pending = jobs.pending();
+	if(0 == pending){ return; }
+	jobs.poll();
+	if(jobs.pending() != pending){ trim(); }
+}
+
+void BoardContent::History::keep_up(){
+	while(waiting > budget && jobs.pending() > 0){
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		collect();
+	}
+}
+
+void BoardContent::History::drop(Tile &tile){
+	Layers &layers = *tile.layers;
+	used -= layers.size();
+	if(!layers.compressed){ waiting -= layers.size(); }
+	layers.dropped = true;
+}
+
+// Tiles still waiting for the worker are left out, or a paste over the
+// whole board would push out far more than it takes once compressed.
+// collect() trims again when they are.
+void BoardContent::History::trim(){
+	// The oldest steps are the least likely to be wanted back
+	std::deque<Step> *steps[2] = { &undo_steps, &redo_steps };
+	for(int k = 0; k < 2; ++k){
+		while(used - waiting > budget && !steps[k]->empty()){
+			Step &step = steps[k]->front();
+			for(size_t i = 0; i < step.tiles.size(); ++i){
+				drop(step.tiles[i]);
+			}
+			steps[k]->pop_front();
+		}
+	}
+}
+
+void BoardContent::History::save(const BoardContent &board, pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1){
+	if(board.width != width || board.height != height){
+		width = board.width;
+		height = board.height;
+		tiles_x = (width + TILE-1) / TILE;
+		tiles_y = (height + TILE-1) / TILE;
+		clear();
+	}
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1, (pixel_coord)width - 1);
+	y1 = std::min(y1, (pixel_coord)height - 1);
+	if(x0 > x1 || y0 > y1){ return; }
+	for(unsigned ty = y0 / TILE; ty <= (unsigned)y1 / TILE; ++ty){
+		for(unsigned tx = x0 / TILE; tx <= (unsigned)x1 / TILE; ++tx){
+			const unsigned index = tx + ty * tiles_x;
+			if(saved[index]){ continue; }
+			saved[index] = 1;
+			open.tiles.push_back(Tile());
+			Tile &tile = open.tiles.back();
+			tile.index = index;
+			tile.layers.reset(new Layers());
+			copy(board, index, tile.layers->bytes);
+		}
+	}
+}
+
+void BoardContent::History::commit(){
+	collect();
+	if(open.tiles.empty()){ return; }
+	for(size_t s = 0; s < redo_steps.size(); ++s){
+		Step &step = redo_steps[s];
+		for(size_t i = 0; i < step.tiles.size(); ++i){
+			drop(step.tiles[i]);
+		}
+	}
+	redo_steps.clear();
+	for(size_t i = 0; i < open.tiles.size(); ++i){
+		const Tile &tile = open.tiles[i];
+		saved[tile.index] = 0;
+		used += tile.layers->size();
+		waiting += tile.layers->size();
+	}
+	undo_steps.push_back(Step());
+	undo_steps.back().tiles.swap(open.tiles);
+	compress_later(undo_steps.back());
+	keep_up();
+	trim();
+}
+
+void BoardContent::History::forget(pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1, const unsigned char *written){
+	const pixel_coord ox = x0, oy = y0, stride = x1 - x0 + 1;
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1, (pixel_coord)width - 1);
+	y1 = std::min(y1, (pixel_coord)height - 1);
+	if(x0 > x1 || y0 > y1){ return; }
+	collect();
+	stale.assign(tiles_x * tiles_y, 0);
+	if(written){
+		for(pixel_coord y = y0; y <= y1; ++y){
+			const unsigned char *row = written + (x0 - ox) + (size_t)(y - oy)*stride;
+			for(pixel_coord x = x0; x <= x1; ++x){
+				if(row[x - x0]){ stale[x / TILE + (y / TILE) * tiles_x] = 1; }
+			}
+		}
+	}else{
+		for(unsigned ty = y0 / TILE; ty <= (unsigned)y1 / TILE; ++ty){
+			for(unsigned tx = x0 / TILE; tx <= (unsigned)x1 / TILE; ++tx){
+				stale[tx + ty * tiles_x] = 1;
+			}
+		}
+	}
+	// The one in progress saves them again if it goes on over them
+	for(size_t i = 0; i < open.tiles.size(); ){
+		Tile &tile = open.tiles[i];
+		if(!stale[tile.index]){ ++i; continue; }
+		saved[tile.index] = 0;
+		std::swap(tile, open.tiles.back());
+		open.tiles.pop_back();
+	}
+	std::deque<Step> *steps[2] = { &undo_steps, &redo_steps };
+	for(int k = 0; k < 2; ++k){
+		for(size_t s = 0; s < steps[k]->size(); ){
+			Step &step = (*steps[k])[s];
+			for(size_t i = 0; i < step.tiles.size(); ){
+				Tile &tile = step.tiles[i];
+				if(!stale[tile.index]){ ++i; continue; }
+				drop(tile);
+				std::swap(tile, step.tiles.back());
+				step.tiles.pop_back();
+			}
+			// A step with nothing left would make undo do nothing
+			if(step.tiles.empty()){
+				steps[k]->erase(steps[k]->begin() + s);
+			}else{
+				++s;
+			}
+		}
+	}
+}
+
+bool BoardContent::History::swap(std::deque<Step> &from, std::deque<Step> &to, BoardContent &board, BoardContent::DirtyTiles *touched){
+	if(from.empty()){ return false; }
+	collect();
+	Step &step = from.back();
+	for(size_t i = 0; i < step.tiles.size(); ++i){
+		Tile &tile = step.tiles[i];
+		const unsigned x0 = (tile.index % tiles_x) * TILE, y0 = (tile.index / tiles_x) * TILE;
+		const unsigned w = std::min((unsigned)TILE, width - x0), h = std::min((unsigned)TILE, height - y0);
+		std::shared_ptr<Layers> current(new Layers());
+		copy(board, tile.index, current->bytes);
+		// Still a copy if the worker has not got to it yet
+		const Layers &layers = *tile.layers;
+		const unsigned char *src;
+		if(!layers.compressed){
+			src = &layers.bytes[0];
+		}else{
+			unpacked.resize(std::max(3*(size_t)w*h + 1 + 4*TILE*TILE, (size_t)16));
+			fastlz_decompress(&layers.packed[0], layers.packed.size(), &unpacked[0], unpacked.size());
+			src = &unpacked[0];
+		}
+		const size_t bg_bytes = 3*(size_t)w*h;
+		for(unsigned y = 0; y < h; ++y){
+			memcpy(&board.background[3*(x0 + (size_t)(y0 + y)*width)], &src[3*(size_t)w*y], 3*w);
+		}
+		std::vector<unsigned char> &ink = board.ink[tile.index];
+		if(src[bg_bytes]){
+			ink.assign(src + bg_bytes + 1, src + bg_bytes + 1 + 4*TILE*TILE);
+		}else{
+			std::vector<unsigned char>().swap(ink);
+		}
+		drop(tile);
+		tile.layers = current;
+		used += current->size();
+		waiting += current->size();
+		for(unsigned y = y0; y < y0 + h; ++y){
+			touched->add_span(x0, x0 + w - 1, y);
+		}
+	}
+	to.push_back(Step());
+	to.back().tiles.swap(step.tiles);
+	from.pop_back();
+	compress_later(to.back());
+	keep_up();
+	trim();
+	return true;
+}
+
+bool BoardContent::History::undo(BoardContent &board, BoardContent::DirtyTiles *touched){
+	return swap(undo_steps, redo_steps, board, touched);
+}
+
+bool BoardContent::History::redo(BoardContent &board, BoardContent::DirtyTiles *touched){
+	return swap(redo_steps, undo_steps, board, touched);
+}
+
+BoardContent::BoardContent():drawable_region(0,0,2048,1024), moving(false), ink_tiles_x(0){
 	width = 2048;
 	height = 1024;
 	width_height = (float)width / (float)height;
-	image.resize(width *height *3);
-	memset(&image[0], 0xff, width *height *3);
+	image.resize(width *height *PIXEL_BYTES);
+	memset(&image[0], 0xff, width *height *PIXEL_BYTES);
 
 	drawable_region.x = 0;
 	drawable_region.y = 0;
@@ -61,11 +429,23 @@ BoardContent::BoardContent():drawable_region(0,0,2048,1024), moving(false){
 	color_palette.push_back(PenColor(0.5, 0, 0.8)); // purple
 	
 	// Set up GUI
-	draw_gui(&image[3*(width - 64)], width, 64, height);
+	draw_gui(&image[PIXEL_BYTES*(width - 64)], width, 64, height);
+	init_layers();
+}
+
+void BoardContent::on_image_update_list(const std::vector<BoardContent::Region> &touched){
+	for(size_t i = 0; i < touched.size(); ++i){
+		Region r = touched[i];
+		on_image_update(&r);
+	}
+}
+
+void BoardContent::on_image_fill(const Region &r, pixel_coord x, pixel_coord y, const unsigned char rgb[3], unsigned tolerance){
+	on_image_update_list(std::vector<Region>(1, r));
 }
 
 void BoardContent::redraw_gui(){
-	draw_gui(&image[3*(width - 64)], width, 64, height);
+	draw_gui(&image[PIXEL_BYTES*(width - 64)], width, 64, height);
 	BoardContent::Region reg(width-64, 0, 64, height);
 	on_image_update(&reg);
 }
@@ -73,48 +453,385 @@ void BoardContent::redraw_gui(){
 BoardContent::~BoardContent(){
 }
 
-void BoardContent::draw_line(pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1, BoardContent::Region *touched) { 
-	int dx = abs(x1-x0), sx = x0<x1 ? 1 : -1;
-	int dy = abs(y1-y0), sy = y0<y1 ? 1 : -1; 
-	int err = (dx>dy ? dx : -dy)/2, e2;
+// Pixels of row y whose centres are within r of (cx, cy), r2 being r*r.
+// Returns false if there are none.
+static bool disc_span(int cx, int cy, float r2, int y, int &xl, int &xr){
+	const int dy2 = (y-cy)*(y-cy);
+	if(dy2 > r2){ return false; }
+	int h = (int)sqrtf(r2 - dy2);
+	while((h+1)*(h+1) + dy2 <= r2){ ++h; }
+	while(h > 0 && h*h + dy2 > r2){ --h; }
+	xl = cx - h;
+	xr = cx + h;
+	return true;
+}
+
+// Narrows [lo, hi] to the t with vmin <= a*t + b <= vmax
+static bool clip_linear(double a, double b, double vmin, double vmax, double &lo, double &hi){
+	if(0 == a){ return vmin <= b && b <= vmax; }
+	double t0 = (vmin - b) / a;
+	double t1 = (vmax - b) / a;
+	if(t0 > t1){ std::swap(t0, t1); }
+	if(t0 > lo){ lo = t0; }
+	if(t1 < hi){ hi = t1; }
+	return lo <= hi;
+}
+
+// Pixels of row y within r of segment (x0, y0)-(x1, y1) and between the
+// perpendiculars at its ends: the capsule without its round caps.
+static bool band_span(int x0, int y0, int x1, int y1, float r, int y, int &xl, int &xr){
+	const double dx = x1 - x0, dy = y1 - y0;
+	const double len2 = dx*dx + dy*dy;
+	if(0 == len2){ return false; }
+	const double ry = y - y0;
+	const double rl = r * sqrt(len2);
+	double lo = -HUGE_VAL, hi = HUGE_VAL;
+	// With t = x - x0: the projection onto the segment, then the distance from it
+	if(!clip_linear(dx, dy*ry, 0, len2, lo, hi)){ return false; }
+	if(!clip_linear(-dy, dx*ry, -rl, rl, lo, hi)){ return false; }
+	const double eps = 1e-6;
+	xl = x0 + (int)ceil(lo - eps);
+	xr = x0 + (int)floor(hi + eps);
+	return xl <= xr;
+}
 
-	for(;;){
-		paint(x0, y0, touched);
-		if (x0==x1 && y0==y1) break;
-		e2 = err;
-		if (e2 >-dx) { err -= dy; x0 += sx; }
-		if (e2 < dy) { err += dx; y0 += sy; }
+// Pixels of row y within r of segment (x0, y0)-(x1, y1). The capsule is
+// convex, so that is a single span: the union of those of its parts.
+static bool capsule_span(int x0, int y0, int x1, int y1, float r, float r2, int y, int &xl, int &xr){
+	int l, h;
+	bool hit = false;
+	if(disc_span(x0, y0, r2, y, l, h)){
+		xl = l;
+		xr = h;
+		hit = true;
 	}
+	if(disc_span(x1, y1, r2, y, l, h)){
+		xl = (hit ? std::min(xl, l) : l);
+		xr = (hit ? std::max(xr, h) : h);
+		hit = true;
+	}
+	if(band_span(x0, y0, x1, y1, r, y, l, h)){
+		xl = (hit ? std::min(xl, l) : l);
+		xr = (hit ? std::max(xr, h) : h);
+		hit = true;
+	}
+	return hit;
+}
+
+static unsigned isqrt(unsigned long long v){
+	unsigned long long s = (unsigned long long)sqrt((double)v);
+	while(s*s > v){ --s; }
+	while((s+1)*(s+1) <= v){ ++s; }
+	return (unsigned)s;
 }
 
-void BoardContent::paint(pixel_coord ux, pixel_coord uy, BoardContent::Region *touched){
-	const int ix = ux;
-	const int iy = uy;
+// How much of pixel (x, y) the capsule of radius r256/256 around segment
+// (x0, y0)-(x1, y1) covers, from 0 to 256, ramping down across the pixel
+// either side of the edge. Only integers, so it is the same everywhere.
+static int coverage(int x0, int y0, int x1, int y1, int r256, int x, int y){
+	const long long dx = x1 - x0, dy = y1 - y0;
+	const long long px = x - x0, py = y - y0;
+	const long long len2 = dx*dx + dy*dy;
+	const long long t = px*dx + py*dy;
+	// Squared distance in 1/256ths of a pixel is d2 / div. Most pixels are
+	// fully in or out, which needs no division or square root.
+	unsigned long long d2, div = 1;
+	if(0 == len2 || t <= 0){
+		d2 = (unsigned long long)(px*px + py*py) << 16;
+	}else if(t >= len2){
+		d2 = (unsigned long long)((px-dx)*(px-dx) + (py-dy)*(py-dy)) << 16;
+	}else{
+		const long long c = px*dy - py*dx;
+		d2 = (unsigned long long)(c*c) << 16;
+		div = len2;
+	}
+	const unsigned long long out = (unsigned long long)(r256 + 128) * (r256 + 128);
+	if(d2 >= out * div){ return 0; }
+	if(r256 >= 128){
+		const unsigned long long in = (unsigned long long)(r256 - 127) * (r256 - 127);
+		if(d2 < in * div){ return 256; }
+	}
+	const int a = r256 + 128 - (int)isqrt(d2 / div);
+	return (a < 0 ? 0 : a > 256 ? 256 : a);
+}
+
+void BoardContent::draw_line(pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1, BoardContent::DirtyTiles *touched) { 
+	const pixel_coord xy[4] = { x0, y0, x1, y1 };
+	draw_polyline(xy, 2, touched);
+}
+
+void BoardContent::draw_polyline(const pixel_coord *xy, unsigned npoints, BoardContent::DirtyTiles *touched, const pixel_coord *before){
+	if(0 == npoints){ return; }
+	if(pen.antialias){
+		draw_polyline_aa(xy, npoints, touched, before);
+		return;
+	}
 	const float r = 0.5*pen.width;
-	const int y0 = floor(iy - r);
-	const int y1 = floor(iy + 1 + r);
-	const int x0 = floor(ix - r);
-	const int x1 = floor(ix + 1 + r);
 	const float r2 = r*r;
-	for(int y = y0; y <= y1; ++y){
-		const int dy = y - iy;
-		const int dy2 = dy*dy;
-		for(int x = x0; x <= x1; ++x){
-			const int dx = x - ix;
-			const int dx2 = dx*dx;
-			if(dx2+dy2 <= r2){
-				set_pixel(x, y, 1, touched);
+	const int reach = (int)r;
+	int ymin = xy[1], ymax = xy[1];
+	for(unsigned i = 1; i < npoints; ++i){
+		ymin = std::min(ymin, xy[2*i+1]);
+		ymax = std::max(ymax, xy[2*i+1]);
+	}
+	ymin = std::max(ymin - reach, drawable_region.y);
+	ymax = std::min(ymax + reach, drawable_region.y + drawable_region.h - 1);
+
+	const unsigned nsegments = (npoints > 1 ? npoints-1 : 1);
+	const unsigned last = npoints-1;
+	int xl, xr;
+	if(1 == nsegments){
+		for(int y = ymin; y <= ymax; ++y){
+			if(capsule_span(xy[0], xy[1], xy[2*last], xy[2*last+1], r, r2, y, xl, xr)){
+				fill_span(xl, xr, y, touched);
 			}
 		}
+		return;
+	}
+
+	// Spans of neighbouring segments overlap, so merge them first
+	std::vector<std::pair<int, int> > spans;
+	spans.reserve(nsegments);
+	for(int y = ymin; y <= ymax; ++y){
+		spans.clear();
+		for(unsigned i = 0; i < nsegments; ++i){
+			// A batch of samples is mostly segments far from this row
+			if(y + reach < std::min(xy[2*i+1], xy[2*i+3]) || y - reach > std::max(xy[2*i+1], xy[2*i+3])){ continue; }
+			if(capsule_span(xy[2*i], xy[2*i+1], xy[2*i+2], xy[2*i+3], r, r2, y, xl, xr)){
+				spans.push_back(std::make_pair(xl, xr));
+			}
+		}
+		if(spans.empty()){ continue; }
+		if(spans.size() > 1){ std::sort(spans.begin(), spans.end()); }
+		xl = spans[0].first;
+		xr = spans[0].second;
+		for(size_t k = 1; k < spans.size(); ++k){
+			if(spans[k].first > xr + 1){
+				fill_span(xl, xr, y, touched);
+				xl = spans[k].first;
+			}
+			xr = std::max(xr, spans[k].second);
+		}
+		fill_span(xl, xr, y, touched);
+	}
+}
+
+void BoardContent::draw_polyline_aa(const pixel_coord *xy, unsigned npoints, BoardContent::DirtyTiles *touched, const pixel_coord *before){
+	const float r = 0.5*pen.width;
+	const int r256 = (int)(r*256 + 0.5f);
+	// Spans reaching half a pixel past the edge hold every pixel with some
+	// coverage, and those more than half a pixel inside are solid. The
+	// margin covers rounding in r256 and in the spans, so which pixels get
+	// which coverage only ever depends on coverage() itself.
+	const float margin = 1.f/64;
+	const float ro = r + 0.5f + margin, ro2 = ro*ro;
+	const float ri = r - 0.5f - margin, ri2 = ri*ri;
+	const int reach = (int)ro + 1;
+	int ymin = xy[1], ymax = xy[1];
+	for(unsigned i = 1; i < npoints; ++i){
+		ymin = std::min(ymin, xy[2*i+1]);
+		ymax = std::max(ymax, xy[2*i+1]);
+	}
+	ymin = std::max(ymin - reach, drawable_region.y);
+	ymax = std::min(ymax + reach, drawable_region.y + drawable_region.h - 1);
+	const int xmin = drawable_region.x, xmax = drawable_region.x + drawable_region.w - 1;
+	const unsigned nsegments = (npoints > 1 ? npoints-1 : 1);
+	const unsigned last = npoints-1;
+	unsigned char rgba[4] = { 0, 0, 0, 0 };
+	if(!pen.eraser){
+		rgba[0] = (unsigned char)(255 * pen.color[0]);
+		rgba[1] = (unsigned char)(255 * pen.color[1]);
+		rgba[2] = (unsigned char)(255 * pen.color[2]);
+		rgba[3] = 255;
+	}
+
+	std::vector<uint16_t> cover;
+	for(int y = ymin; y <= ymax; ++y){
+		int xl = INT_MAX, xr = INT_MIN, l, h;
+		for(unsigned i = 0; i < nsegments; ++i){
+			const pixel_coord *p = &xy[2*i], *q = &xy[2*std::min(i+1, last)];
+			if(capsule_span(p[0], p[1], q[0], q[1], ro, ro2, y, l, h)){
+				xl = std::min(xl, l);
+				xr = std::max(xr, h);
+			}
+		}
+		xl = std::max(xl, xmin);
+		xr = std::min(xr, xmax);
+		if(xl > xr){ continue; }
+		cover.assign(4*(size_t)(xr - xl + 1), 0);
+		for(unsigned i = 0; i < nsegments; ++i){
+			const pixel_coord *p = &xy[2*i], *q = &xy[2*std::min(i+1, last)];
+			if(!capsule_span(p[0], p[1], q[0], q[1], ro, ro2, y, l, h)){ continue; }
+			l = std::max(l, xl);
+			h = std::min(h, xr);
+			int sl = 1, sh = 0;
+			if(ri > 0){
+				capsule_span(p[0], p[1], q[0], q[1], ri, ri2, y, sl, sh);
+			}
+			for(int x = l; x <= h; ++x){
+				const int a = (sl <= x && x <= sh ? 256 : coverage(p[0], p[1], q[0], q[1], r256, x, y));
+				uint16_t *c = &cover[4*(x - xl)];
+				if(a > c[0]){
+					c[0] = c[1] = c[2] = c[3] = a;
+				}
+			}
+		}
+		if(before && capsule_span(before[0], before[1], xy[0], xy[1], ro, ro2, y, l, h)){
+			// Only top up what the previous segment left: going from
+			// coverage b to a takes a weight of (a-b)/(1-b)
+			l = std::max(l, xl);
+			h = std::min(h, xr);
+			int sl = 1, sh = 0;
+			if(ri > 0){
+				capsule_span(before[0], before[1], xy[0], xy[1], ri, ri2, y, sl, sh);
+			}
+			for(int x = l; x <= h; ++x){
+				uint16_t *c = &cover[4*(x - xl)];
+				if(0 == c[0]){ continue; }
+				const int b = (sl <= x && x <= sh ? 256 : coverage(before[0], before[1], xy[0], xy[1], r256, x, y));
+				const int a = (b >= c[0] ? 0 : ((c[0] - b) << 8) / (256 - b));
+				c[0] = c[1] = c[2] = c[3] = a;
+			}
+		}
+		for(int x = xl; x <= xr; ){
+			const int end = std::min(xr, x - x % INK_TILE + INK_TILE-1);
+			unsigned char *dst = ink_at(x, y, !pen.eraser);
+			if(dst){
+				PixelOps::blend_rgba(dst, &cover[4*(x - xl)], end - x + 1, rgba);
+			}
+			x = end + 1;
+		}
+		touched->add_span(xl, xr, y);
 	}
 }
-void BoardContent::set_pixel(pixel_coord x, pixel_coord y, float val, BoardContent::Region *touched) {
+
+void BoardContent::paint(pixel_coord ux, pixel_coord uy, BoardContent::DirtyTiles *touched){
+	const pixel_coord xy[2] = { ux, uy };
+	draw_polyline(xy, 1, touched);
+}
+
+static void fill_rgba(unsigned char *dst, unsigned n, const unsigned char rgba[4]){
+	for(unsigned i = 0; i < n; ++i){
+		memcpy(dst + 4*i, rgba, 4);
+	}
+}
+
+void BoardContent::fill_span(pixel_coord x0, pixel_coord x1, pixel_coord y, BoardContent::DirtyTiles *touched){
+	if(y < drawable_region.y || y >= drawable_region.y + drawable_region.h){ return; }
+	x0 = std::max(x0, drawable_region.x);
+	x1 = std::min(x1, drawable_region.x + drawable_region.w - 1);
+	if(x0 > x1){ return; }
+	unsigned char rgba[4] = { 0, 0, 0, 0 };
+	if(!pen.eraser){
+		rgba[0] = (unsigned char)(255 * pen.color[0]);
+		rgba[1] = (unsigned char)(255 * pen.color[1]);
+		rgba[2] = (unsigned char)(255 * pen.color[2]);
+		rgba[3] = 255;
+	}
+	for(pixel_coord x = x0; x <= x1; ){
+		const pixel_coord end = std::min(x1, x - x % INK_TILE + INK_TILE-1);
+		unsigned char *dst = ink_at(x, y, !pen.eraser);
+		if(dst){
+			fill_rgba(dst, end - x + 1, rgba);
+		}
+		x = end + 1;
+	}
+	touched->add_span(x0, x1, y);
+}
+void BoardContent::set_pixel(pixel_coord x, pixel_coord y, float val, BoardContent::DirtyTiles *touched) {
 	if(!drawable_region.contains(x, y)){ return;  }
-	int k = x + y * width;
-	image[3 * k + 0] = 255 * (val*pen.color[0]);
-	image[3 * k + 1] = 255 * (val*pen.color[1]);
-	image[3 * k + 2] = 255 * (val*pen.color[2]);
-	touched->expand_to_include(x, y);
+	unsigned char *dst = ink_at(x, y, !pen.eraser);
+	if(!dst){ return; }
+	dst[0] = (pen.eraser ? 0 : 255 * (val*pen.color[0]));
+	dst[1] = (pen.eraser ? 0 : 255 * (val*pen.color[1]));
+	dst[2] = (pen.eraser ? 0 : 255 * (val*pen.color[2]));
+	dst[3] = (pen.eraser ? 0 : 255);
+	touched->add_span(x, x, y);
+}
+
+// Copy n pixels between the RGB layers and the image's own layout
+static inline void rgb_to_image(unsigned char *dst, const unsigned char *src, size_t n){
+	if(4 == BoardContent::PIXEL_BYTES){
+		PixelOps::rgbx_from_rgb(dst, src, n);
+	}else{
+		memcpy(dst, src, 3*n);
+	}
+}
+static inline void rgb_from_image(unsigned char *dst, const unsigned char *src, size_t n){
+	if(4 == BoardContent::PIXEL_BYTES){
+		PixelOps::rgb_from_rgbx(dst, src, n);
+	}else{
+		memcpy(dst, src, 3*n);
+	}
+}
+
+void BoardContent::init_layers(){
+	const unsigned tiles_x = (width + INK_TILE-1) / INK_TILE;
+	if(background.size() / 3 == image.size() / PIXEL_BYTES && tiles_x == ink_tiles_x){ return; }
+	background.resize(image.size() / PIXEL_BYTES * 3);
+	rgb_from_image(&background[0], &image[0], image.size() / PIXEL_BYTES);
+	ink_tiles_x = tiles_x;
+	ink.clear();
+	ink.resize(tiles_x * ((height + INK_TILE-1) / INK_TILE));
+	changed.assign((size_t)width*height, 0);
+}
+
+unsigned char *BoardContent::ink_at(pixel_coord x, pixel_coord y, bool create){
+	std::vector<unsigned char> &tile = ink[x / INK_TILE + (y / INK_TILE) * ink_tiles_x];
+	if(tile.empty()){
+		if(!create){ return NULL; }
+		tile.assign(4*INK_TILE*INK_TILE, 0);
+	}
+	return &tile[4*(x % INK_TILE + (y % INK_TILE) * INK_TILE)];
+}
+
+void BoardContent::clear_ink(const Region &r){
+	for(pixel_coord ty = r.y / INK_TILE; ty <= (r.y + r.h - 1) / INK_TILE; ++ty){
+		for(pixel_coord tx = r.x / INK_TILE; tx <= (r.x + r.w - 1) / INK_TILE; ++tx){
+			std::vector<unsigned char> &tile = ink[tx + ty * ink_tiles_x];
+			if(tile.empty()){ continue; }
+			const pixel_coord x0 = std::max(r.x, tx * INK_TILE), x1 = std::min(r.x + r.w, (tx+1) * INK_TILE);
+			const pixel_coord y0 = std::max(r.y, ty * INK_TILE), y1 = std::min(r.y + r.h, (ty+1) * INK_TILE);
+			if(x1 - x0 == INK_TILE && y1 - y0 == INK_TILE){
+				std::vector<unsigned char>().swap(tile);
+				continue;
+			}
+			for(pixel_coord y = y0; y < y1; ++y){
+				memset(&tile[4*(x0 % INK_TILE + (y % INK_TILE) * INK_TILE)], 0, 4*(x1 - x0));
+			}
+		}
+	}
+}
+
+void BoardContent::composite(const Region &r){
+	static const unsigned char no_ink[4*INK_TILE] = { 0 };
+	const pixel_coord x0 = std::max(r.x, drawable_region.x);
+	const pixel_coord x1 = std::min(r.x + r.w, drawable_region.x + drawable_region.w) - 1;
+	const pixel_coord y0 = std::max(r.y, drawable_region.y);
+	const pixel_coord y1 = std::min(r.y + r.h, drawable_region.y + drawable_region.h) - 1;
+	for(pixel_coord y = y0; y <= y1; ++y){
+		for(pixel_coord x = x0; x <= x1; ){
+			const pixel_coord end = std::min(x1, x - x % INK_TILE + INK_TILE-1);
+			const unsigned char *src = ink_at(x, y, false);
+			const size_t k = x + (size_t)y * width;
+			if(4 == PIXEL_BYTES){
+				PixelOps::composite_rgbx(&image[4*k], &background[3*k], src ? src : no_ink, end - x + 1, &changed[k]);
+			}else{
+				PixelOps::composite_rgb(&image[3*k], &background[3*k], src ? src : no_ink, end - x + 1, &changed[k]);
+			}
+			x = end + 1;
+		}
+	}
+}
+
+void BoardContent::update_dirty(){
+	if(dirty.empty()){ return; }
+	std::vector<BoardContent::Region> rects;
+	dirty.take(rects);
+	for(size_t i = 0; i < rects.size(); ++i){
+		composite(rects[i]);
+	}
+	on_image_update_list(rects);
 }
 
 // Drawing/Pen commands
@@ -127,35 +844,182 @@ void BoardContent::pen_get_color(PenColor &rgb) {
 void BoardContent::pen_set_size(float d) {
 	pen.width = d;
 }
+void BoardContent::pen_set_antialias(bool enable) {
+	pen.antialias = enable;
+}
+void BoardContent::pen_set_eraser(bool enable) {
+	flush_pen();
+	pen.eraser = enable;
+}
+void BoardContent::pen_set_fill(bool enable) {
+	flush_pen();
+	pen.fill = enable;
+	pen.filled = false;
+}
+void BoardContent::pen_set_fill_tolerance(unsigned tolerance) {
+	pen.fill_tolerance = std::min(tolerance, 255u);
+}
+void BoardContent::pen_set_smoothing(float amount) {
+	pen.smoothing = std::min(std::max(amount, 0.f), 0.95f);
+}
+void BoardContent::pen_set_deferred(bool enable) {
+	pen.deferred = enable;
+	if(!enable){ flush_pen(); }
+}
+void BoardContent::flush_pen() {
+	const unsigned npoints = pending.size() / 2;
+	if(npoints < 2){
+		pending.clear();
+		return;
+	}
+	init_layers();
+	dirty.resize(width, height);
+	// Everything each segment can reach, soft edge included
+	const pixel_coord pad = (pixel_coord)(0.5f * pen.width) + 2;
+	for(unsigned i = 0; i + 1 < npoints; ++i){
+		const pixel_coord *xy = &pending[2*i];
+		history.save(*this,
+			std::min(xy[0], xy[2]) - pad, std::min(xy[1], xy[3]) - pad,
+			std::max(xy[0], xy[2]) + pad, std::max(xy[1], xy[3]) + pad
+		);
+	}
+	draw_polyline(&pending[0], npoints, &dirty, pen.joined ? pen.stroke_prev : NULL);
+	pen.stroke_prev[0] = pending[2*npoints - 4];
+	pen.stroke_prev[1] = pending[2*npoints - 3];
+	pen.joined = true;
+	pending.clear();
+	update_dirty();
+}
 void BoardContent::pen_down(pixel_coord x, pixel_coord y) {
+	if(pen.fill){
+		// Once per press, however often gui_input repeats it
+		if(!pen.filled){
+			pen.filled = true;
+			fill(x, y);
+		}
+		return;
+	}
+	// Likewise, the stroke only starts once
+	if(pen.down){ return; }
+	flush_pen();
+	history.commit();
 	pen.down = true;
+	pen.joined = false;
 }
 void BoardContent::pen_move(pixel_coord x, pixel_coord y) {
 	if(!drawable_region.contains(x, y)){ return; }
+	if(pen.down && pen.smoothing > 0.f){
+		if(!pen.joined && pending.empty()){
+			pen.smoothed[0] = pen.cursor_prev[0];
+			pen.smoothed[1] = pen.cursor_prev[1];
+		}
+		const float a = 1.f - pen.smoothing;
+		pen.smoothed[0] += a * (x - pen.smoothed[0]);
+		pen.smoothed[1] += a * (y - pen.smoothed[1]);
+		x = (pixel_coord)floorf(pen.smoothed[0] + 0.5f);
+		y = (pixel_coord)floorf(pen.smoothed[1] + 0.5f);
+	}
 	if (pen.down && (x != pen.cursor_prev[0] || y != pen.cursor_prev[1])){
-		BoardContent::Region touched(width, height, -width, -height);
-		draw_line(pen.cursor_prev[0], pen.cursor_prev[1], x, y, &touched);
-		if(touched.w > 0 && touched.h > 0){
-			on_image_update(&touched);
+		if(pending.empty()){
+			pending.push_back(pen.cursor_prev[0]);
+			pending.push_back(pen.cursor_prev[1]);
 		}
+		pending.push_back(x);
+		pending.push_back(y);
+		if(!pen.deferred){ flush_pen(); }
 	}
 	pen.cursor_prev[0] = x;
 	pen.cursor_prev[1] = y;
 }
 void BoardContent::pen_up(int x, int y) {
+	if(pen.down && pen.smoothing > 0.f && drawable_region.contains(x, y) && (x != pen.cursor_prev[0] || y != pen.cursor_prev[1])){
+		// Smoothing lags behind, so finish where the pen came up
+		if(pending.empty()){
+			pending.push_back(pen.cursor_prev[0]);
+			pending.push_back(pen.cursor_prev[1]);
+		}
+		pending.push_back(x);
+		pending.push_back(y);
+		pen.cursor_prev[0] = x;
+		pen.cursor_prev[1] = y;
+	}
+	flush_pen();
+	history.commit();
 	pen.down = false;
+	pen.joined = false;
+	pen.filled = false;
 }
 void BoardContent::clear(const PenColor &color) {
-	for (int j = 0; j < (int)drawable_region.h; ++j) {
-		int jy = drawable_region.y + j;
-		for (int i = 0; i < (int)drawable_region.w; ++i) {
-			int ix = drawable_region.x + i;
-			image[3 * (ix + jy * width) + 0] = 255*color[0];
-			image[3 * (ix + jy * width) + 1] = 255*color[1];
-			image[3 * (ix + jy * width) + 2] = 255*color[2];
+	const unsigned char rgb[3] = {
+		(unsigned char)(255 * color[0]),
+		(unsigned char)(255 * color[1]),
+		(unsigned char)(255 * color[2])
+	};
+	const BoardContent::Region &r = drawable_region;
+	init_layers();
+	history.commit();
+	history.save(*this, r.x, r.y, r.x + r.w - 1, r.y + r.h - 1);
+	PixelOps::fill_rect_rgb(&background[3 * (r.x + r.y * width)], 3 * (size_t)width, r.w, r.h, rgb);
+	clear_ink(r);
+	composite(r);
+	history.commit();
+	on_image_update(NULL);
+}
+
+void BoardContent::fill(pixel_coord x, pixel_coord y) {
+	if(!drawable_region.contains(x, y)){ return; }
+	flush_pen();
+	init_layers();
+	const BoardContent::Region &d = drawable_region;
+	std::vector<FloodFill::Span> spans;
+	FloodFill::find(&image[PIXEL_BYTES * (d.x + (size_t)d.y * width)], PIXEL_BYTES, width, d.w, d.h, x - d.x, y - d.y, pen.fill_tolerance, spans);
+	pixel_coord x0 = x, y0 = y, x1 = x, y1 = y;
+	for(size_t i = 0; i < spans.size(); ++i){
+		x0 = std::min(x0, d.x + (pixel_coord)spans[i].x0);
+		x1 = std::max(x1, d.x + (pixel_coord)spans[i].x1);
+		y0 = std::min(y0, d.y + (pixel_coord)spans[i].y);
+		y1 = std::max(y1, d.y + (pixel_coord)spans[i].y);
+	}
+	const unsigned char rgba[4] = {
+		(unsigned char)(255 * pen.color[0]),
+		(unsigned char)(255 * pen.color[1]),
+		(unsigned char)(255 * pen.color[2]),
+		255
+	};
+	history.commit();
+	history.save(*this, x0, y0, x1, y1);
+	for(size_t i = 0; i < spans.size(); ++i){
+		const pixel_coord sy = d.y + spans[i].y, sx1 = d.x + spans[i].x1;
+		for(pixel_coord sx = d.x + spans[i].x0; sx <= sx1; ){
+			const pixel_coord end = std::min(sx1, sx - sx % INK_TILE + INK_TILE-1);
+			fill_rgba(ink_at(sx, sy, true), end - sx + 1, rgba);
+			sx = end + 1;
 		}
 	}
-	on_image_update(NULL);
+	history.commit();
+	const BoardContent::Region r(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+	composite(r);
+	on_image_fill(r, x, y, rgba, pen.fill_tolerance);
+}
+
+bool BoardContent::undo(){
+	flush_pen();
+	history.commit();
+	init_layers();
+	dirty.resize(width, height);
+	if(!history.undo(*this, &dirty)){ return false; }
+	update_dirty();
+	return true;
+}
+
+bool BoardContent::redo(){
+	flush_pen();
+	history.commit();
+	init_layers();
+	dirty.resize(width, height);
+	if(!history.redo(*this, &dirty)){ return false; }
+	update_dirty();
+	return true;
 }
 
 void BoardContent::get_pen_state(PenColor &color, float &width){
@@ -168,11 +1032,57 @@ void BoardContent::get_size(unsigned int &width_, unsigned int &height_) const{
 	height_ = height;
 }
 
+// Converts one row of a pasted image to RGB. The usual layouts have their
+// own kernels; anything else takes the first bytes of each pixel.
+static void paste_row(unsigned char *dst, const unsigned char *src, unsigned n, unsigned format, unsigned bpp){
+	if(BoardContent::PASTE_FORMAT_BW == format){
+		if(1 == bpp){
+			PixelOps::rgb_from_gray(dst, src, n);
+			return;
+		}
+		for(unsigned i = 0; i < n; ++i){
+			dst[0] = dst[1] = dst[2] = *src;
+			dst += 3;
+			src += bpp;
+		}
+	}else if(BoardContent::PASTE_FORMAT_BGR == format){
+		if(3 == bpp){
+			PixelOps::rgb_from_bgr(dst, src, n);
+		}else if(4 == bpp){
+			PixelOps::rgb_from_bgrx(dst, src, n);
+		}else{
+			for(unsigned i = 0; i < n; ++i){
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+				dst += 3;
+				src += bpp;
+			}
+		}
+	}else{
+		if(3 == bpp){
+			memcpy(dst, src, 3*(size_t)n);
+		}else if(4 == bpp){
+			PixelOps::rgb_from_rgbx(dst, src, n);
+		}else{
+			for(unsigned i = 0; i < n; ++i){
+				dst[0] = src[0];
+				dst[1] = src[1];
+				dst[2] = src[2];
+				dst += 3;
+				src += bpp;
+			}
+		}
+	}
+}
+
 void BoardContent::paste_image(
 	unsigned int location_flags, unsigned int format,
 	const unsigned char *img, unsigned row_stride_bytes, unsigned bytes_per_pixel,
 	unsigned imgwidth, unsigned imgheight
 ){
+	const unsigned min_bpp = (PASTE_FORMAT_BW == format ? 1 : 3);
+	if(bytes_per_pixel < min_bpp){ return; }
 	BoardContent::Region src(0, 0, imgwidth, imgheight);
 	BoardContent::Region dst(drawable_region);
 	if(src.w > dst.w){
@@ -185,13 +1095,13 @@ void BoardContent::paste_image(
 			src.x = (imgwidth - dst.w) / 2;
 		}
 	}else{
-		dst.w = src.h;
+		dst.w = src.w;
 		if(location_flags & PASTE_LOC_LEFT){
 			// do nothing
 		}else if(location_flags & PASTE_LOC_RIGHT){
-			dst.x = src.w - dst.w;
+			dst.x += drawable_region.w - dst.w;
 		}else{ // centered
-			dst.x = (src.w - dst.w) / 2;
+			dst.x += (drawable_region.w - dst.w) / 2;
 		}
 	}
 	if(src.h > dst.h){
@@ -208,25 +1118,62 @@ void BoardContent::paste_image(
 		if(location_flags & PASTE_LOC_TOP){
 			// do nothing
 		}else if(location_flags & PASTE_LOC_BOTTOM){
-			dst.y = src.h - dst.h;
+			dst.y += drawable_region.h - dst.h;
 		}else{ // centered
-			dst.y = (src.h - dst.h) / 2;
+			dst.y += (drawable_region.h - dst.h) / 2;
 		}
 	}
 	
-	unsigned dststride = width;
+	init_layers();
+	history.commit();
+	history.save(*this, dst.x, dst.y, dst.x + dst.w - 1, dst.y + dst.h - 1);
 	for(unsigned int j = 0; j < src.h; ++j){
-		if(3 == bytes_per_pixel && PASTE_FORMAT_RGBA == format){
-			memcpy(&image[3*(dst.x+(dst.y+j)*dststride)], &img[3*src.x+(src.y+j)*row_stride_bytes], 3*src.w);
-		}else{
-			for(unsigned int i = 0; i < src.w; ++i){
-				for(unsigned k = 0; k < 3; ++k){
-					image[3*(dst.x+i+(dst.y+j)*dststride)+k] = img[bytes_per_pixel*(src.x+i+(src.y+j)*row_stride_bytes)+k];
-				}
-			}
-		}
+		const size_t k = dst.x+(dst.y+j)*(size_t)width;
+		paste_row(
+			&background[3*k],
+			img + (size_t)(src.y+j)*row_stride_bytes + (size_t)src.x*bytes_per_pixel,
+			src.w, format, bytes_per_pixel
+		);
+		rgb_to_image(&image[PIXEL_BYTES*k], &background[3*k], src.w);
 	}
+	clear_ink(dst);
+	history.commit();
 	on_image_update(&dst);
+	// Sending may have replaced the pixels with their lossy version
+	flatten(dst);
+}
+
+void BoardContent::image_replaced(const Region &r, const unsigned char *written){
+	init_layers();
+	history.forget(r.x, r.y, r.x + r.w - 1, r.y + r.h - 1, written);
+	flatten(r, written);
+}
+
+void BoardContent::flatten(const Region &r, const unsigned char *written){
+	const pixel_coord x0 = std::max(r.x, 0), x1 = std::min(r.x + r.w, (pixel_coord)width);
+	const pixel_coord y0 = std::max(r.y, 0), y1 = std::min(r.y + r.h, (pixel_coord)height);
+	if(x0 >= x1 || y0 >= y1){ return; }
+	if(!written){
+		for(pixel_coord y = y0; y < y1; ++y){
+			const size_t k = x0 + (size_t)y*width;
+			rgb_from_image(&background[3*k], &image[PIXEL_BYTES*k], x1 - x0);
+		}
+		clear_ink(Region(x0, y0, x1 - x0, y1 - y0));
+		return;
+	}
+	// Ink the update did not reach stays, so runs of written pixels at a time
+	for(pixel_coord y = y0; y < y1; ++y){
+		const unsigned char *row = written + (x0 - r.x) + (size_t)(y - r.y)*r.w;
+		for(pixel_coord x = x0; x < x1; ){
+			if(!row[x - x0]){ ++x; continue; }
+			pixel_coord end = x + 1;
+			while(end < x1 && row[end - x0]){ ++end; }
+			const size_t k = x + (size_t)y*width;
+			rgb_from_image(&background[3*k], &image[PIXEL_BYTES*k], end - x);
+			clear_ink(Region(x, y, end - x, 1));
+			x = end;
+		}
+	}
 }
 
 
@@ -269,38 +1216,71 @@ static void draw_button_color(unsigned char *img, unsigned stride, unsigned widt
 		}
 	}
 }
-static void draw_button_img(unsigned char *img, unsigned stride, unsigned width, unsigned height, const char *filename) {
-	unsigned char *icon = NULL;
-	unsigned error;
+// The sidebar icons, decoded to RGB once for the whole process
+struct GuiIcon{
 	unsigned w, h;
-	error = lodepng_decode32_file(&icon, &w, &h, filename);
-	if (error) {
-		//ML_LOG_TAG(Debug, APP_TAG, "lodepng error %u: %s, %s", error, lodepng_error_text(error), filename);
-		return;
-	}
-	for (int j = 0; j < height; ++j) {
-		for (int i = 0; i < width; ++i) {
-			for (int k = 0; k < 3; ++k) {
-				img[3 * (i + j * stride) + k] = icon[4*(i+j*w)+k];
+	std::vector<unsigned char> rgb;
+};
+enum{ ICON_MOVE, ICON_BRUSH1, ICON_BRUSH2, ICON_BRUSH3, ICON_CLEAR_BLACK, ICON_CLEAR_WHITE, NUM_ICONS };
+struct GuiIcons{
+	GuiIcon icon[NUM_ICONS];
+	GuiIcons(){
+		static const char *files[NUM_ICONS] = {
+			"data/moveb.png", "data/brush1.png", "data/brush2.png", "data/brush3.png",
+			"data/clearb.png", "data/clearw.png"
+		};
+		for(int k = 0; k < NUM_ICONS; ++k){
+			unsigned char *rgba = NULL;
+			GuiIcon &ic = icon[k];
+			unsigned error = lodepng_decode32_file(&rgba, &ic.w, &ic.h, files[k]);
+			if(error){
+				//ML_LOG_TAG(Debug, APP_TAG, "lodepng error %u: %s, %s", error, lodepng_error_text(error), files[k]);
+				ic.w = ic.h = 0;
+			}else{
+				ic.rgb.resize(3*(size_t)ic.w*ic.h);
+				PixelOps::rgb_from_rgbx(&ic.rgb[0], rgba, (size_t)ic.w*ic.h);
 			}
+			free(rgba);
 		}
 	}
-	free(icon);
+};
+static const GuiIcons &gui_icons(){
+	static const GuiIcons icons; // C++11 makes the first call thread safe
+	return icons;
+}
+
+static void draw_button_img(unsigned char *img, unsigned stride, unsigned width, unsigned height, int which) {
+	const GuiIcon &icon = gui_icons().icon[which];
+	const unsigned w = std::min(width, icon.w);
+	const unsigned h = std::min(height, icon.h);
+	for (unsigned j = 0; j < h; ++j) {
+		memcpy(&img[3 * (j * stride)], &icon.rgb[3 * (j * icon.w)], 3 * w);
+	}
 }
 
 void BoardContent::draw_gui(unsigned char *img, unsigned stride, unsigned width, unsigned height) {
-	int i = 0;
-	draw_button_img(&img[3 * (64 * i*stride)], stride, width, width, "data/moveb.png"); ++i;
-	draw_button_img(&img[3 * (64 * i*stride)], stride, width, width, "data/brush1.png"); ++i;
-	draw_button_img(&img[3 * (64 * i*stride)], stride, width, width, "data/brush2.png"); ++i;
-	draw_button_img(&img[3 * (64 * i*stride)], stride, width, width, "data/brush3.png"); ++i;
-	for (int j = 0; j < color_palette.size(); ++j, ++i) {
-		draw_button_color(&img[3 * (64 * i*stride)], stride, width, width, color_palette[j]);
-	}
-	draw_button_img(&img[3 * (64 * i * stride)], stride, width, width, "data/clearb.png"); ++i;
-	draw_button_img(&img[3 * (64 * i * stride)], stride, width, width, "data/clearw.png");
-	for (int i = 0; i < 16; ++i) {
-		draw_button_border(&img[3 * (64 * i*stride)], stride, width, width);
+	// 16 buttons, stacked
+	const unsigned strip_height = 16 * width;
+	if (gui_strip.size() != 3 * (size_t)width * strip_height) {
+		gui_strip.assign(3 * (size_t)width * strip_height, 0);
+		unsigned char *strip = &gui_strip[0];
+		int i = 0;
+		draw_button_img(&strip[3 * (64 * i*width)], width, width, width, ICON_MOVE); ++i;
+		draw_button_img(&strip[3 * (64 * i*width)], width, width, width, ICON_BRUSH1); ++i;
+		draw_button_img(&strip[3 * (64 * i*width)], width, width, width, ICON_BRUSH2); ++i;
+		draw_button_img(&strip[3 * (64 * i*width)], width, width, width, ICON_BRUSH3); ++i;
+		for (int j = 0; j < color_palette.size(); ++j, ++i) {
+			draw_button_color(&strip[3 * (64 * i*width)], width, width, width, color_palette[j]);
+		}
+		draw_button_img(&strip[3 * (64 * i * width)], width, width, width, ICON_CLEAR_BLACK); ++i;
+		draw_button_img(&strip[3 * (64 * i * width)], width, width, width, ICON_CLEAR_WHITE);
+		for (int i = 0; i < 16; ++i) {
+			draw_button_border(&strip[3 * (64 * i*width)], width, width, width);
+		}
+	}
+	const unsigned rows = std::min(height, strip_height);
+	for (unsigned j = 0; j < rows; ++j) {
+		rgb_to_image(&img[PIXEL_BYTES * (j * stride)], &gui_strip[3 * (j * width)], width);
 	}
 }
 void BoardContent::gui_click(int i) {
@@ -1,7 +1,11 @@
 #ifndef BOARD_CONTENT_H_INCLUDED
 #define BOARD_CONTENT_H_INCLUDED
 
+#include <deque>
+#include <memory>
 #include <vector>
+#include <cstddef>
+#include "JobQueue.h"
 
 class BoardContent{
 public:
@@ -23,6 +27,102 @@ public:
 		void expand_to_include(int tx, int ty);
 		bool contains(int tx, int ty) const;
 	};
+	// Collects what drawing touches as a tight box per 32x32 tile, and
+	// hands it out as a few rectangles that cover little else.
+	class DirtyTiles{
+		struct Box{
+			pixel_coord x0, y0, x1, y1; // x0 > x1 while empty
+		};
+		std::vector<Box> boxes;
+		std::vector<unsigned> touched; // tiles whose box is not empty
+		unsigned width, height, tiles_x;
+	public:
+		enum{ TILE = 32 };
+		DirtyTiles();
+		void resize(unsigned width, unsigned height);
+		void add_span(pixel_coord x0, pixel_coord x1, pixel_coord y);
+		bool empty() const{ return touched.empty(); }
+		// Appends the merged rectangles to rects and starts over empty.
+		void take(std::vector<Region> &rects);
+	};
+	// Undo and redo steps, each holding the fastlz-compressed layers of
+	// only the 64x64 tiles that one operation changed. Stepping back or
+	// forward swaps those tiles with the board's. Past a memory budget the
+	// oldest steps are dropped.
+	class History{
+		// A tile's layers as they were copied, until the worker has
+		// compressed them into packed. Its job's completion swaps them
+		// over, so nothing has to look for the tiles a job has done.
+		struct Layers{
+			std::vector<unsigned char> bytes, packed;
+			bool compressed; // bytes are gone, and packed holds them
+			bool dropped; // no step has them any more
+			Layers():compressed(false), dropped(false){}
+			size_t size() const{ return sizeof(Layers) + (compressed ? packed.capacity() : bytes.capacity()); }
+		};
+		struct Tile{
+			unsigned index;
+			std::shared_ptr<Layers> layers;
+		};
+		struct Step{
+			std::vector<Tile> tiles;
+		};
+		std::deque<Step> undo_steps, redo_steps;
+		Step open; // the operation in progress
+		std::vector<unsigned char> saved; // tiles in open, by index
+		size_t budget, used, waiting; // waiting: bytes of tiles not compressed yet
+		unsigned width, height, tiles_x, tiles_y;
+		std::vector<unsigned char> unpacked; // a tile after decompression
+		std::vector<unsigned char> stale; // tiles for forget(), by index
+		// Compresses the copies off the calling thread, so saving a tile
+		// costs a copy and operations on the whole board stay quick.
+		JobQueue jobs;
+
+		void copy(const BoardContent &board, unsigned index, std::vector<unsigned char> &bytes);
+		void compress_later(const Step &step);
+		// Runs the completions of finished jobs
+		void collect();
+		// Waits for the worker if it falls a whole budget behind
+		void keep_up();
+		// Takes a tile of an undo or redo step out of the counts
+		void drop(Tile &tile);
+		void trim();
+		bool swap(std::deque<Step> &from, std::deque<Step> &to, BoardContent &board, DirtyTiles *touched);
+	public:
+		enum{ TILE = 64 };
+		History();
+		// Bytes of undo and redo data to keep, per board
+		void set_budget(size_t bytes);
+		// Forgets every step, as when the image is replaced
+		void clear();
+		// Keeps the tiles overlapping x0..x1, y0..y1, as they are before the
+		// operation in progress changes them. Forgets everything if the
+		// board size changed.
+		void save(const BoardContent &board, pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1);
+		// Ends the operation in progress, which becomes the one undo()
+		// reverts, and drops the redo steps.
+		void commit();
+		// The tiles overlapping x0..x1, y0..y1 were overwritten from
+		// outside. Drops them from every step, so undo and redo leave
+		// them as they now are. With written, a byte per pixel of the
+		// rectangle, only the tiles with a pixel that is not 0 go.
+		void forget(pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1, const unsigned char *written = NULL);
+		// Revert or repeat the last step, leaving the image to be
+		// composited again. Return false if there is none.
+		bool undo(BoardContent &board, DirtyTiles *touched);
+		bool redo(BoardContent &board, DirtyTiles *touched);
+		size_t memory_used() const{ return used; }
+	};
+
+	// Bytes per pixel of image: packed RGB, or RGBX when built with
+	// BOARD_RGBX, which keeps every pixel aligned and lets textures be
+	// uploaded as GL_RGBA without a conversion in the driver. The layers
+	// and everything sent over the network stay RGB.
+#ifdef BOARD_RGBX
+	enum{ PIXEL_BYTES = 4 };
+#else
+	enum{ PIXEL_BYTES = 3 };
+#endif
 
 	BoardContent();
 	~BoardContent();
@@ -31,10 +131,31 @@ public:
 	void pen_set_color(const PenColor &color);
 	void pen_get_color(PenColor &color);
 	void pen_set_size(float d); // diameter of pen
+	void pen_set_antialias(bool enable); // soft edged strokes
+	void pen_set_eraser(bool enable); // takes ink away, down to the background
+	void pen_set_fill(bool enable); // pen_down fills the area it lands in
+	void pen_set_fill_tolerance(unsigned tolerance); // 0 to 255, per channel
+	// 0 draws every sample where it is. Up to 1, each sample only pulls the
+	// stroke part of the way towards it, which evens out a shaky hand.
+	void pen_set_smoothing(float amount);
+	// When deferred, pen_move only collects samples, and flush_pen draws
+	// them as one polyline and reports everything it touched in a single
+	// on_image_update_list call. Meant for clients that get many input
+	// events per frame and flush once a frame.
+	void pen_set_deferred(bool enable);
+	void flush_pen();
 	void pen_down(pixel_coord x, pixel_coord y);
 	void pen_move(pixel_coord x, pixel_coord y);
 	void pen_up(pixel_coord x, pixel_coord y);
 	void clear(const PenColor &color);
+	// Fills the pixels joined to (x, y) whose colour is within the fill
+	// tolerance of its own with the pen colour, as ink.
+	void fill(pixel_coord x, pixel_coord y);
+	// Step back over the last stroke, clear or paste made on this board,
+	// or forward again. The pixels go out through on_image_update_list
+	// like any other change. Return false if there was nothing to do.
+	bool undo();
+	bool redo();
 
 	void get_pen_state(PenColor &color, float &width);
 	
@@ -46,16 +167,27 @@ public:
 		PASTE_LOC_TOP      = 0x04,
 		PASTE_LOC_BOTTOM   = 0x08
 	};
+	// Channel order of pasted pixels. bytes_per_pixel may be larger than
+	// the number of channels, as with alpha, and the extra bytes are skipped.
 	enum PasteFormat{
 		PASTE_FORMAT_RGBA    = 0x00,
 		PASTE_FORMAT_BGR     = 0x01,
 		PASTE_FORMAT_BW      = 0x02
 	};
+	// Pasted images go into the background, and take the ink above them
+	// with them.
 	void paste_image(
 		unsigned int location_flags, unsigned int format,
 		const unsigned char *img, unsigned row_stride_bytes, unsigned bytes_per_pixel,
 		unsigned width, unsigned height
 	);
+	// The pixels of image in r were written from outside, as by an update
+	// from the server. They become background, and the ink there goes,
+	// as do the undo steps for them. Also call it for the whole board
+	// after resizing image. If only some of them were written, as by a
+	// sparse update or a fill, written has a byte per pixel of r, not 0
+	// for those; see ImageCoder::decode.
+	void image_replaced(const Region &r, const unsigned char *written = NULL);
 	
 	void draw_gui(unsigned char *img, unsigned stride, unsigned width, unsigned height);
 	void redraw_gui();
@@ -63,7 +195,7 @@ public:
 	virtual void gui_input(bool pressed, int x, int y);
 public:
 	unsigned int width, height;
-	std::vector<unsigned char> image; // size 3*width*height
+	std::vector<unsigned char> image; // size PIXEL_BYTES*width*height
 	float width_height; // width/height
 	Region drawable_region;
 	bool moving;
@@ -73,23 +205,88 @@ public:
 		float width;
 		int cursor_prev[2];
 		bool down;
+		bool antialias;
+		// Start of the last segment drawn, while the stroke goes on from it
+		int stroke_prev[2];
+		bool joined;
+		bool deferred;
+		bool eraser;
+		bool fill; // pen_down fills instead of drawing
+		bool filled; // the fill for this press is done
+		unsigned fill_tolerance;
+		float smoothing;
+		float smoothed[2]; // where smoothing has got to
 		PenState():
 			color(0,0,0),
 			width(5.f),
-			down(false)
+			down(false),
+			antialias(false),
+			joined(false),
+			deferred(false),
+			eraser(false),
+			fill(false),
+			filled(false),
+			fill_tolerance(32),
+			smoothing(0.f)
 		{
 			cursor_prev[0] = 0;
 			cursor_prev[1] = 0;
+			stroke_prev[0] = 0;
+			stroke_prev[1] = 0;
 		}
 	};
 	PenState pen;
 
 	std::vector<PenColor> color_palette;
+	// The sidebar as draw_gui last drew it; clear it after changing the palette
+	std::vector<unsigned char> gui_strip;
+
+	DirtyTiles dirty; // for pen_move
+	std::vector<pixel_coord> pending; // stroke points not drawn yet, as x, y pairs
+	History history;
+
+	// The image is the background with the ink drawn over it. Ink is
+	// premultiplied RGBA, kept only for the tiles that were drawn on, so
+	// strokes over a pasted photo cost little and can be taken back off.
+	enum{ INK_TILE = 64 };
+	std::vector<unsigned char> background; // 3*width*height, like image
+	std::vector<std::vector<unsigned char> > ink; // one per tile, empty where there is none
+	unsigned ink_tiles_x;
+	// A byte per pixel, 1 where composite last changed the image. Valid
+	// within the rectangles passed to on_image_update_list.
+	std::vector<unsigned char> changed;
 
-	void draw_line(pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1, Region *touched);
-	void paint(pixel_coord x, pixel_coord y, Region *touched);
-	void set_pixel(pixel_coord x, pixel_coord y, float val, Region *touched);
+	void draw_line(pixel_coord x0, pixel_coord y0, pixel_coord x1, pixel_coord y1, DirtyTiles *touched);
+	// Strokes the line through npoints (x, y) pairs with the pen, with
+	// round ends and joins. Each covered pixel is written once. If the
+	// stroke carries on from an already drawn segment that ends at xy,
+	// before is its start, so anti-aliased edges are not blended twice.
+	void draw_polyline(const pixel_coord *xy, unsigned npoints, DirtyTiles *touched, const pixel_coord *before = NULL);
+	void draw_polyline_aa(const pixel_coord *xy, unsigned npoints, DirtyTiles *touched, const pixel_coord *before);
+	void paint(pixel_coord x, pixel_coord y, DirtyTiles *touched);
+	void fill_span(pixel_coord x0, pixel_coord x1, pixel_coord y, DirtyTiles *touched);
+	void set_pixel(pixel_coord x, pixel_coord y, float val, DirtyTiles *touched);
+	// Sets up the layers from the image when they do not match its size
+	void init_layers();
+	// The ink of pixel (x, y), within its tile's rows of 4*INK_TILE bytes.
+	// NULL if the tile has no ink and create is false.
+	unsigned char *ink_at(pixel_coord x, pixel_coord y, bool create);
+	void clear_ink(const Region &r);
+	// Takes the image within r as background, without ink, and leaves
+	// the history alone. written is as for image_replaced.
+	void flatten(const Region &r, const unsigned char *written = NULL);
+	// Recomputes the image from the layers within r
+	void composite(const Region &r);
+	// Composites what dirty holds and passes it to on_image_update_list
+	void update_dirty();
 	virtual void on_image_update(Region *touched = NULL){}
+	// Several separate rectangles changed. By default each one is passed
+	// to on_image_update in turn.
+	virtual void on_image_update_list(const std::vector<Region> &touched);
+	// fill(x, y) changed the pixels within r to rgb. By default r goes to
+	// on_image_update_list; a client can send the fill itself instead,
+	// for the others to repeat.
+	virtual void on_image_fill(const Region &r, pixel_coord x, pixel_coord y, const unsigned char rgb[3], unsigned tolerance);
 };
 
 #endif // BOARD_CONTENT_H_INCLUDED
@@ -24,12 +24,24 @@ struct BoardMessage{
 		BOARD_GET_SIZE      = 0x0020, // sent by client to query size of a board
 		BOARD_SIZE          = 0x0021, // sent by server in response to BOARD_GET_SIZE
 		BOARD_GET_CONTENTS  = 0x0022, // sent by client to get board contents, server response is BOARD_UPDATED
+		BOARD_GET_SNAPSHOT  = 0x0023, // sent by client to get a PNG of a board, optionally x, y, w, h of a region
+		BOARD_SNAPSHOT      = 0x0024, // server response to BOARD_GET_SNAPSHOT: w, h, x, y, then the PNG file
 		
 		BOARD_UPDATE        = 0x0030, // sent by client to update a board
 		BOARD_UPDATED       = 0x0031, // server broadcast to send board updates
 		
 		INVALID = 0x0000
 	};
+	enum{
+		// Set on the type of a message whose payload is a block of the
+		// sending connection's compression stream
+		TYPE_COMPRESSED = 0x8000
+	};
+	// Capability mask, sent after the name in HANDSHAKE_CLIENT and as the
+	// payload of HANDSHAKE_SERVER
+	enum Capability{
+		CAP_STREAM_COMPRESSION = 0x0001 // accepts TYPE_COMPRESSED messages
+	};
 
 	// 4 byte header:
 	//   2 byte message type
@@ -1,5 +1,7 @@
 #include "BoardServer.h"
 #include "ImageCoder.h"
+#include "PixelOps.h"
+#include "PngWriter.h"
 #include "Poco/Net/SocketAddress.h"
 #include "Poco/Net/Socket.h"
 #include "Poco/Net/StreamSocket.h"
@@ -37,11 +39,43 @@ static void msgdump(const BoardMessage &msg){
 # define msgdump(MSG) do{}while(0)
 #endif
 
+// Snapshots cached per board, each holding a whole PNG
+static const size_t max_snapshots = 4;
+
+static BoardMessage snapshot_message(unsigned iboard, unsigned x, unsigned y, unsigned w, unsigned h, const std::vector<unsigned char> &png){
+	BoardMessage msg(BoardMessage::BOARD_SNAPSHOT, iboard);
+	if(png.empty()){
+		w = 0;
+		h = 0;
+	}
+	msg.adds(w);
+	msg.adds(h);
+	msg.adds(x);
+	msg.adds(y);
+	if(!png.empty()){
+		msg.addbytes(png);
+	}
+	return msg;
+}
+
+void BoardServer::Connection::enable_compression(){
+	zsend.reset(fastlz_stream_create(), fastlz_stream_destroy);
+}
 
 int BoardServer::Connection::send(const BoardMessage &msg){
 	dbgmsg("Sending:\n");
 	msgdump(msg);
 	
+	if(zsend && msg.size() > 0 && msg.size() <= FASTLZ_STREAM_MAX_BLOCK){
+		BoardMessage packed(msg.type() | BoardMessage::TYPE_COMPRESSED, msg.id());
+		packed.payload.resize(msg.size() + (msg.size()+19)/20 + 66);
+		int sz = fastlz_stream_compress(zsend.get(), &msg.payload[0], msg.size(), &packed.payload[0]);
+		packed.payload.resize(sz);
+		return send_frame(packed);
+	}
+	return send_frame(msg);
+}
+int BoardServer::Connection::send_frame(const BoardMessage &msg){
 	int ret;
 	uint16_t s;
 	uint32_t l;
@@ -56,13 +90,24 @@ int BoardServer::Connection::send(const BoardMessage &msg){
 int BoardServer::Connection::recv(BoardMessage &msg){
 	int p = recvbuf.size();
 	int len = socket.available();
+	bool closed = false;
+	if(len <= 0 && socket.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ)){
+		// Readable, but nothing had arrived when asked. Reading tells
+		// data that came in since from the peer closing its end.
+		len = 4096;
+	}
 	if(len > 0){
 		recvbuf.resize(p + len);
-		socket.receiveBytes(&recvbuf[p], len, 0);
+		const int n = socket.receiveBytes(&recvbuf[p], len, 0);
+		recvbuf.resize(p + (n > 0 ? n : 0));
+		closed = (0 == n);
 	}
 	if(recvbuf.size() >= 8){
 		int expected_size = ntohl(*((uint32_t*)(&recvbuf[4])));
 		if(recvbuf.size() < expected_size){
+			if(closed){
+				throw Poco::Net::ConnectionResetException("Connection closed by peer");
+			}
 			recvbuf.reserve(expected_size);
 			return 0;
 		}
@@ -72,10 +117,35 @@ int BoardServer::Connection::recv(BoardMessage &msg){
 		msg.payload.resize(expected_size-8);
 		memcpy(&msg.payload[0], &recvbuf[8], expected_size-8);
 		recvbuf.erase(recvbuf.begin(), recvbuf.begin()+expected_size);
+		if(msg.type_ & BoardMessage::TYPE_COMPRESSED){
+			msg.type_ &= ~BoardMessage::TYPE_COMPRESSED;
+			if(!zrecv){
+				zrecv.reset(fastlz_stream_create(), fastlz_stream_destroy);
+			}
+			std::vector<unsigned char> packed;
+			packed.swap(msg.payload);
+			msg.payload.resize(FASTLZ_STREAM_MAX_BLOCK);
+			int sz = 0;
+			if(zrecv && packed.size() > 0){
+				sz = fastlz_stream_decompress(zrecv.get(), &packed[0], packed.size(), &msg.payload[0], msg.payload.size());
+			}
+			if(0 == sz){
+				// The windows at the two ends no longer match, so nothing
+				// more can be read from this peer. Shutting the socket down
+				// tells it so at once; whoever owns it closes it.
+				dbgmsg("Corrupt compressed message\n");
+				socket.shutdown();
+				throw Poco::Net::ConnectionResetException("Corrupt compressed message");
+			}
+			msg.payload.resize(sz);
+		}
 		dbgmsg("Received:\n");
 		msgdump(msg);
 		return 1;
 	}
+	if(closed){
+		throw Poco::Net::ConnectionResetException("Connection closed by peer");
+	}
 	return 0;
 }
 bool BoardServer::Connection::can_recv(){
@@ -99,14 +169,16 @@ BoardServer::BoardServer(const char *addr, int port):
 BoardServer::~BoardServer(){
 }
 
-int BoardServer::add_board(unsigned width, unsigned height, const std::string &title){
+int BoardServer::add_board(unsigned width, unsigned height, const std::string &title, const unsigned char *background){
 	int ret = boards.size();
 	boards.push_back(new Board());
 	boards.back()->width = width;
 	boards.back()->height = height;
 	boards.back()->img.resize(3*width*height);
 	boards.back()->title = title;
-	memset(&boards.back()->img[0], 0xff, 3*width*height);
+	boards.back()->version = 0;
+	static const unsigned char white[3] = { 0xff, 0xff, 0xff };
+	PixelOps::fill_rgb(&boards.back()->img[0], (size_t)width*height, NULL != background ? background : white);
 	return ret;
 }
 
@@ -120,6 +192,7 @@ int BoardServer::poll(){
 	}
 	for(size_t iconn = 0; iconn < connections.size(); ++iconn){
 		BoardServer::Connection &conn = connections[iconn];
+		if(conn.dead){ continue; }
 		try{
 			if(conn.can_recv()){
 				BoardMessage msg;
@@ -127,10 +200,13 @@ int BoardServer::poll(){
 					process_message(iconn, msg);
 				}
 			}
-		}catch(Poco::Net::ConnectionResetException cre){
-			// ignore for now
+		}catch(Poco::Exception &e){
+			// Sends to the others do not throw, so this is its own socket
+			conn.dead = true;
 		}
 	}
+	jobs.poll();
+	drop_dead_connections();
 	return 1; // request for continued polling
 }
 
@@ -150,10 +226,117 @@ void BoardServer::get_uri(std::string &uri) const{
 	} 
 }
 
+void BoardServer::drop_dead_connections(){
+	for(size_t iconn = 0; iconn < connections.size(); ){
+		if(!connections[iconn].dead){
+			++iconn;
+			continue;
+		}
+		const std::string id = connections[iconn].id;
+		dbgmsg("Client disconnected: %s", id.c_str());
+		// The peer address may be gone with the peer
+		std::cout << "Client disconnected: " << id << std::endl;
+		connections[iconn].close();
+		connections.erase(connections.begin()+iconn);
+		
+		// Send disconnection announcement. It can find others dead, so
+		// start over.
+		BoardMessage announce(BoardMessage::CLIENT_DISCONNECTED, 0);
+		announce.addstring(id);
+		broadcast(announce, -1);
+		iconn = 0;
+	}
+}
+
+void BoardServer::send_to(size_t iconn, const BoardMessage &msg){
+	try{
+		connections[iconn].send(msg);
+	}catch(Poco::Exception &e){
+		connections[iconn].dead = true;
+	}
+}
+
 void BoardServer::broadcast(const BoardMessage &msg, int iconn_exclude){
 	for(int iconn = 0; iconn < connections.size(); ++iconn){
-		if(iconn == iconn_exclude){ continue; }
-		connections[iconn].send(msg);
+		if(iconn == iconn_exclude || connections[iconn].dead){ continue; }
+		send_to(iconn, msg);
+	}
+}
+
+void BoardServer::request_snapshot(size_t iconn, unsigned iboard, unsigned x, unsigned y, unsigned w, unsigned h){
+	BoardServer::Connection &conn = connections[iconn];
+	Board &board = *boards[iboard];
+	std::list<Snapshot>::iterator it;
+	for(it = board.snapshots.begin(); it != board.snapshots.end(); ++it){
+		if(it->version == board.version && it->x == x && it->y == y && it->w == w && it->h == h){ break; }
+	}
+	if(it != board.snapshots.end()){
+		board.snapshots.splice(board.snapshots.end(), board.snapshots, it);
+		if(it->ready){
+			conn.send(snapshot_message(iboard, x, y, w, h, it->png));
+		}else{
+			it->waiting.push_back(conn.socket);
+		}
+		return;
+	}
+	
+	// Make room by dropping the least recently used finished snapshots.
+	// Ones still encoding stay, their jobs point at them.
+	it = board.snapshots.begin();
+	while(board.snapshots.size() >= max_snapshots && it != board.snapshots.end()){
+		if(it->ready){
+			it = board.snapshots.erase(it);
+		}else{
+			++it;
+		}
+	}
+	board.snapshots.push_back(Snapshot());
+	Snapshot *snap = &board.snapshots.back();
+	snap->x = x;
+	snap->y = y;
+	snap->w = w;
+	snap->h = h;
+	snap->version = board.version;
+	snap->ready = false;
+	snap->waiting.push_back(conn.socket);
+	
+	// Copy the pixels now, the board may change while the job runs
+	std::shared_ptr<std::vector<unsigned char> > rgb(new std::vector<unsigned char>(3*(size_t)w*h));
+	for(unsigned j = 0; j < h; ++j){
+		memcpy(&(*rgb)[3*(size_t)w*j], &board.img[3*(x+(size_t)(y+j)*board.width)], 3*(size_t)w);
+	}
+	jobs.post([this, iboard, snap, rgb, w, h]() -> JobQueue::Completion{
+		std::shared_ptr<std::vector<unsigned char> > png(new std::vector<unsigned char>());
+		if(PngWriter::encode_rgb(*png, &(*rgb)[0], w, h)){
+			png->clear();
+		}
+		return [this, iboard, snap, png](){ finish_snapshot(iboard, snap, *png); };
+	});
+}
+
+void BoardServer::finish_snapshot(unsigned iboard, Snapshot *snap, std::vector<unsigned char> &png){
+	Board &board = *boards[iboard];
+	snap->png.swap(png);
+	snap->ready = true;
+	if(!snap->waiting.empty()){
+		BoardMessage msg = snapshot_message(iboard, snap->x, snap->y, snap->w, snap->h, snap->png);
+		for(size_t i = 0; i < snap->waiting.size(); ++i){
+			for(size_t iconn = 0; iconn < connections.size(); ++iconn){
+				if(connections[iconn].socket == snap->waiting[i] && !connections[iconn].dead){
+					send_to(iconn, msg);
+				}
+			}
+		}
+		snap->waiting.clear();
+	}
+	// Only keep it while it still shows the board as it is
+	if(snap->png.empty() || snap->version != board.version){
+		for(std::list<Snapshot>::iterator it = board.snapshots.begin(); it != board.snapshots.end(); ++it){
+			if(&*it == snap){
+				board.snapshots.erase(it);
+				break;
+			}
+		}
 	}
 }
 
@@ -171,13 +354,21 @@ void BoardServer::process_message(size_t iconn, const BoardMessage &msg){
 			if(len > 256){
 				len = 256;
 			}
+			unsigned caps = 0;
 			{
 				std::string str = msg.getstring(0);
 				conn.id = str.c_str();
+				if(msgsize >= str.size()+3){
+					caps = msg.gets(str.size()+1);
+				}
 			}
 			// Send handshake response
 			BoardMessage resp(BoardMessage::HANDSHAKE_SERVER, 1);
+			resp.adds(BoardMessage::CAP_STREAM_COMPRESSION);
 			conn.send(resp);
+			if(caps & BoardMessage::CAP_STREAM_COMPRESSION){
+				conn.enable_compression();
+			}
 			// Send connection announcement
 			BoardMessage announce(BoardMessage::CLIENT_CONNECTED, 0);
 			announce.addstring(conn.id);
@@ -187,23 +378,17 @@ void BoardServer::process_message(size_t iconn, const BoardMessage &msg){
 		}
 		break;
 	case BoardMessage::CLIENT_DISCONNECT:
-		{
-			dbgmsg("Client disconnected: %s", conn.id.c_str());
-			std::cout << "Client disconnected: " << conn.socket.peerAddress().toString() << std::endl;
-			
-			// Send disconnection announcement
-			BoardMessage announce(BoardMessage::CLIENT_DISCONNECTED, 0);
-			announce.addstring(conn.id);
-			broadcast(announce, iconn);
-			conn.close();
-			connections.erase(connections.begin()+iconn);
-		}
+		conn.dead = true;
 		break;
 	case BoardMessage::ENUMERATE_USERS:
 		{
-			BoardMessage resp(BoardMessage::USER_ENUMERATION, connections.size());
+			unsigned n = 0;
+			for(size_t i = 0; i < connections.size(); ++i){
+				n += !connections[i].dead;
+			}
+			BoardMessage resp(BoardMessage::USER_ENUMERATION, n);
 			for(size_t i = 0; i < connections.size(); ++i){
-				resp.addstring(connections[i].id);
+				if(!connections[i].dead){ resp.addstring(connections[i].id); }
 			}
 			conn.send(resp);
 		}
@@ -257,10 +442,10 @@ void BoardServer::process_message(size_t iconn, const BoardMessage &msg){
 		break;
 	case BoardMessage::BOARD_GET_CONTENTS:
 		{
-			int method = 1;
 			unsigned iboard = msg.id();
 			BoardMessage resp(BoardMessage::BOARD_UPDATED, iboard);
 			if(iboard < boards.size()){
+				int method = ImageCoder::default_method(boards[iboard]->width, boards[iboard]->height);
 				resp.adds(boards[iboard]->width);
 				resp.adds(boards[iboard]->height);
 				resp.adds(0); // x offset
@@ -280,6 +465,29 @@ void BoardServer::process_message(size_t iconn, const BoardMessage &msg){
 			conn.send(resp);
 		}
 		break;
+	case BoardMessage::BOARD_GET_SNAPSHOT:
+		{
+			unsigned iboard = msg.id();
+			if(iboard >= boards.size()){
+				conn.send(snapshot_message(iboard, 0, 0, 0, 0, std::vector<unsigned char>()));
+				return;
+			}
+			const Board &board = *boards[iboard];
+			unsigned x = 0, y = 0, w = 0, h = 0;
+			if(msgsize >= 8){
+				x = msg.gets(0);
+				y = msg.gets(2);
+				w = msg.gets(4);
+				h = msg.gets(6);
+			}
+			// A zero or oversized w or h extends to the edge of the board
+			if(x >= board.width){ x = board.width-1; }
+			if(y >= board.height){ y = board.height-1; }
+			if(0 == w || x + w > board.width){ w = board.width-x; }
+			if(0 == h || y + h > board.height){ h = board.height-y; }
+			request_snapshot(iconn, iboard, x, y, w, h);
+		}
+		break;
 	case BoardMessage::BOARD_UPDATE:
 		{
 			unsigned iboard = msg.id();
@@ -306,6 +514,17 @@ void BoardServer::process_message(size_t iconn, const BoardMessage &msg){
 				&board.img[3*(x+y*board.width)], board.width, w, h
 			);
 			
+			// Cached snapshots are stale now. Those still encoding go
+			// once they have been sent.
+			++board.version;
+			for(std::list<Snapshot>::iterator it = board.snapshots.begin(); it != board.snapshots.end();){
+				if(it->ready){
+					it = board.snapshots.erase(it);
+				}else{
+					++it;
+				}
+			}
+			
 			// Compose response
 			BoardMessage resp(BoardMessage::BOARD_UPDATED, iboard);
 			resp.payload = msg.payload;
@@ -5,7 +5,11 @@
 #include "Poco/Net/ServerSocket.h"
 #include <string>
 #include <vector>
+#include <memory>
+#include <list>
 #include "BoardMessage.h"
+#include "JobQueue.h"
+#include "fastlz.h"
 
 class BoardServer{
 	friend class BoardClient;
@@ -15,30 +19,62 @@ class BoardServer{
 		Poco::Net::StreamSocket socket;
 		std::string id;
 		std::vector<unsigned char> recvbuf;
-		Connection(){}
-		Connection(const Poco::Net::StreamSocket &sock):socket(sock){}
+		// Stream compression state for each direction. zsend is only set
+		// once the peer has said it can take TYPE_COMPRESSED messages;
+		// zrecv is created by the first one that arrives.
+		std::shared_ptr<fastlz_stream> zsend, zrecv;
+		// The peer has gone or asked to leave. The server removes it once
+		// it is through its connections.
+		bool dead;
+		Connection():dead(false){}
+		Connection(const Poco::Net::StreamSocket &sock):socket(sock), dead(false){}
 		int send(const BoardMessage &msg);
 		int recv(BoardMessage &msg);
 		bool can_recv();
 		void close();
+		void enable_compression();
+	private:
+		int send_frame(const BoardMessage &msg);
 	};
 	std::vector<Connection> connections;
 	
+	// PNG of a region of a board, kept until the board changes. While
+	// ready is false the encoding job is still running, and the
+	// connections that asked for it wait in waiting.
+	struct Snapshot{
+		unsigned x, y, w, h;
+		unsigned version; // board version the pixels were taken at
+		bool ready;
+		std::vector<unsigned char> png; // empty if encoding failed
+		std::vector<Poco::Net::StreamSocket> waiting;
+	};
 	struct Board{
 		std::vector<unsigned char> img;
 		unsigned width, height;
 		std::string title;
+		unsigned version; // bumped on every change to img
+		std::list<Snapshot> snapshots; // least recently used first
 	};
 	std::vector<Board*> boards;
 	
+	JobQueue jobs; // snapshot encoding, kept off the polling thread
+	
 	void process_message(size_t iconn, const BoardMessage &msg);
+	// Closes the dead connections and tells the other clients they have gone
+	void drop_dead_connections();
+	// Sends to a connection other than the one being served, marking it
+	// dead if that fails rather than throwing
+	void send_to(size_t iconn, const BoardMessage &msg);
 	void broadcast(const BoardMessage &msg, int iconn_exclude);
+	void request_snapshot(size_t iconn, unsigned iboard, unsigned x, unsigned y, unsigned w, unsigned h);
+	void finish_snapshot(unsigned iboard, Snapshot *snap, std::vector<unsigned char> &png);
 public:
 	BoardServer(int port);
 	BoardServer(const char *addr, int port);
 	~BoardServer();
 	
-	int add_board(unsigned width, unsigned height, const std::string &title);
+	// background is the RGB colour of the new board, white if NULL
+	int add_board(unsigned width, unsigned height, const std::string &title, const unsigned char *background = NULL);
 	int poll(); // returns zero if no further polling should occur
 	
 	void get_uri(std::string &uri) const;
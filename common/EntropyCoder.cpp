@@ -0,0 +1,362 @@
+#include "EntropyCoder.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+static const unsigned max_code_bits = 11;
+static const unsigned table_size = 1 << max_code_bits;
+// Set on decode table entries that no code maps to
+static const uint16_t bad_entry = 0x8000;
+// Huffman payloads are split into this many bitstreams, each holding an
+// equal share of the symbols, so the decoder can interleave them and
+// not wait on one table lookup before it can start the next.
+static const unsigned num_streams = 4;
+
+static void put_varint(unsigned v, std::vector<unsigned char> &buffer){
+	while(v > 127){
+		buffer.push_back(0x80 | (v & 0x7F));
+		v >>= 7;
+	}
+	buffer.push_back(v);
+}
+static bool get_varint(const unsigned char *buffer, unsigned buflen, unsigned &pos, unsigned &v){
+	v = 0;
+	for(unsigned shift = 0; shift < 32; shift += 7){
+		if(pos >= buflen){ return false; }
+		unsigned char b = buffer[pos++];
+		v |= (unsigned)(b & 0x7F) << shift;
+		if(0 == (b & 0x80)){ return true; }
+	}
+	return false;
+}
+
+// Huffman code lengths for the symbols with nonzero count, limited to
+// max_code_bits by lengthening the rarest short codes until the Kraft
+// sum fits again. The result is slightly off optimal only in the rare
+// case where the limit kicks in.
+static void build_lengths(const unsigned *count, unsigned char *length){
+	// Leaves are 0..255, merged nodes follow. Everything is on the stack
+	// so that encoding small updates does not allocate.
+	unsigned weight[511];
+	int parent[511];
+	int order[256];
+	int nleaves = 0;
+	for(unsigned s = 0; s < 256; ++s){
+		length[s] = 0;
+		weight[s] = count[s];
+		if(count[s] > 0){ order[nleaves++] = s; }
+	}
+	std::sort(order, order+nleaves, [&](int a, int b){ return weight[a] < weight[b]; });
+	// Two-queue construction: leaves in order, merged nodes are produced
+	// in nondecreasing order so they form a second sorted queue.
+	int nnodes = 256;
+	int ileaf = 0, imerged = 256;
+	auto pop = [&]() -> int{
+		if(imerged >= nnodes || (ileaf < nleaves && weight[order[ileaf]] <= weight[imerged])){
+			return order[ileaf++];
+		}
+		return imerged++;
+	};
+	for(int k = 1; k < nleaves; ++k){
+		int a = pop();
+		int b = pop();
+		weight[nnodes] = weight[a] + weight[b];
+		parent[a] = parent[b] = nnodes;
+		++nnodes;
+	}
+	// Depths from the root down; parents always come after children
+	unsigned char depth[511];
+	depth[nnodes-1] = 0;
+	for(int i = nnodes-2; i >= 256; --i){
+		depth[i] = depth[parent[i]] + 1;
+	}
+	for(int k = 0; k < nleaves; ++k){
+		const int s = order[k];
+		const unsigned d = depth[parent[s]] + 1;
+		length[s] = (d > max_code_bits ? max_code_bits : d);
+	}
+	unsigned kraft = 0;
+	for(unsigned s = 0; s < 256; ++s){
+		if(length[s]){ kraft += table_size >> length[s]; }
+	}
+	while(kraft > table_size){
+		// Lengthen the longest code that can still grow, rarest first
+		int best = -1;
+		for(int k = 0; k < nleaves; ++k){
+			int s = order[k];
+			if(length[s] < max_code_bits && (best < 0 || length[s] > length[best])){
+				best = s;
+			}
+		}
+		kraft -= table_size >> (length[best]+1);
+		length[best]++;
+	}
+}
+
+// Canonical codes for the given lengths, bit reversed so they can be
+// written and read LSB first.
+static void build_codes(const unsigned char *length, unsigned n, uint16_t *code){
+	unsigned bl_count[max_code_bits+1] = { 0 };
+	for(unsigned s = 0; s < n; ++s){ bl_count[length[s]]++; }
+	bl_count[0] = 0;
+	unsigned next[max_code_bits+1];
+	unsigned c = 0;
+	for(unsigned bits = 1; bits <= max_code_bits; ++bits){
+		c = (c + bl_count[bits-1]) << 1;
+		next[bits] = c;
+	}
+	for(unsigned s = 0; s < n; ++s){
+		const unsigned len = length[s];
+		if(0 == len){ code[s] = 0; continue; }
+		unsigned v = next[len]++;
+		unsigned r = 0;
+		for(unsigned b = 0; b < len; ++b){
+			r = (r << 1) | ((v >> b) & 1);
+		}
+		code[s] = r;
+	}
+}
+
+// Writes the codes for data LSB first, whole bytes only
+static void put_stream(const unsigned char *data, unsigned len, const unsigned char *length, const uint16_t *code, unsigned char *dst){
+	uint64_t acc = 0;
+	unsigned nacc = 0;
+	unsigned i = 0;
+	// Four codes of at most 11 bits fit behind the < 8 bits left over
+	// from the previous flush.
+	for(; i+4 <= len; i += 4){
+		for(unsigned k = 0; k < 4; ++k){
+			const unsigned s = data[i+k];
+			acc |= (uint64_t)code[s] << nacc;
+			nacc += length[s];
+		}
+		while(nacc >= 8){
+			*dst++ = (unsigned char)acc;
+			acc >>= 8;
+			nacc -= 8;
+		}
+	}
+	for(; i < len; ++i){
+		const unsigned s = data[i];
+		acc |= (uint64_t)code[s] << nacc;
+		nacc += length[s];
+	}
+	while(nacc > 0){
+		*dst++ = (unsigned char)acc;
+		acc >>= 8;
+		nacc = (nacc > 8 ? nacc - 8 : 0);
+	}
+}
+
+void EntropyCoder::encode(const unsigned char *data, unsigned len, std::vector<unsigned char> &buffer){
+	const size_t off = buffer.size();
+	unsigned count[256] = { 0 };
+	for(unsigned i = 0; i < len; ++i){ count[data[i]]++; }
+	unsigned nused = 0, n = 0;
+	for(unsigned s = 0; s < 256; ++s){
+		if(count[s]){ ++nused; n = s+1; }
+	}
+	if(1 == nused && len > 4){
+		buffer.push_back(MODE_FILL);
+		put_varint(len, buffer);
+		buffer.push_back(data[0]);
+		return;
+	}
+	if(nused > 1){
+		unsigned char length[256];
+		build_lengths(count, length);
+		uint64_t nbits = 0;
+		for(unsigned s = 0; s < n; ++s){ nbits += (uint64_t)count[s] * length[s]; }
+		const size_t header = 1 + 5 + 1 + (n+1)/2;
+		if(header + 3*4 + (nbits+7)/8 + num_streams < len){
+			uint16_t code[256];
+			build_codes(length, n, code);
+			buffer.push_back(MODE_HUFFMAN);
+			put_varint(len, buffer);
+			buffer.push_back(n-1);
+			for(unsigned s = 0; s < n; s += 2){
+				buffer.push_back(length[s] | (s+1 < n ? length[s+1] << 4 : 0));
+			}
+			const unsigned seg = (len + num_streams-1) / num_streams;
+			unsigned stream_bytes[num_streams];
+			for(unsigned k = 0; k < num_streams; ++k){
+				const unsigned i0 = (k*seg < len ? k*seg : len);
+				const unsigned i1 = (i0+seg < len ? i0+seg : len);
+				uint64_t sbits = 0;
+				for(unsigned i = i0; i < i1; ++i){ sbits += length[data[i]]; }
+				stream_bytes[k] = (sbits+7)/8;
+			}
+			for(unsigned k = 0; k+1 < num_streams; ++k){
+				put_varint(stream_bytes[k], buffer);
+			}
+			size_t pos = buffer.size();
+			buffer.resize(pos + (nbits+7)/8 + num_streams + 8);
+			unsigned char *dst = &buffer[pos];
+			for(unsigned k = 0; k < num_streams; ++k){
+				const unsigned i0 = (k*seg < len ? k*seg : len);
+				const unsigned i1 = (i0+seg < len ? i0+seg : len);
+				put_stream(data + i0, i1 - i0, length, code, dst);
+				dst += stream_bytes[k];
+			}
+			buffer.resize(dst - &buffer[0]);
+			return;
+		}
+	}
+	buffer.resize(off + 1 + len);
+	buffer[off] = MODE_STORED;
+	if(len > 0){ memcpy(&buffer[off+1], data, len); }
+}
+
+int EntropyCoder::decoded_size(const unsigned char *buffer, unsigned buflen){
+	if(buflen < 1){ return -1; }
+	if(MODE_STORED == buffer[0]){ return buflen-1; }
+	if(MODE_FILL != buffer[0] && MODE_HUFFMAN != buffer[0]){ return -1; }
+	unsigned pos = 1, len;
+	if(!get_varint(buffer, buflen, pos, len) || len > 0x7fffffff){ return -1; }
+	return len;
+}
+
+static inline uint64_t load_le64(const unsigned char *p){
+	uint64_t v;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&v, p, 8);
+#else
+	v = 0;
+	for(int k = 7; k >= 0; --k){ v = (v << 8) | p[k]; }
+#endif
+	return v;
+}
+
+// LSB-first reader that keeps at least 56 bits buffered after a refill,
+// enough for 5 codes. Past the end it reads zeros, and counts them so
+// that running off the end can be detected afterwards.
+struct BitReader{
+	const unsigned char *start, *p, *end;
+	uint64_t bits;
+	unsigned nbits, virt;
+	void init(const unsigned char *data, unsigned len){
+		start = p = data;
+		end = data + len;
+		bits = 0;
+		nbits = virt = 0;
+	}
+	void refill_fast(){
+		bits |= load_le64(p) << nbits;
+		p += (63 - nbits) >> 3;
+		nbits |= 56;
+	}
+	void refill(){
+		if(end - p >= 8){
+			refill_fast();
+			return;
+		}
+		while(nbits <= 56){
+			if(p < end){
+				bits |= (uint64_t)*p++ << nbits;
+			}else{
+				++virt;
+			}
+			nbits += 8;
+		}
+	}
+	unsigned char get(const uint16_t *table, unsigned &bad){
+		const unsigned e = table[bits & (table_size-1)];
+		bad |= e;
+		const unsigned l = e & 0xF;
+		bits >>= l;
+		nbits -= l;
+		return (unsigned char)(e >> 4);
+	}
+	bool overrun() const{
+		return 8*((uint64_t)(p - start) + virt) - nbits > 8*(uint64_t)(end - start);
+	}
+};
+
+int EntropyCoder::decode(const unsigned char *buffer, unsigned buflen, unsigned char *out, unsigned outlen){
+	if(buflen < 1){ return -2; }
+	const int mode = buffer[0];
+	if(MODE_STORED == mode){
+		if(buflen-1 != outlen){ return -2; }
+		if(outlen > 0){ memcpy(out, buffer+1, outlen); }
+		return 0;
+	}
+	unsigned pos = 1, len;
+	if(!get_varint(buffer, buflen, pos, len) || len != outlen){ return -2; }
+	if(MODE_FILL == mode){
+		if(pos >= buflen){ return -2; }
+		if(outlen > 0){ memset(out, buffer[pos], outlen); }
+		return 0;
+	}
+	if(MODE_HUFFMAN != mode){ return -2; }
+
+	if(pos >= buflen){ return -2; }
+	const unsigned n = buffer[pos++] + 1;
+	if(pos + (n+1)/2 > buflen){ return -2; }
+	unsigned char length[256];
+	unsigned kraft = 0;
+	for(unsigned s = 0; s < n; ++s){
+		length[s] = (buffer[pos + s/2] >> (4*(s&1))) & 0xF;
+		if(length[s] > max_code_bits){ return -2; }
+		if(length[s]){ kraft += table_size >> length[s]; }
+	}
+	if(kraft > table_size){ return -2; }
+	pos += (n+1)/2;
+	uint16_t code[256];
+	build_codes(length, n, code);
+	uint16_t table[table_size];
+	for(unsigned k = 0; k < table_size; ++k){ table[k] = bad_entry; }
+	for(unsigned s = 0; s < n; ++s){
+		const unsigned l = length[s];
+		if(0 == l){ continue; }
+		for(unsigned k = code[s]; k < table_size; k += 1u << l){
+			table[k] = (s << 4) | l;
+		}
+	}
+
+	const unsigned seg = (len + num_streams-1) / num_streams;
+	BitReader br[num_streams];
+	unsigned char *o[num_streams], *oend[num_streams];
+	unsigned bytes[num_streams];
+	for(unsigned k = 0; k+1 < num_streams; ++k){
+		if(!get_varint(buffer, buflen, pos, bytes[k])){ return -2; }
+	}
+	unsigned stream_start = pos;
+	for(unsigned k = 0; k < num_streams; ++k){
+		if(k+1 == num_streams){ bytes[k] = buflen - stream_start; }
+		if(bytes[k] > buflen - stream_start){ return -2; }
+		br[k].init(buffer + stream_start, bytes[k]);
+		stream_start += bytes[k];
+		const unsigned i0 = (k*seg < len ? k*seg : len);
+		o[k] = out + i0;
+		oend[k] = out + (i0+seg < len ? i0+seg : len);
+	}
+
+	unsigned bad = 0;
+	// Interleave the streams while all of them can refill straight from
+	// memory, then finish each one on its own.
+	while(true){
+		bool all = true;
+		for(unsigned k = 0; k < num_streams; ++k){
+			all = all && br[k].end - br[k].p >= 8 && oend[k] - o[k] >= 5;
+		}
+		if(!all){ break; }
+		for(unsigned k = 0; k < num_streams; ++k){ br[k].refill_fast(); }
+		for(unsigned j = 0; j < 5; ++j){
+			for(unsigned k = 0; k < num_streams; ++k){
+				*o[k]++ = br[k].get(table, bad);
+			}
+		}
+	}
+	for(unsigned k = 0; k < num_streams; ++k){
+		while(o[k] < oend[k]){
+			br[k].refill();
+			unsigned m = (oend[k] - o[k] < 5 ? oend[k] - o[k] : 5);
+			while(m--){
+				*o[k]++ = br[k].get(table, bad);
+			}
+		}
+		if(br[k].overrun()){ return -2; }
+	}
+	if(bad & bad_entry){ return -2; }
+	return 0;
+}
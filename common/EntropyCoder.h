@@ -0,0 +1,36 @@
+#ifndef ENTROPY_CODER_H_INCLUDED
+#define ENTROPY_CODER_H_INCLUDED
+
+#include <vector>
+
+// Order-0 entropy coding of byte streams, meant to run after an LZ or
+// transform stage that leaves skewed byte statistics behind it.
+//
+// Payload: 1 byte mode, then
+//   MODE_STORED:  the input bytes
+//   MODE_FILL:    varint length, the repeated byte
+//   MODE_HUFFMAN: varint length, byte n, n nibbles (rounded up to bytes)
+//                 of code lengths for symbols 0..n-1, LSB-first bitstream
+// encode picks whichever mode is smallest, so the output is never more
+// than a few bytes bigger than the input.
+namespace EntropyCoder{
+
+enum Mode{
+	MODE_STORED  = 0,
+	MODE_FILL    = 1,
+	MODE_HUFFMAN = 2  // canonical, code lengths limited to 11 bits
+};
+
+// Appends the coded form of data to buffer.
+void encode(const unsigned char *data, unsigned len, std::vector<unsigned char> &buffer);
+
+// Returns the decoded length of a payload, or -1 if it is malformed.
+int decoded_size(const unsigned char *buffer, unsigned buflen);
+
+// Decodes into out, which must hold exactly decoded_size() bytes.
+// Returns 0 on success, -2 on corrupt or mismatched input.
+int decode(const unsigned char *buffer, unsigned buflen, unsigned char *out, unsigned outlen);
+
+} // namespace EntropyCoder
+
+#endif // ENTROPY_CODER_H_INCLUDED
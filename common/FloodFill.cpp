@@ -0,0 +1,102 @@
+#include "FloodFill.h"
+#include "PixelOps.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// A byte per pixel, 1 while the pixel matches and is not in a span yet.
+// Rows are worked out the first time the fill reaches them, so a small
+// fill only looks at the rows it touches, and the rest of the fill only
+// deals in these bytes.
+static thread_local std::vector<unsigned char> open_px;
+static thread_local std::vector<unsigned char> row_ready;
+static thread_local std::vector<unsigned> seeds; // x, y pairs
+
+static unsigned char *open_row(
+	const unsigned char *img, unsigned bpp, unsigned stride, unsigned w,
+	const unsigned char lo[3], const unsigned char hi[3], unsigned y
+){
+	unsigned char *o = &open_px[(size_t)y*w];
+	if(!row_ready[y]){
+		row_ready[y] = 1;
+		if(4 == bpp){
+			PixelOps::match_rgbx(o, img + 4*(size_t)y*stride, w, lo, hi);
+		}else{
+			PixelOps::match_rgb(o, img + 3*(size_t)y*stride, w, lo, hi);
+		}
+	}
+	return o;
+}
+
+// The first of o[x] to o[end-1] that is 0, or end, eight at a time
+static unsigned skip_open(const unsigned char *o, unsigned x, unsigned end){
+	static const uint64_t all = 0x0101010101010101ull;
+	for(uint64_t v; x + 8 <= end; x += 8){
+		memcpy(&v, o + x, 8);
+		if(v != all){ break; }
+	}
+	while(x < end && o[x]){ ++x; }
+	return x;
+}
+// The first of o[x] to o[end-1] that is not 0, or end
+static unsigned skip_closed(const unsigned char *o, unsigned x, unsigned end){
+	for(uint64_t v; x + 8 <= end; x += 8){
+		memcpy(&v, o + x, 8);
+		if(v){ break; }
+	}
+	while(x < end && !o[x]){ ++x; }
+	return x;
+}
+
+void FloodFill::find(
+	const unsigned char *img, unsigned bpp, unsigned stride, unsigned w, unsigned h,
+	unsigned x, unsigned y, unsigned tolerance, std::vector<Span> &spans
+){
+	spans.clear();
+	if(x >= w || y >= h){ return; }
+	// Each channel matches within tolerance of the seed's
+	const unsigned char *seed = img + bpp*((size_t)x + (size_t)y*stride);
+	unsigned char lo[3], hi[3];
+	for(int c = 0; c < 3; ++c){
+		lo[c] = (unsigned char)std::max(0, (int)seed[c] - (int)tolerance);
+		hi[c] = (unsigned char)std::min(255, (int)seed[c] + (int)tolerance);
+	}
+	open_px.resize((size_t)w*h);
+	row_ready.assign(h, 0);
+	seeds.clear();
+	seeds.push_back(x);
+	seeds.push_back(y);
+	while(!seeds.empty()){
+		const unsigned sy = seeds.back();
+		seeds.pop_back();
+		const unsigned sx = seeds.back();
+		seeds.pop_back();
+		unsigned char *o = open_row(img, bpp, stride, w, lo, hi, sy);
+		if(!o[sx]){ continue; }
+
+		// Widen the seed to the whole run it sits in
+		static const uint64_t all = 0x0101010101010101ull;
+		unsigned x0 = sx;
+		for(uint64_t v; x0 >= 8; x0 -= 8){
+			memcpy(&v, o + x0 - 8, 8);
+			if(v != all){ break; }
+		}
+		while(x0 > 0 && o[x0-1]){ --x0; }
+		const unsigned x1 = skip_open(o, sx, w) - 1;
+		memset(o + x0, 0, x1 - x0 + 1);
+		Span span = { x0, x1, sy };
+		spans.push_back(span);
+
+		// One seed for each run above and below that touches this one
+		for(int d = -1; d <= 1; d += 2){
+			if((0 == sy && d < 0) || (sy+1 == h && d > 0)){ continue; }
+			const unsigned ny = sy + d;
+			const unsigned char *n = open_row(img, bpp, stride, w, lo, hi, ny);
+			for(unsigned i = skip_closed(n, x0, x1+1); i <= x1; i = skip_closed(n, i, x1+1)){
+				seeds.push_back(i);
+				seeds.push_back(ny);
+				i = skip_open(n, i, x1+1);
+			}
+		}
+	}
+}
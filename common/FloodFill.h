@@ -0,0 +1,29 @@
+#ifndef FLOOD_FILL_H_INCLUDED
+#define FLOOD_FILL_H_INCLUDED
+
+#include <vector>
+
+// Scanline flood fill. BoardContent fills with it, and ImageCoder repeats
+// the same fill on every other copy of the board from just the seed, so
+// the pixels picked depend only on the image and never on the order they
+// are visited in.
+namespace FloodFill{
+
+// Pixels x0 to x1 inclusive of row y
+struct Span{
+	unsigned x0, x1, y;
+};
+
+// Finds the pixels connected to (x, y) through their four neighbours
+// whose R, G and B are each within tolerance of the pixel at (x, y). img
+// is w x h pixels of RGB, or RGBX with bpp = 4, stride pixels from one
+// row to the next. spans is replaced by rows of them, not overlapping and
+// in no particular order.
+void find(
+	const unsigned char *img, unsigned bpp, unsigned stride, unsigned w, unsigned h,
+	unsigned x, unsigned y, unsigned tolerance, std::vector<Span> &spans
+);
+
+} // namespace FloodFill
+
+#endif // FLOOD_FILL_H_INCLUDED
@@ -1,7 +1,13 @@
 #include "ImageCoder.h"
 #include <cstring>
 #include <cstdio>
+#include <cmath>
+#include <algorithm>
 #include "fastlz.h"
+#include "EntropyCoder.h"
+#include "ThreadPool.h"
+#include "PixelOps.h"
+#include "FloodFill.h"
 
 typedef int (*encoderproc)(
 	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
@@ -28,31 +34,186 @@ int rle_dec(
 	const unsigned char *buffer, unsigned buflen,
 	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
 );
+int tiled_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+);
+int tiled_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+);
+int lossy_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+);
+int lossy_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+);
+int sparse_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+);
+int sparse_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+);
+int fill_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+);
+int fill_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+);
+
+template <encoderproc base>
+int entropy_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+);
+template <decoderproc base>
+int entropy_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+);
 
 struct endecpair{
 	encoderproc encoder;
 	decoderproc decoder;
 };
 
-endecpair endec[2] = {
+endecpair endec[] = {
 	{ &raw_enc, &raw_dec },
-	{ &rle_enc, &rle_dec }
+	{ &rle_enc, &rle_dec },
+	{ &tiled_enc, &tiled_dec },
+	{ &lossy_enc, &lossy_dec },
+	{ &entropy_enc<&rle_enc>, &entropy_dec<&rle_dec> },
+	{ &entropy_enc<&lossy_enc>, &entropy_dec<&lossy_dec> },
+	{ &sparse_enc, &sparse_dec },
+	{ &fill_enc, &fill_dec }
 };
+static const int num_methods = sizeof(endec)/sizeof(endec[0]);
+
+// Target amount of raw pixel data per stripe of METHOD_FASTLZ_TILED
+static const unsigned tile_bytes = 256*1024;
+
+int ImageCoder::default_method(unsigned w, unsigned h){
+	if(3*w*h >= 2*tile_bytes){ return METHOD_FASTLZ_TILED; }
+	return METHOD_FASTLZ;
+}
+
+bool ImageCoder::is_lossy(int method){
+	return METHOD_LOSSY == method || METHOD_LOSSY_ENTROPY == method;
+}
+
+static int lossy_quality = 85;
+
+void ImageCoder::set_lossy_quality(int quality){
+	if(quality < 0){ quality = 0; }
+	if(quality > 100){ quality = 100; }
+	lossy_quality = quality;
+}
+int ImageCoder::get_lossy_quality(){
+	return lossy_quality;
+}
+
+// Shannon entropy, in bits, of the horizontal green differences over a
+// sample of rows. Drawings and screenshots are dominated by flat areas
+// and come out well under 2 bits; photographs are typically 4 or more.
+static float estimate_entropy(const unsigned char *rgb, unsigned stride, unsigned w, unsigned h, unsigned bpp){
+	unsigned hist[256] = { 0 };
+	unsigned total = 0;
+	unsigned step = h / 64;
+	if(step < 1){ step = 1; }
+	for(unsigned j = 0; j < h; j += step){
+		const unsigned char *row = rgb + bpp*j*stride;
+		for(unsigned i = 1; i < w; ++i){
+			hist[(unsigned char)(row[bpp*i+1] - row[bpp*(i-1)+1])]++;
+		}
+		total += w-1;
+	}
+	float bits = 0;
+	for(unsigned k = 0; k < 256; ++k){
+		if(0 == hist[k]){ continue; }
+		float p = (float)hist[k] / total;
+		bits -= p * std::log2(p);
+	}
+	return bits;
+}
+
+int ImageCoder::choose_method(const unsigned char *rgb, unsigned stride, unsigned w, unsigned h, unsigned bpp){
+	// Big enough that only pastes qualify, not pen strokes over a photo,
+	// which would otherwise re-quantize the same pixels again and again.
+	static const unsigned lossy_min_pixels = 256*256;
+	static const float lossy_min_entropy = 3.5f;
+	// Below this the Huffman table costs about as much as it saves
+	static const unsigned entropy_min_bytes = 16*1024;
+	if(lossy_quality > 0 && w >= 16 && h >= 16 && w*h >= lossy_min_pixels){
+		if(estimate_entropy(rgb, stride, w, h, bpp) >= lossy_min_entropy){
+			return METHOD_LOSSY_ENTROPY;
+		}
+	}
+	const int method = default_method(w, h);
+	if(METHOD_FASTLZ == method && 3*w*h >= entropy_min_bytes){
+		return METHOD_FASTLZ_ENTROPY;
+	}
+	return method;
+}
+
+// RGBX pixels are packed to RGB here before coding, and spread out again
+// after decoding, so the methods themselves only ever see RGB.
+static thread_local std::vector<unsigned char> layout_scratch;
+
+static unsigned char *pack_rgbx(const unsigned char *rgbx, unsigned stride, unsigned w, unsigned h){
+	std::vector<unsigned char> &tmp = layout_scratch;
+	tmp.resize(3*(size_t)w*h + 1);
+	for(unsigned j = 0; j < h; ++j){
+		PixelOps::rgb_from_rgbx(&tmp[3*(size_t)w*j], rgbx + 4*(size_t)j*stride, w);
+	}
+	return &tmp[0];
+}
 
 int ImageCoder::encode(int method,
 	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
-	std::vector<unsigned char> &buffer
+	std::vector<unsigned char> &buffer, unsigned bpp
 ){
-	if(method < 0 || method > 1){ return -1; }
+	if(method < 0 || method >= num_methods){ return -1; }
+	if(4 == bpp){
+		return endec[method].encoder(pack_rgbx(rgb, stride, w, h), w, w, h, buffer);
+	}
 	return endec[method].encoder(rgb, stride, w, h, buffer);
 }
 
+// Fills in decode's written from what the last decoder left behind
+static void mark_written(int method, unsigned w, unsigned h, unsigned char *written);
+
 int ImageCoder::decode(int method,
 	const unsigned char *buffer, unsigned buflen,
-	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h, unsigned bpp,
+	unsigned char *written
 ){
-	if(method < 0 || method > 1){ return -1; }
-	return endec[method].decoder(buffer, buflen, rgb, stride, w, h);
+	if(method < 0 || method >= num_methods){ return -1; }
+	if(4 != bpp){
+		const int ret = endec[method].decoder(buffer, buflen, rgb, stride, w, h);
+		if(0 == ret && written){ mark_written(method, w, h, written); }
+		return ret;
+	}
+	// Sparse updates and fills leave some pixels as they were
+	unsigned char *tmp;
+	if(METHOD_SPARSE == method || METHOD_FILL == method){
+		tmp = pack_rgbx(rgb, stride, w, h);
+	}else{
+		layout_scratch.resize(3*(size_t)w*h + 1);
+		tmp = &layout_scratch[0];
+	}
+	const int ret = endec[method].decoder(buffer, buflen, tmp, w, w, h);
+	if(0 != ret){ return ret; }
+	for(unsigned j = 0; j < h; ++j){
+		PixelOps::rgbx_from_rgb(rgb + 4*(size_t)j*stride, tmp + 3*(size_t)w*j, w);
+	}
+	if(written){ mark_written(method, w, h, written); }
+	return 0;
 }
 
 
@@ -167,20 +328,15 @@ int rle_enc(
 	}
 	*/
 	
-	size_t bufsize = 3*w*h + (3*w*h+19/20);
+	// fastlz wants 5% slack and at least 66 bytes; the strided encoder may
+	// also spend one extra literal marker per row.
+	size_t bufsize = 3*w*h + (3*w*h+19)/20 + h + 66;
 	buffer.resize(off + bufsize);
 	int sz;
 	if(stride == w){
 		sz = fastlz_compress_level(2, rgb, 3*w*h, &buffer[off]);
 	}else{
-		std::vector<unsigned char> buf(3*w*h);
-		unsigned char *row = &buf[0];
-		for(unsigned j = 0; j < h; ++j){
-			memcpy(row, rgb, 3*w);
-			rgb += 3*stride;
-			row += 3*w;
-		}
-		sz = fastlz_compress_level(2, &buf[0], 3*w*h, &buffer[off]);
+		sz = fastlz_compress_strided(2, rgb, 3*w, 3*stride, h, &buffer[off]);
 	}
 	buffer.resize(off+sz);
 	
@@ -190,19 +346,15 @@ int rle_dec(
 	const unsigned char *buffer, unsigned buflen,
 	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
 ){
+	if(0 == w || 0 == h){ return 0; }
+	if(0 == buflen){ return -2; }
 	int sz;
 	if(stride == w){
 		sz = fastlz_decompress(buffer, buflen, rgb, 3*w*h);
 	}else{
-		std::vector<unsigned char> buf(3*w*h);
-		sz = fastlz_decompress(buffer, buflen, &buf[0], 3*w*h);
-		unsigned char *row = &buf[0];
-		for(unsigned j = 0; j < h; ++j){
-			memcpy(rgb, row, 3*w);
-			rgb += 3*stride;
-			row += 3*w;
-		}
+		sz = fastlz_decompress_strided(buffer, buflen, rgb, 3*w, 3*stride, h);
 	}
+	if(3*w*h != (unsigned)sz){ return -2; }
 	/*
 	size_t off = 0;
 	unsigned char *row = rgb;
@@ -230,3 +382,571 @@ int rle_dec(
 	*/
 	return 0;
 }
+
+// Tiled payload:
+//   2 byte stripe count n
+//   n 4 byte compressed stripe sizes
+//   n fastlz blocks, one per stripe
+// All stripes except possibly the last are ceil(h/n) rows tall. Stripes
+// are independent, so both ends can work on them in parallel.
+static void put_u32(unsigned char *p, unsigned v){
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+static unsigned get_u32(const unsigned char *p){
+	return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+}
+
+int tiled_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+){
+	unsigned n = 3*w*h / tile_bytes;
+	if(n > h){ n = h; }
+	if(n > 0xffff){ n = 0xffff; }
+	if(n < 1){ n = 1; }
+	const unsigned rows = (h + n-1) / n;
+	n = (h + rows-1) / rows;
+	
+	// Each stripe is compressed into its own worst-case sized slot, then
+	// the slots are packed together behind the header.
+	const size_t slot = 3*w*rows + (3*w*rows+19)/20 + rows + 66;
+	const size_t off = buffer.size();
+	const size_t header = 2 + 4*n;
+	buffer.resize(off + header + n*slot);
+	buffer[off+0] = n >> 8;
+	buffer[off+1] = n;
+	unsigned char *base = &buffer[off];
+	ThreadPool::shared().run(n, [=](unsigned i){
+		unsigned y0 = i*rows;
+		unsigned hi = (y0 + rows > h ? h - y0 : rows);
+		const unsigned char *src = rgb + 3*y0*stride;
+		unsigned char *dst = base + header + i*slot;
+		int sz;
+		if(stride == w){
+			sz = fastlz_compress_level(2, src, 3*w*hi, dst);
+		}else{
+			sz = fastlz_compress_strided(2, src, 3*w, 3*stride, hi, dst);
+		}
+		put_u32(base + 2 + 4*i, sz);
+	});
+	size_t pos = off + header;
+	for(unsigned i = 0; i < n; ++i){
+		unsigned sz = get_u32(&buffer[off + 2 + 4*i]);
+		memmove(&buffer[pos], &buffer[off + header + i*slot], sz);
+		pos += sz;
+	}
+	buffer.resize(pos);
+	return 0;
+}
+int tiled_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+){
+	if(0 == w || 0 == h){ return 0; }
+	if(buflen < 2){ return -2; }
+	const unsigned n = ((unsigned)buffer[0] << 8) | buffer[1];
+	if(n < 1 || n > h){ return -2; }
+	const unsigned rows = (h + n-1) / n;
+	if((n-1)*rows >= h){ return -2; }
+	const size_t header = 2 + 4*n;
+	if(buflen < header){ return -2; }
+	
+	// Validate the stripe table up front, then decode stripes in parallel
+	std::vector<size_t> start(n+1);
+	start[0] = header;
+	for(unsigned i = 0; i < n; ++i){
+		start[i+1] = start[i] + get_u32(&buffer[2 + 4*i]);
+		if(start[i+1] > buflen){ return -2; }
+	}
+	std::vector<int> ret(n);
+	ThreadPool::shared().run(n, [&](unsigned i){
+		unsigned y0 = i*rows;
+		unsigned hi = (y0 + rows > h ? h - y0 : rows);
+		ret[i] = rle_dec(buffer + start[i], start[i+1] - start[i], rgb + 3*y0*stride, stride, w, hi);
+	});
+	for(unsigned i = 0; i < n; ++i){
+		if(0 != ret[i]){ return ret[i]; }
+	}
+	return 0;
+}
+
+// Lossy payload:
+//   1 byte quality (1-100)
+//   coefficient tokens for the Y, then Co, then Cg plane
+// The chroma planes are subsampled 2x2. Each plane is coded as 8x8 blocks
+// in raster order; a block is the difference of its DC from that of the
+// previous block of the plane, then (zero run, value) pairs in zigzag
+// order, then a run of 63 to end the block. Values are zigzag-signed
+// varints. The transform is done in fixed point so that every peer
+// decodes the exact same pixels.
+
+static const unsigned char zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+static const unsigned char quant_luma[64] = {
+	16, 11, 10, 16,  24,  40,  51,  61,
+	12, 12, 14, 19,  26,  58,  60,  55,
+	14, 13, 16, 24,  40,  57,  69,  56,
+	14, 17, 22, 29,  51,  87,  80,  62,
+	18, 22, 37, 56,  68, 109, 103,  77,
+	24, 35, 55, 64,  81, 104, 113,  92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103,  99
+};
+static const unsigned char quant_chroma[64] = {
+	17, 18, 24, 47, 99, 99, 99, 99,
+	18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,
+	47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99
+};
+// 4096 * C(u) * cos((2x+1)u pi/16), C(0) = 1/sqrt(2), C(u) = 1 otherwise
+static const int dct_basis[8][8] = {
+	{2896,  2896,  2896,  2896,  2896,  2896,  2896,  2896},
+	{4017,  3406,  2276,   799,  -799, -2276, -3406, -4017},
+	{3784,  1567, -1567, -3784, -3784, -1567,  1567,  3784},
+	{3406,  -799, -4017, -2276,  2276,  4017,   799, -3406},
+	{2896, -2896, -2896,  2896,  2896, -2896, -2896,  2896},
+	{2276, -4017,   799,  3406, -3406,  -799,  4017, -2276},
+	{1567, -3784,  3784, -1567, -1567,  3784, -3784,  1567},
+	{ 799, -2276,  3406, -4017,  4017, -3406,  2276,  -799}
+};
+
+static void quant_table(int quality, const unsigned char *base, int *table){
+	// Same scaling as the IJG reference encoder
+	int scale = (quality < 50 ? 5000 / quality : 200 - 2*quality);
+	for(int k = 0; k < 64; ++k){
+		int q = (base[k]*scale + 50) / 100;
+		if(q < 1){ q = 1; }
+		if(q > 255){ q = 255; }
+		table[k] = q;
+	}
+}
+
+static void fdct8x8(const int *in, int *out){
+	int tmp[64];
+	for(int y = 0; y < 8; ++y){
+		for(int u = 0; u < 8; ++u){
+			int sum = 0;
+			for(int x = 0; x < 8; ++x){ sum += in[8*y+x] * dct_basis[u][x]; }
+			tmp[8*y+u] = (sum + (1 << 9)) >> 10;
+		}
+	}
+	for(int v = 0; v < 8; ++v){
+		for(int u = 0; u < 8; ++u){
+			int sum = 0;
+			for(int y = 0; y < 8; ++y){ sum += tmp[8*y+u] * dct_basis[v][y]; }
+			out[8*v+u] = (sum + (1 << 15)) >> 16;
+		}
+	}
+}
+// Input coefficients must be within +-max_coef to stay clear of overflow
+static const int max_coef = 4095;
+static void idct8x8(const int *in, int *out){
+	int tmp[64];
+	for(int v = 0; v < 8; ++v){
+		for(int x = 0; x < 8; ++x){
+			int sum = 0;
+			for(int u = 0; u < 8; ++u){ sum += in[8*v+u] * dct_basis[u][x]; }
+			tmp[8*v+x] = (sum + (1 << 10)) >> 11;
+		}
+	}
+	for(int y = 0; y < 8; ++y){
+		for(int x = 0; x < 8; ++x){
+			int sum = 0;
+			for(int v = 0; v < 8; ++v){ sum += tmp[8*v+x] * dct_basis[v][y]; }
+			out[8*y+x] = (sum + (1 << 14)) >> 15;
+		}
+	}
+}
+static inline int dequant(int v, int q){
+	if(v > max_coef){ v = max_coef; }
+	if(v < -max_coef){ v = -max_coef; }
+	v *= q;
+	return (v > max_coef ? max_coef : (v < -max_coef ? -max_coef : v));
+}
+
+static void put_svarint(int v, std::vector<unsigned char> &buffer){
+	encode_byte_continuation(((unsigned)v << 1) ^ (unsigned)(v >> 31), buffer);
+}
+static bool get_svarint(const unsigned char *buffer, unsigned buflen, unsigned &pos, int &v){
+	unsigned u = 0, shift = 0;
+	while(1){
+		if(pos >= buflen || shift > 28){ return false; }
+		unsigned char b = buffer[pos++];
+		u |= (unsigned)(b & 0x7F) << shift;
+		if(0 == (b & 0x80)){ break; }
+		shift += 7;
+	}
+	v = (int)(u >> 1) ^ -(int)(u & 1);
+	return true;
+}
+
+// One plane of the lossy coder, padded out to whole blocks
+struct LossyPlane{
+	unsigned w, h, bw, bh; // size in pixels and in blocks
+	std::vector<int> px;
+	LossyPlane(unsigned w_, unsigned h_):
+		w(w_), h(h_), bw((w_+7)/8), bh((h_+7)/8), px(64*bw*bh)
+	{}
+	int *row(unsigned y){ return &px[8*bw*y]; }
+	// Replicate the last column and row into the padding
+	void pad(){
+		const unsigned pw = 8*bw, ph = 8*bh;
+		for(unsigned y = 0; y < h; ++y){
+			int *r = row(y);
+			for(unsigned x = w; x < pw; ++x){ r[x] = r[w-1]; }
+		}
+		for(unsigned y = h; y < ph; ++y){
+			memcpy(row(y), row(h-1), pw*sizeof(int));
+		}
+	}
+	void get_block(unsigned bx, unsigned by, int *blk){
+		for(unsigned j = 0; j < 8; ++j){
+			memcpy(&blk[8*j], row(8*by+j) + 8*bx, 8*sizeof(int));
+		}
+	}
+	void set_block(unsigned bx, unsigned by, const int *blk){
+		for(unsigned j = 0; j < 8; ++j){
+			memcpy(row(8*by+j) + 8*bx, &blk[8*j], 8*sizeof(int));
+		}
+	}
+};
+
+static void lossy_enc_plane(LossyPlane &plane, const int *quant, int bias, std::vector<unsigned char> &buffer){
+	int blk[64], coef[64];
+	int prev_dc = 0;
+	for(unsigned by = 0; by < plane.bh; ++by){
+		for(unsigned bx = 0; bx < plane.bw; ++bx){
+			plane.get_block(bx, by, blk);
+			for(int k = 0; k < 64; ++k){ blk[k] -= bias; }
+			fdct8x8(blk, coef);
+			int run = 0;
+			for(int k = 0; k < 64; ++k){
+				const int c = coef[zigzag[k]];
+				const int q = quant[zigzag[k]];
+				const int v = (c >= 0 ? (c + q/2) / q : -((-c + q/2) / q));
+				if(0 == k){
+					put_svarint(v - prev_dc, buffer);
+					prev_dc = v;
+				}else if(0 == v){
+					++run;
+				}else{
+					buffer.push_back(run);
+					put_svarint(v, buffer);
+					run = 0;
+				}
+			}
+			buffer.push_back(63);
+		}
+	}
+}
+static int lossy_dec_plane(const unsigned char *buffer, unsigned buflen, unsigned &pos, LossyPlane &plane, const int *quant, int bias){
+	int blk[64], coef[64];
+	int prev_dc = 0;
+	for(unsigned by = 0; by < plane.bh; ++by){
+		for(unsigned bx = 0; bx < plane.bw; ++bx){
+			memset(coef, 0, sizeof(coef));
+			int v;
+			if(!get_svarint(buffer, buflen, pos, v)){ return -2; }
+			prev_dc += (v > max_coef ? max_coef : (v < -max_coef ? -max_coef : v));
+			if(prev_dc > max_coef || prev_dc < -max_coef){ return -2; }
+			coef[0] = dequant(prev_dc, quant[0]);
+			int k = 1;
+			while(1){
+				if(pos >= buflen){ return -2; }
+				int run = buffer[pos++];
+				if(63 == run){ break; }
+				k += run;
+				if(k > 63){ return -2; }
+				if(!get_svarint(buffer, buflen, pos, v)){ return -2; }
+				coef[zigzag[k]] = dequant(v, quant[zigzag[k]]);
+				++k;
+			}
+			idct8x8(coef, blk);
+			for(int i = 0; i < 64; ++i){ blk[i] += bias; }
+			plane.set_block(bx, by, blk);
+		}
+	}
+	return 0;
+}
+
+static inline unsigned char clamp_u8(int v){
+	return (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+int lossy_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+){
+	int quality = lossy_quality;
+	if(quality < 1){ quality = 1; }
+	const unsigned cw = (w+1)/2, ch = (h+1)/2;
+	LossyPlane Y(w, h), Co(cw, ch), Cg(cw, ch);
+	
+	// YCoCg-R, with chroma summed over 2x2 cells then halved again to
+	// bring it to the same range as Y
+	for(unsigned j = 0; j < h; ++j){
+		const unsigned char *src = rgb + 3*j*stride;
+		int *y = Y.row(j);
+		int *co = Co.row(j/2);
+		int *cg = Cg.row(j/2);
+		for(unsigned i = 0; i < w; ++i){
+			int r = src[3*i+0], g = src[3*i+1], b = src[3*i+2];
+			int o = r - b;
+			int t = b + (o >> 1);
+			int gg = g - t;
+			y[i] = t + (gg >> 1);
+			co[i/2] += o;
+			cg[i/2] += gg;
+		}
+	}
+	for(unsigned j = 0; j < ch; ++j){
+		const int nj = (2*j+1 < h ? 2 : 1);
+		int *co = Co.row(j);
+		int *cg = Cg.row(j);
+		for(unsigned i = 0; i < cw; ++i){
+			const int n = 2 * nj * (2*i+1 < w ? 2 : 1);
+			co[i] = (co[i] >= 0 ? (co[i] + n/2) / n : -((-co[i] + n/2) / n));
+			cg[i] = (cg[i] >= 0 ? (cg[i] + n/2) / n : -((-cg[i] + n/2) / n));
+		}
+	}
+	Y.pad();
+	Co.pad();
+	Cg.pad();
+	
+	int qluma[64], qchroma[64];
+	quant_table(quality, quant_luma, qluma);
+	quant_table(quality, quant_chroma, qchroma);
+	buffer.reserve(buffer.size() + w*h/4);
+	buffer.push_back(quality);
+	lossy_enc_plane(Y, qluma, 128, buffer);
+	lossy_enc_plane(Co, qchroma, 0, buffer);
+	lossy_enc_plane(Cg, qchroma, 0, buffer);
+	return 0;
+}
+int lossy_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+){
+	if(0 == w || 0 == h){ return 0; }
+	if(buflen < 1){ return -2; }
+	const int quality = buffer[0];
+	if(quality < 1 || quality > 100){ return -2; }
+	const unsigned cw = (w+1)/2, ch = (h+1)/2;
+	LossyPlane Y(w, h), Co(cw, ch), Cg(cw, ch);
+	
+	int qluma[64], qchroma[64];
+	quant_table(quality, quant_luma, qluma);
+	quant_table(quality, quant_chroma, qchroma);
+	unsigned pos = 1;
+	int ret;
+	if(0 != (ret = lossy_dec_plane(buffer, buflen, pos, Y, qluma, 128))){ return ret; }
+	if(0 != (ret = lossy_dec_plane(buffer, buflen, pos, Co, qchroma, 0))){ return ret; }
+	if(0 != (ret = lossy_dec_plane(buffer, buflen, pos, Cg, qchroma, 0))){ return ret; }
+	
+	for(unsigned j = 0; j < h; ++j){
+		unsigned char *dst = rgb + 3*j*stride;
+		const int *y = Y.row(j);
+		const int *co = Co.row(j/2);
+		const int *cg = Cg.row(j/2);
+		for(unsigned i = 0; i < w; ++i){
+			int o = 2*co[i/2];
+			int gg = 2*cg[i/2];
+			int t = y[i] - (gg >> 1);
+			int g = gg + t;
+			int b = t - (o >> 1);
+			int r = b + o;
+			dst[3*i+0] = clamp_u8(r);
+			dst[3*i+1] = clamp_u8(g);
+			dst[3*i+2] = clamp_u8(b);
+		}
+	}
+	return 0;
+}
+
+// Entropy coded payload: the payload of the base method, run through
+// EntropyCoder. The intermediate payload lives in a per-thread scratch
+// buffer so that steady-state updates do not allocate.
+static thread_local std::vector<unsigned char> entropy_scratch;
+
+template <encoderproc base>
+int entropy_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+){
+	std::vector<unsigned char> &tmp = entropy_scratch;
+	tmp.clear();
+	int ret = base(rgb, stride, w, h, tmp);
+	if(0 != ret){ return ret; }
+	EntropyCoder::encode(tmp.empty() ? NULL : &tmp[0], tmp.size(), buffer);
+	return 0;
+}
+template <decoderproc base>
+int entropy_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+){
+	if(0 == w || 0 == h){ return 0; }
+	// No base method needs more than a few bytes per pixel, so anything
+	// claiming more is corrupt and not worth allocating for.
+	const int len = EntropyCoder::decoded_size(buffer, buflen);
+	if(len < 0 || (size_t)len > 8*(size_t)w*h + 1024){ return -2; }
+	std::vector<unsigned char> &tmp = entropy_scratch;
+	tmp.resize(len);
+	if(0 != EntropyCoder::decode(buffer, buflen, tmp.empty() ? NULL : &tmp[0], len)){ return -2; }
+	return base(tmp.empty() ? NULL : &tmp[0], len, rgb, stride, w, h);
+}
+
+// Sparse payload: a single fastlz block of
+//   h rows of (w+7)/8 mask bytes, bit i%8 of byte i/8 set for pixel i
+//   the RGB of each set pixel, in raster order
+static thread_local std::vector<unsigned char> sparse_scratch;
+
+int ImageCoder::encode_sparse(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	const unsigned char *mask,
+	std::vector<unsigned char> &buffer, unsigned bpp
+){
+	const size_t mask_row = (w + 7) / 8;
+	size_t count = 0;
+	for(unsigned j = 0; j < h; ++j){
+		const unsigned char *m = mask + (size_t)j*stride;
+		for(unsigned i = 0; i < w; ++i){
+			count += (0 != m[i]);
+		}
+	}
+	std::vector<unsigned char> &tmp = sparse_scratch;
+	tmp.assign(mask_row * h + 3*count, 0);
+	unsigned char *dst = &tmp[mask_row * h];
+	for(unsigned j = 0; j < h; ++j){
+		const unsigned char *m = mask + (size_t)j*stride;
+		const unsigned char *src = rgb + bpp*(size_t)j*stride;
+		unsigned char *bits = &tmp[mask_row * j];
+		for(unsigned i = 0; i < w; ++i){
+			if(!m[i]){ continue; }
+			bits[i/8] |= 1 << (i%8);
+			dst[0] = src[bpp*i+0];
+			dst[1] = src[bpp*i+1];
+			dst[2] = src[bpp*i+2];
+			dst += 3;
+		}
+	}
+	// fastlz wants at least 16 bytes of input
+	if(tmp.size() < 16){ tmp.resize(16); }
+	const size_t off = buffer.size();
+	buffer.resize(off + tmp.size() + (tmp.size()+19)/20 + 66);
+	const int sz = fastlz_compress_level(2, &tmp[0], tmp.size(), &buffer[off]);
+	buffer.resize(off + sz);
+	return 0;
+}
+
+int sparse_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+){
+	// Without a mask, every pixel is sent
+	std::vector<unsigned char> all((size_t)stride*h, 1);
+	return ImageCoder::encode_sparse(rgb, stride, w, h, all.empty() ? NULL : &all[0], buffer);
+}
+int sparse_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+){
+	if(0 == w || 0 == h){ return 0; }
+	if(0 == buflen){ return -2; }
+	const size_t mask_row = (w + 7) / 8;
+	const size_t mask_bytes = mask_row * h;
+	std::vector<unsigned char> &tmp = sparse_scratch;
+	tmp.resize(std::max(mask_bytes + 3*(size_t)w*h, (size_t)16));
+	const int sz = fastlz_decompress(buffer, buflen, &tmp[0], tmp.size());
+	if(sz <= 0 || (size_t)sz < mask_bytes){ return -2; }
+	const unsigned char *src = &tmp[mask_bytes], *end = &tmp[0] + sz;
+	for(unsigned j = 0; j < h; ++j){
+		const unsigned char *bits = &tmp[mask_row * j];
+		unsigned char *dst = rgb + 3*(size_t)j*stride;
+		for(unsigned i = 0; i < w; ++i){
+			if(!(bits[i/8] & (1 << (i%8)))){ continue; }
+			if(end - src < 3){ return -2; }
+			dst[3*i+0] = src[0];
+			dst[3*i+1] = src[1];
+			dst[3*i+2] = src[2];
+			src += 3;
+		}
+	}
+	return 0;
+}
+
+// Fill payload: 2 byte x, 2 byte y, R, G, B, tolerance
+static thread_local std::vector<FloodFill::Span> fill_scratch;
+
+int ImageCoder::encode_fill(
+	unsigned x, unsigned y, const unsigned char rgb[3], unsigned tolerance,
+	std::vector<unsigned char> &buffer
+){
+	const unsigned char fill[8] = {
+		(unsigned char)(x >> 8), (unsigned char)x,
+		(unsigned char)(y >> 8), (unsigned char)y,
+		rgb[0], rgb[1], rgb[2],
+		(unsigned char)std::min(tolerance, 255u)
+	};
+	buffer.insert(buffer.end(), fill, fill + 8);
+	return 0;
+}
+
+int fill_enc(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer
+){
+	// A fill is made by encode_fill, not found in pixels
+	return -1;
+}
+int fill_dec(
+	const unsigned char *buffer, unsigned buflen,
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+){
+	if(buflen < 8){ return -2; }
+	const unsigned x = (buffer[0] << 8) | buffer[1];
+	const unsigned y = (buffer[2] << 8) | buffer[3];
+	if(x >= w || y >= h){ return -2; }
+	std::vector<FloodFill::Span> &spans = fill_scratch;
+	FloodFill::find(rgb, 3, stride, w, h, x, y, buffer[7], spans);
+	for(size_t i = 0; i < spans.size(); ++i){
+		const FloodFill::Span &s = spans[i];
+		PixelOps::fill_rgb(rgb + 3*(s.x0 + (size_t)s.y*stride), s.x1 - s.x0 + 1, &buffer[4]);
+	}
+	return 0;
+}
+
+// The mask is still at the start of sparse_scratch, and the spans in
+// fill_scratch, since decoding them on this thread
+static void mark_written(int method, unsigned w, unsigned h, unsigned char *written){
+	if(0 == w || 0 == h){ return; }
+	if(ImageCoder::METHOD_SPARSE == method){
+		const size_t mask_row = (w + 7) / 8;
+		for(unsigned j = 0; j < h; ++j){
+			const unsigned char *bits = &sparse_scratch[mask_row * j];
+			unsigned char *dst = written + (size_t)w*j;
+			for(unsigned i = 0; i < w; ++i){
+				dst[i] = (bits[i/8] >> (i%8)) & 1;
+			}
+		}
+	}else if(ImageCoder::METHOD_FILL == method){
+		memset(written, 0, (size_t)w*h);
+		for(size_t i = 0; i < fill_scratch.size(); ++i){
+			const FloodFill::Span &s = fill_scratch[i];
+			memset(written + s.x0 + (size_t)s.y*w, 1, s.x1 - s.x0 + 1);
+		}
+	}else{
+		memset(written, 1, (size_t)w*h);
+	}
+}
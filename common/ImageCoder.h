@@ -1,18 +1,73 @@
 #ifndef IMAGE_CODER_H_INCLUDED
 #define IMAGE_CODER_H_INCLUDED
 
+#include <cstddef>
 #include <vector>
 
 namespace ImageCoder{
 
+enum Method{
+	METHOD_RAW            = 0, // uncompressed rows
+	METHOD_FASTLZ         = 1, // single fastlz block
+	METHOD_FASTLZ_TILED   = 2, // horizontal stripes of independent fastlz blocks
+	METHOD_LOSSY          = 3, // YCoCg 8x8 DCT, for photographic content
+	METHOD_FASTLZ_ENTROPY = 4, // METHOD_FASTLZ followed by an EntropyCoder stage
+	METHOD_LOSSY_ENTROPY  = 5, // METHOD_LOSSY followed by an EntropyCoder stage
+	METHOD_SPARSE         = 6, // only some pixels, picked by a mask; see encode_sparse
+	METHOD_FILL           = 7  // a flood fill, done again by the decoder; see encode_fill
+};
+
+// Picks the lossless method to send a w x h update with.
+int default_method(unsigned w, unsigned h);
+
+// Like default_method, but looks at the pixels and picks lossy coding for
+// large, photograph-like regions when it is enabled, and adds the entropy
+// coding stage where it pays off.
+int choose_method(const unsigned char *rgb, unsigned stride, unsigned w, unsigned h, unsigned bpp = 3);
+
+// Whether decoding a method's output gives back something other than
+// the pixels that were encoded.
+bool is_lossy(int method);
+
+// Quality of METHOD_LOSSY, 1 (smallest) to 100 (best); 0 disables
+// choose_method from ever picking it.
+void set_lossy_quality(int quality);
+int get_lossy_quality();
+
+// The pixels at rgb are packed RGB, or RGBX with bpp = 4. Either way they
+// are coded as RGB, so both ends need not agree on a layout. stride is in
+// pixels.
 int encode(int method,
 	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	std::vector<unsigned char> &buffer, unsigned bpp = 3
+);
+
+// Encodes with METHOD_SPARSE the pixels whose mask byte is not 0, mask
+// having a byte per pixel and the same stride as rgb. Decoding leaves the
+// other pixels as they are, which suits a few strokes over a photograph.
+int encode_sparse(
+	const unsigned char *rgb, unsigned stride, unsigned w, unsigned h,
+	const unsigned char *mask,
+	std::vector<unsigned char> &buffer, unsigned bpp = 3
+);
+
+// Encodes with METHOD_FILL a flood fill with rgb from (x, y), which are
+// relative to the update's rectangle, as FloodFill::find picks the pixels.
+// The rectangle must hold the whole fill. Decoding fills the pixels that
+// are already there, so it only gives the same result on the same image.
+// encode cannot produce this method.
+int encode_fill(
+	unsigned x, unsigned y, const unsigned char rgb[3], unsigned tolerance,
 	std::vector<unsigned char> &buffer
 );
 
+// If written is not NULL, it gets a byte per pixel of the w x h update:
+// 1 where decoding set the pixel, 0 where it left it as it was, as sparse
+// updates and fills do.
 int decode(int method,
 	const unsigned char *buffer, unsigned buflen,
-	unsigned char *rgb, unsigned stride, unsigned w, unsigned h
+	unsigned char *rgb, unsigned stride, unsigned w, unsigned h, unsigned bpp = 3,
+	unsigned char *written = NULL
 );
 
 } // namespace ImageCoder
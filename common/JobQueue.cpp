@@ -0,0 +1,62 @@
+#include "JobQueue.h"
+
+JobQueue::JobQueue():
+	busy(0),
+	stopping(false)
+{
+	thread = std::thread(&JobQueue::worker, this);
+}
+
+JobQueue::~JobQueue(){
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cv_work.notify_all();
+	thread.join();
+}
+
+void JobQueue::worker(){
+	std::unique_lock<std::mutex> lock(mutex);
+	while(1){
+		while(!stopping && jobs.empty()){
+			cv_work.wait(lock);
+		}
+		if(jobs.empty()){ return; }
+		Job job;
+		job.swap(jobs.front());
+		jobs.pop_front();
+		lock.unlock();
+		Completion completion = job();
+		lock.lock();
+		done.push_back(completion);
+	}
+}
+
+void JobQueue::post(const Job &job){
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		jobs.push_back(job);
+		++busy;
+	}
+	cv_work.notify_one();
+}
+
+void JobQueue::poll(){
+	std::deque<Completion> ready;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if(done.empty()){ return; }
+		ready.swap(done);
+		busy -= ready.size();
+	}
+	// Run without the lock so a completion can post follow-up jobs
+	for(size_t i = 0; i < ready.size(); ++i){
+		if(ready[i]){ ready[i](); }
+	}
+}
+
+unsigned JobQueue::pending(){
+	std::unique_lock<std::mutex> lock(mutex);
+	return busy;
+}
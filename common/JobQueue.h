@@ -0,0 +1,42 @@
+#ifndef JOB_QUEUE_H_INCLUDED
+#define JOB_QUEUE_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs slow work (image decode, conversion, PNG encoding) on a worker
+// thread, one job at a time in the order posted. A job returns a
+// completion, which poll() later runs on the owner's thread; that is the
+// only place a job's result may touch boards, connections or GL state.
+class JobQueue{
+public:
+	typedef std::function<void()> Completion;
+	typedef std::function<Completion()> Job;
+private:
+	std::mutex mutex;
+	std::condition_variable cv_work;
+	std::deque<Job> jobs;
+	std::deque<Completion> done;
+	std::thread thread;
+	unsigned busy; // jobs posted whose completion has not been taken yet
+	bool stopping;
+
+	void worker();
+public:
+	JobQueue();
+	// Finishes the jobs already posted; their completions are dropped.
+	~JobQueue();
+
+	void post(const Job &job);
+
+	// Runs the completions of finished jobs. Call once per frame.
+	void poll();
+
+	// Number of jobs posted whose completion has not run yet.
+	unsigned pending();
+};
+
+#endif // JOB_QUEUE_H_INCLUDED
@@ -0,0 +1,445 @@
+#include "PixelOps.h"
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define PIXEL_OPS_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXEL_OPS_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(PIXEL_OPS_SSE2)
+// Blends 16 bytes; c is the colour for each of them
+static inline void blend16(unsigned char *dst, const uint16_t *cover, const uint16_t *c){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k256 = _mm_set1_epi16(256);
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i d = _mm_loadu_si128((const __m128i*)dst);
+	const __m128i alo = _mm_loadu_si128((const __m128i*)cover);
+	const __m128i ahi = _mm_loadu_si128((const __m128i*)(cover + 8));
+	const __m128i clo = _mm_loadu_si128((const __m128i*)c);
+	const __m128i chi = _mm_loadu_si128((const __m128i*)(c + 8));
+	// Both products and their sum stay below 65536
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(k256, alo));
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(k256, ahi));
+	lo = _mm_add_epi16(_mm_add_epi16(lo, _mm_mullo_epi16(clo, alo)), half);
+	hi = _mm_add_epi16(_mm_add_epi16(hi, _mm_mullo_epi16(chi, ahi)), half);
+	_mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+}
+
+// Packs four RGBX pixels into the low 12 bytes, leaving the rest zero
+static inline __m128i pack_rgbx(__m128i v){
+	const __m128i low3 = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+	const __m128i high3 = _mm_set_epi32(0xffff, (int)0xff000000, 0xffff, (int)0xff000000);
+	// Six bytes at the bottom of each 64-bit half, then close the gap
+	const __m128i t = _mm_or_si128(_mm_and_si128(v, low3), _mm_and_si128(_mm_srli_epi64(v, 8), high3));
+	return _mm_or_si128(_mm_move_epi64(t), _mm_slli_si128(_mm_srli_si128(t, 8), 6));
+}
+
+// Writes 16 RGBX pixels, given four at a time, as 48 bytes of RGB
+static inline void store_rgbx16(unsigned char *dst, __m128i a, __m128i b, __m128i c, __m128i d){
+	a = pack_rgbx(a);
+	b = pack_rgbx(b);
+	c = pack_rgbx(c);
+	d = pack_rgbx(d);
+	_mm_storeu_si128((__m128i*)dst, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+	_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+	_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+}
+
+// Spreads four RGB pixels, in the low 12 bytes, to four RGBX pixels with
+// X = 255
+static inline __m128i unpack_rgb4(__m128i v){
+	const __m128i low6 = _mm_set_epi32(0, 0, 0xffff, (int)0xffffffff);
+	const __m128i low3 = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+	const __m128i next3 = _mm_set_epi32(0x00ffffff, 0, 0x00ffffff, 0);
+	// Two pixels at the bottom of each 64-bit half, then open the gap
+	const __m128i t = _mm_or_si128(_mm_and_si128(v, low6), _mm_slli_si128(_mm_and_si128(_mm_srli_si128(v, 6), low6), 8));
+	const __m128i x = _mm_set1_epi32((int)0xff000000);
+	return _mm_or_si128(_mm_or_si128(_mm_and_si128(t, low3), _mm_and_si128(_mm_slli_epi64(t, 8), next3)), x);
+}
+
+// Swaps the first and third byte of every 32-bit pixel
+static inline __m128i swap_rb(__m128i v){
+	const __m128i g = _mm_set1_epi32(0x0000ff00);
+	const __m128i rb = _mm_set1_epi32(0x000000ff);
+	return _mm_or_si128(_mm_or_si128(_mm_and_si128(v, g), _mm_slli_epi32(_mm_and_si128(v, rb), 16)), _mm_and_si128(_mm_srli_epi32(v, 16), rb));
+}
+#elif defined(PIXEL_OPS_NEON)
+static inline void blend16(unsigned char *dst, const uint16_t *cover, const uint16_t *c){
+	const uint16x8_t k256 = vdupq_n_u16(256);
+	const uint8x16_t d = vld1q_u8(dst);
+	const uint16x8_t alo = vld1q_u16(cover);
+	const uint16x8_t ahi = vld1q_u16(cover + 8);
+	uint16x8_t lo = vmulq_u16(vmovl_u8(vget_low_u8(d)), vsubq_u16(k256, alo));
+	uint16x8_t hi = vmulq_u16(vmovl_u8(vget_high_u8(d)), vsubq_u16(k256, ahi));
+	lo = vmlaq_u16(lo, vld1q_u16(c), alo);
+	hi = vmlaq_u16(hi, vld1q_u16(c + 8), ahi);
+	// Rounding narrow: (x + 128) >> 8
+	vst1q_u8(dst, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+}
+#endif
+
+// Blends bytes, cycling through the channels of color
+static void blend_bytes(unsigned char *dst, const uint16_t *cover, size_t bytes, const unsigned char *color, unsigned channels){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2) || defined(PIXEL_OPS_NEON)
+	// 16 bytes per step; the colour pattern comes round again every 48
+	// bytes, which is a whole number of pixels for 3 and 4 channels
+	uint16_t pattern[48];
+	for(unsigned j = 0; j < 48; ++j){
+		pattern[j] = color[j % channels];
+	}
+	unsigned phase = 0;
+	for(; i + 16 <= bytes; i += 16){
+		blend16(dst + i, cover + i, pattern + phase);
+		phase = (phase == 32 ? 0 : phase + 16);
+	}
+	if(i < bytes){
+		// Spans are short, so do the tail the same way through a copy
+		unsigned char d[16] = { 0 };
+		uint16_t a[16] = { 0 };
+		memcpy(d, dst + i, bytes - i);
+		memcpy(a, cover + i, 2*(bytes - i));
+		blend16(d, a, pattern + phase);
+		memcpy(dst + i, d, bytes - i);
+	}
+#else
+	for(; i < bytes; ++i){
+		const unsigned a = cover[i];
+		dst[i] = (unsigned char)((dst[i]*(256 - a) + color[i % channels]*a + 128) >> 8);
+	}
+#endif
+}
+
+void PixelOps::blend_rgb(unsigned char *dst, const uint16_t *cover, unsigned n, const unsigned char rgb[3]){
+	blend_bytes(dst, cover, 3*(size_t)n, rgb, 3);
+}
+
+void PixelOps::blend_rgba(unsigned char *dst, const uint16_t *cover, unsigned n, const unsigned char rgba[4]){
+	blend_bytes(dst, cover, 4*(size_t)n, rgba, 4);
+}
+
+// x/255 rounded to nearest, for x up to 255*255
+static inline unsigned div255(unsigned x){
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// D is the bytes per pixel of dst; a fourth byte is set to 255
+template <unsigned D>
+static void composite(unsigned char *dst, const unsigned char *bg, const unsigned char *ink, size_t n, unsigned char *changed){
+	for(size_t i = 0; i < n; ++i){
+		// Nearly all ink is either solid or absent
+		const unsigned keep = 255 - ink[3];
+		unsigned char out[3];
+		if(0 == keep){
+			out[0] = ink[0];
+			out[1] = ink[1];
+			out[2] = ink[2];
+		}else if(255 == keep){
+			out[0] = bg[0];
+			out[1] = bg[1];
+			out[2] = bg[2];
+		}else{
+			out[0] = (unsigned char)(ink[0] + div255(bg[0] * keep));
+			out[1] = (unsigned char)(ink[1] + div255(bg[1] * keep));
+			out[2] = (unsigned char)(ink[2] + div255(bg[2] * keep));
+		}
+		if(changed){
+			changed[i] = (out[0] != dst[0] || out[1] != dst[1] || out[2] != dst[2]);
+		}
+		dst[0] = out[0];
+		dst[1] = out[1];
+		dst[2] = out[2];
+		if(4 == D){ dst[3] = 255; }
+		dst += D;
+		bg += 3;
+		ink += 4;
+	}
+}
+
+void PixelOps::composite_rgb(unsigned char *dst, const unsigned char *bg, const unsigned char *ink, size_t n, unsigned char *changed){
+	composite<3>(dst, bg, ink, n, changed);
+}
+
+void PixelOps::composite_rgbx(unsigned char *dst, const unsigned char *bg, const unsigned char *ink, size_t n, unsigned char *changed){
+	composite<4>(dst, bg, ink, n, changed);
+}
+
+void PixelOps::fill_rgb(unsigned char *dst, size_t n, const unsigned char rgb[3]){
+	const unsigned char r = rgb[0], g = rgb[1], b = rgb[2];
+	if(n < 16){
+		// Pen strokes are mostly short spans, which are not worth the setup
+		for(size_t k = 0; k < n; ++k){
+			dst[0] = r;
+			dst[1] = g;
+			dst[2] = b;
+			dst += 3;
+		}
+		return;
+	}
+	// 16 pixels make 48 bytes, which is three whole vectors. Since the
+	// last 48 bytes start on a pixel too, the tail is one more, overlapping,
+	// step rather than a loop.
+	const size_t bytes = 3*n;
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	const int w0 = (int)(r | g << 8 | b << 16 | (unsigned)r << 24);
+	const int w1 = (int)(g | b << 8 | r << 16 | (unsigned)g << 24);
+	const int w2 = (int)(b | r << 8 | g << 16 | (unsigned)b << 24);
+	const __m128i p0 = _mm_setr_epi32(w0, w1, w2, w0);
+	const __m128i p1 = _mm_setr_epi32(w1, w2, w0, w1);
+	const __m128i p2 = _mm_setr_epi32(w2, w0, w1, w2);
+	for(;; i += 48){
+		if(i + 48 > bytes){ i = bytes - 48; }
+		_mm_storeu_si128((__m128i*)(dst + i), p0);
+		_mm_storeu_si128((__m128i*)(dst + i + 16), p1);
+		_mm_storeu_si128((__m128i*)(dst + i + 32), p2);
+		if(i + 48 == bytes){ break; }
+	}
+#elif defined(PIXEL_OPS_NEON)
+	uint8x16x3_t p;
+	p.val[0] = vdupq_n_u8(r);
+	p.val[1] = vdupq_n_u8(g);
+	p.val[2] = vdupq_n_u8(b);
+	for(;; i += 48){
+		if(i + 48 > bytes){ i = bytes - 48; }
+		// vst3q interleaves the planes into RGB order
+		vst3q_u8(dst + i, p);
+		if(i + 48 == bytes){ break; }
+	}
+#else
+	unsigned char pattern[48];
+	for(unsigned j = 0; j < 48; j += 3){
+		pattern[j] = r;
+		pattern[j+1] = g;
+		pattern[j+2] = b;
+	}
+	for(;; i += 48){
+		if(i + 48 > bytes){ i = bytes - 48; }
+		memcpy(dst + i, pattern, 48);
+		if(i + 48 == bytes){ break; }
+	}
+#endif
+}
+
+void PixelOps::fill_rect_rgb(unsigned char *dst, size_t stride, unsigned w, unsigned h, const unsigned char rgb[3]){
+	if(stride == 3*(size_t)w){
+		fill_rgb(dst, (size_t)w*h, rgb);
+		return;
+	}
+	for(unsigned j = 0; j < h; ++j){
+		fill_rgb(dst + j*stride, w, rgb);
+	}
+}
+
+void PixelOps::rgb_from_rgbx(unsigned char *dst, const unsigned char *src, size_t n){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	for(; i + 16 <= n; i += 16){
+		const __m128i *s = (const __m128i*)(src + 4*i);
+		store_rgbx16(dst + 3*i, _mm_loadu_si128(s), _mm_loadu_si128(s + 1), _mm_loadu_si128(s + 2), _mm_loadu_si128(s + 3));
+	}
+#elif defined(PIXEL_OPS_NEON)
+	for(; i + 16 <= n; i += 16){
+		const uint8x16x4_t s = vld4q_u8(src + 4*i);
+		uint8x16x3_t d;
+		d.val[0] = s.val[0];
+		d.val[1] = s.val[1];
+		d.val[2] = s.val[2];
+		vst3q_u8(dst + 3*i, d);
+	}
+#endif
+	for(; i < n; ++i){
+		dst[3*i + 0] = src[4*i + 0];
+		dst[3*i + 1] = src[4*i + 1];
+		dst[3*i + 2] = src[4*i + 2];
+	}
+}
+
+void PixelOps::rgbx_from_rgb(unsigned char *dst, const unsigned char *src, size_t n){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	for(; i + 16 <= n; i += 16){
+		const __m128i *s = (const __m128i*)(src + 3*i);
+		const __m128i a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1), c = _mm_loadu_si128(s + 2);
+		__m128i *d = (__m128i*)(dst + 4*i);
+		_mm_storeu_si128(d, unpack_rgb4(a));
+		_mm_storeu_si128(d + 1, unpack_rgb4(_mm_or_si128(_mm_srli_si128(a, 12), _mm_slli_si128(b, 4))));
+		_mm_storeu_si128(d + 2, unpack_rgb4(_mm_or_si128(_mm_srli_si128(b, 8), _mm_slli_si128(c, 8))));
+		_mm_storeu_si128(d + 3, unpack_rgb4(_mm_srli_si128(c, 4)));
+	}
+#elif defined(PIXEL_OPS_NEON)
+	for(; i + 16 <= n; i += 16){
+		const uint8x16x3_t s = vld3q_u8(src + 3*i);
+		uint8x16x4_t d;
+		d.val[0] = s.val[0];
+		d.val[1] = s.val[1];
+		d.val[2] = s.val[2];
+		d.val[3] = vdupq_n_u8(255);
+		vst4q_u8(dst + 4*i, d);
+	}
+#endif
+	for(; i < n; ++i){
+		dst[4*i + 0] = src[3*i + 0];
+		dst[4*i + 1] = src[3*i + 1];
+		dst[4*i + 2] = src[3*i + 2];
+		dst[4*i + 3] = 255;
+	}
+}
+
+#if defined(PIXEL_OPS_SSE2)
+// All ones for each RGBX pixel whose bytes are within lo to hi, else 0
+static inline __m128i in_range4(__m128i v, __m128i lo, __m128i hi){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i in = _mm_and_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, hi), zero), _mm_cmpeq_epi8(_mm_subs_epu8(lo, v), zero));
+	return _mm_cmpeq_epi32(in, _mm_set1_epi32(-1));
+}
+// 0 or 1 for each of 16 RGBX pixels
+static inline __m128i match16(__m128i a, __m128i b, __m128i c, __m128i d, __m128i lo, __m128i hi){
+	const __m128i ab = _mm_packs_epi32(in_range4(a, lo, hi), in_range4(b, lo, hi));
+	const __m128i cd = _mm_packs_epi32(in_range4(c, lo, hi), in_range4(d, lo, hi));
+	return _mm_and_si128(_mm_packs_epi16(ab, cd), _mm_set1_epi8(1));
+}
+#endif
+
+void PixelOps::match_rgb(unsigned char *mask, const unsigned char *src, size_t n, const unsigned char lo[3], const unsigned char hi[3]){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	// The X that unpack_rgb4 adds is always in range
+	const __m128i vlo = _mm_set1_epi32(lo[0] | lo[1] << 8 | lo[2] << 16);
+	const __m128i vhi = _mm_set1_epi32((int)(hi[0] | hi[1] << 8 | hi[2] << 16 | 0xff000000u));
+	for(; i + 16 <= n; i += 16){
+		const __m128i *s = (const __m128i*)(src + 3*i);
+		const __m128i a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1), c = _mm_loadu_si128(s + 2);
+		_mm_storeu_si128((__m128i*)(mask + i), match16(
+			unpack_rgb4(a),
+			unpack_rgb4(_mm_or_si128(_mm_srli_si128(a, 12), _mm_slli_si128(b, 4))),
+			unpack_rgb4(_mm_or_si128(_mm_srli_si128(b, 8), _mm_slli_si128(c, 8))),
+			unpack_rgb4(_mm_srli_si128(c, 4)),
+			vlo, vhi
+		));
+	}
+#elif defined(PIXEL_OPS_NEON)
+	const uint8x16_t one = vdupq_n_u8(1);
+	for(; i + 16 <= n; i += 16){
+		const uint8x16x3_t s = vld3q_u8(src + 3*i);
+		uint8x16_t m = vandq_u8(vcgeq_u8(s.val[0], vdupq_n_u8(lo[0])), vcleq_u8(s.val[0], vdupq_n_u8(hi[0])));
+		m = vandq_u8(m, vandq_u8(vcgeq_u8(s.val[1], vdupq_n_u8(lo[1])), vcleq_u8(s.val[1], vdupq_n_u8(hi[1]))));
+		m = vandq_u8(m, vandq_u8(vcgeq_u8(s.val[2], vdupq_n_u8(lo[2])), vcleq_u8(s.val[2], vdupq_n_u8(hi[2]))));
+		vst1q_u8(mask + i, vandq_u8(m, one));
+	}
+#endif
+	for(; i < n; ++i){
+		const unsigned char *p = src + 3*i;
+		mask[i] = (p[0] >= lo[0] && p[0] <= hi[0] && p[1] >= lo[1] && p[1] <= hi[1] && p[2] >= lo[2] && p[2] <= hi[2]);
+	}
+}
+
+void PixelOps::match_rgbx(unsigned char *mask, const unsigned char *src, size_t n, const unsigned char lo[3], const unsigned char hi[3]){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	const __m128i vlo = _mm_set1_epi32(lo[0] | lo[1] << 8 | lo[2] << 16);
+	const __m128i vhi = _mm_set1_epi32((int)(hi[0] | hi[1] << 8 | hi[2] << 16 | 0xff000000u));
+	for(; i + 16 <= n; i += 16){
+		const __m128i *s = (const __m128i*)(src + 4*i);
+		_mm_storeu_si128((__m128i*)(mask + i), match16(
+			_mm_loadu_si128(s), _mm_loadu_si128(s + 1), _mm_loadu_si128(s + 2), _mm_loadu_si128(s + 3),
+			vlo, vhi
+		));
+	}
+#elif defined(PIXEL_OPS_NEON)
+	const uint8x16_t one = vdupq_n_u8(1);
+	for(; i + 16 <= n; i += 16){
+		const uint8x16x4_t s = vld4q_u8(src + 4*i);
+		uint8x16_t m = vandq_u8(vcgeq_u8(s.val[0], vdupq_n_u8(lo[0])), vcleq_u8(s.val[0], vdupq_n_u8(hi[0])));
+		m = vandq_u8(m, vandq_u8(vcgeq_u8(s.val[1], vdupq_n_u8(lo[1])), vcleq_u8(s.val[1], vdupq_n_u8(hi[1]))));
+		m = vandq_u8(m, vandq_u8(vcgeq_u8(s.val[2], vdupq_n_u8(lo[2])), vcleq_u8(s.val[2], vdupq_n_u8(hi[2]))));
+		vst1q_u8(mask + i, vandq_u8(m, one));
+	}
+#endif
+	for(; i < n; ++i){
+		const unsigned char *p = src + 4*i;
+		mask[i] = (p[0] >= lo[0] && p[0] <= hi[0] && p[1] >= lo[1] && p[1] <= hi[1] && p[2] >= lo[2] && p[2] <= hi[2]);
+	}
+}
+
+void PixelOps::rgb_from_bgrx(unsigned char *dst, const unsigned char *src, size_t n){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	for(; i + 16 <= n; i += 16){
+		const __m128i *s = (const __m128i*)(src + 4*i);
+		store_rgbx16(dst + 3*i,
+			swap_rb(_mm_loadu_si128(s)), swap_rb(_mm_loadu_si128(s + 1)),
+			swap_rb(_mm_loadu_si128(s + 2)), swap_rb(_mm_loadu_si128(s + 3))
+		);
+	}
+#elif defined(PIXEL_OPS_NEON)
+	for(; i + 16 <= n; i += 16){
+		const uint8x16x4_t s = vld4q_u8(src + 4*i);
+		uint8x16x3_t d;
+		d.val[0] = s.val[2];
+		d.val[1] = s.val[1];
+		d.val[2] = s.val[0];
+		vst3q_u8(dst + 3*i, d);
+	}
+#endif
+	for(; i < n; ++i){
+		dst[3*i + 0] = src[4*i + 2];
+		dst[3*i + 1] = src[4*i + 1];
+		dst[3*i + 2] = src[4*i + 0];
+	}
+}
+
+void PixelOps::rgb_from_bgr(unsigned char *dst, const unsigned char *src, size_t n){
+	size_t i = 0;
+#if defined(PIXEL_OPS_NEON)
+	for(; i + 16 <= n; i += 16){
+		const uint8x16x3_t s = vld3q_u8(src + 3*i);
+		uint8x16x3_t d;
+		d.val[0] = s.val[2];
+		d.val[1] = s.val[1];
+		d.val[2] = s.val[0];
+		vst3q_u8(dst + 3*i, d);
+	}
+#endif
+	// SSE2 has no byte shuffle to move pixels that straddle vectors
+	for(; i < n; ++i){
+		dst[3*i + 0] = src[3*i + 2];
+		dst[3*i + 1] = src[3*i + 1];
+		dst[3*i + 2] = src[3*i + 0];
+	}
+}
+
+void PixelOps::rgb_from_gray(unsigned char *dst, const unsigned char *src, size_t n){
+	size_t i = 0;
+#if defined(PIXEL_OPS_SSE2)
+	for(; i + 16 <= n; i += 16){
+		// Widen each byte to four copies, then pack as if it were RGBX
+		const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		const __m128i lo = _mm_unpacklo_epi8(s, s);
+		const __m128i hi = _mm_unpackhi_epi8(s, s);
+		store_rgbx16(dst + 3*i,
+			_mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo),
+			_mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi)
+		);
+	}
+#elif defined(PIXEL_OPS_NEON)
+	for(; i + 16 <= n; i += 16){
+		const uint8x16_t s = vld1q_u8(src + i);
+		uint8x16x3_t d;
+		d.val[0] = s;
+		d.val[1] = s;
+		d.val[2] = s;
+		vst3q_u8(dst + 3*i, d);
+	}
+#endif
+	for(; i < n; ++i){
+		dst[3*i + 0] = src[i];
+		dst[3*i + 1] = src[i];
+		dst[3*i + 2] = src[i];
+	}
+}
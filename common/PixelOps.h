@@ -0,0 +1,53 @@
+#ifndef PIXEL_OPS_H_INCLUDED
+#define PIXEL_OPS_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernels that work on a span of 8-bit RGB pixels at a time, with SSE2 and
+// NEON versions next to the plain C++ one. They only use exact integer
+// arithmetic, so every build produces the same pixels as every other,
+// which lets boards rasterized on different machines match.
+namespace PixelOps{
+
+// Blends rgb into the n pixels at dst. cover holds a weight from 0 to 256
+// for every byte, so three per pixel, and each byte becomes
+// (dst*(256-a) + c*a + 128) >> 8.
+void blend_rgb(unsigned char *dst, const uint16_t *cover, unsigned n, const unsigned char rgb[3]);
+
+// The same for 4 bytes per pixel, with four weights per pixel.
+void blend_rgba(unsigned char *dst, const uint16_t *cover, unsigned n, const unsigned char rgba[4]);
+
+// Puts n pixels of premultiplied RGBA ink over the RGB background bg and
+// writes the result to dst: ink + bg*(255 - alpha)/255, rounded. If
+// changed is not NULL, it gets a 1 for each pixel of dst that changed and
+// a 0 for the others.
+void composite_rgb(unsigned char *dst, const unsigned char *bg, const unsigned char *ink, size_t n, unsigned char *changed);
+// The same, writing dst as RGBX with X = 255
+void composite_rgbx(unsigned char *dst, const unsigned char *bg, const unsigned char *ink, size_t n, unsigned char *changed);
+
+// Sets the n pixels at dst to rgb.
+void fill_rgb(unsigned char *dst, size_t n, const unsigned char rgb[3]);
+
+// Sets a w x h block of pixels to rgb, with stride bytes from one row to
+// the next. Rows that follow each other without a gap are done as one run.
+void fill_rect_rgb(unsigned char *dst, size_t stride, unsigned w, unsigned h, const unsigned char rgb[3]);
+
+// Sets mask[i] to 1 where R, G and B of pixel i are each within lo to hi,
+// and to 0 elsewhere, for n pixels. match_rgbx takes RGBX pixels.
+void match_rgb(unsigned char *mask, const unsigned char *src, size_t n, const unsigned char lo[3], const unsigned char hi[3]);
+void match_rgbx(unsigned char *mask, const unsigned char *src, size_t n, const unsigned char lo[3], const unsigned char hi[3]);
+
+// Convert n pixels of another layout into packed RGB at dst. In the 4 byte
+// layouts the fourth byte, usually alpha, is dropped. dst must not overlap
+// src.
+void rgb_from_rgbx(unsigned char *dst, const unsigned char *src, size_t n);
+void rgb_from_bgrx(unsigned char *dst, const unsigned char *src, size_t n);
+void rgb_from_bgr(unsigned char *dst, const unsigned char *src, size_t n);
+void rgb_from_gray(unsigned char *dst, const unsigned char *src, size_t n);
+// And back to RGBX from packed RGB, with X = 255
+void rgbx_from_rgb(unsigned char *dst, const unsigned char *src, size_t n);
+
+} // namespace PixelOps
+
+#endif // PIXEL_OPS_H_INCLUDED
@@ -0,0 +1,268 @@
+#include "PngReader.h"
+#include "lodepng.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// Keeps the scaler's per-row sums within 32 bits
+static const unsigned max_dimension = 1u << 24;
+
+// Shrinks a stream of rows from sw x sh to dw x dh RGB by area averaging.
+// Measured in units of 1/dw of a source pixel, source column i spans
+// [i*dw, (i+1)*dw) and destination column x spans [x*sw, (x+1)*sw), so the
+// weight of each source pixel in a destination pixel is an integer overlap.
+// Since dw <= sw, a source pixel touches at most two destination pixels.
+// Rows work the same way with sh and dh. Source rows are summed down into
+// the current destination row first, which is one multiply-add per byte,
+// and only summed across once a destination row is complete.
+class AreaScaler{
+	unsigned sw, sh, dw, dh, bpp;
+	unsigned char *out;
+	std::vector<unsigned> col;  // destination column of each source column
+	std::vector<unsigned> colw; // its weight there, the rest goes to col+1
+	std::vector<unsigned> vsum; // source rows of the current destination row, summed down
+	std::vector<unsigned long long> hsum;
+	double inv_area;
+	unsigned sy;
+
+	void emit_row(unsigned y){
+		std::fill(hsum.begin(), hsum.end(), 0ull);
+		const unsigned *v = &vsum[0];
+		for(unsigned i = 0; i < sw; ++i){
+			unsigned long long *s = &hsum[3*col[i]];
+			const unsigned a = colw[i], b = dw - a;
+			s[0] += (unsigned long long)v[0] * a;
+			s[1] += (unsigned long long)v[1] * a;
+			s[2] += (unsigned long long)v[2] * a;
+			s[3] += (unsigned long long)v[0] * b;
+			s[4] += (unsigned long long)v[1] * b;
+			s[5] += (unsigned long long)v[2] * b;
+			v += bpp;
+		}
+		unsigned char *dst = out + 3*(size_t)dw*y;
+		for(unsigned c = 0; c < 3*dw; ++c){
+			dst[c] = (unsigned char)((double)hsum[c] * inv_area + 0.5);
+		}
+	}
+public:
+	// bpp is the bytes per source pixel, with RGB first
+	AreaScaler(unsigned sw_, unsigned sh_, unsigned dw_, unsigned dh_, unsigned bpp_, unsigned char *out_):
+		sw(sw_), sh(sh_), dw(dw_), dh(dh_), bpp(bpp_), out(out_), sy(0)
+	{
+		inv_area = 1.0 / ((double)sw * (double)sh);
+		if(sw == dw && sh == dh){ return; }
+		col.resize(sw);
+		colw.resize(sw);
+		for(unsigned i = 0; i < sw; ++i){
+			unsigned long long start = (unsigned long long)i * dw;
+			unsigned x = (unsigned)(start / sw);
+			unsigned long long boundary = (unsigned long long)(x+1) * sw;
+			col[i] = x;
+			colw[i] = (start + dw <= boundary ? dw : (unsigned)(boundary - start));
+		}
+		vsum.assign((size_t)bpp*sw, 0u);
+		hsum.resize(3*(dw+1));
+	}
+	void push_row(const unsigned char *row){
+		if(sy >= sh){ return; }
+		if(sw == dw && sh == dh){
+			unsigned char *dst = out + 3*(size_t)dw*sy++;
+			if(3 == bpp){
+				memcpy(dst, row, 3*(size_t)dw);
+				return;
+			}
+			for(unsigned i = 0; i < dw; ++i){
+				dst[0] = row[0];
+				dst[1] = row[1];
+				dst[2] = row[2];
+				dst += 3;
+				row += bpp;
+			}
+			return;
+		}
+
+		const unsigned long long start = (unsigned long long)sy * dh;
+		const unsigned y = (unsigned)(start / sh);
+		const unsigned long long boundary = (unsigned long long)(y+1) * sh;
+		const unsigned a = (start + dh <= boundary ? dh : (unsigned)(boundary - start));
+		const size_t n = vsum.size();
+		unsigned *v = &vsum[0];
+		for(size_t c = 0; c < n; ++c){
+			v[c] += row[c] * a;
+		}
+		if(start + dh >= boundary){
+			emit_row(y);
+			const unsigned b = dh - a;
+			for(size_t c = 0; c < n; ++c){
+				v[c] = row[c] * b;
+			}
+		}
+		++sy;
+	}
+};
+
+// Largest size with the aspect ratio of sw x sh that fits in maxw x maxh,
+// or sw x sh itself if that already fits.
+static void fit_size(unsigned sw, unsigned sh, unsigned maxw, unsigned maxh, unsigned &dw, unsigned &dh){
+	dw = sw;
+	dh = sh;
+	if(sw <= maxw && sh <= maxh){ return; }
+	if((unsigned long long)sw * maxh >= (unsigned long long)sh * maxw){
+		dw = maxw;
+		dh = (unsigned)(((unsigned long long)sh * maxw + sw/2) / sw);
+	}else{
+		dh = maxh;
+		dw = (unsigned)(((unsigned long long)sw * maxh + sh/2) / sh);
+	}
+	if(dw < 1){ dw = 1; }
+	if(dh < 1){ dh = 1; }
+}
+
+// Collects inflated bytes into scanlines and feeds each one, unfiltered
+// and in RGB order, to the scaler.
+struct RowDecoder{
+	AreaScaler *scaler;
+	const LodePNGColorMode *mode_in;
+	LodePNGColorMode mode_rgb;
+	unsigned w, h, rows;
+	unsigned direct_bpp; // 3 or 4 if rows are used as they are, else 0
+	size_t linebytes, bytewidth, fill;
+	std::vector<unsigned char> cur, prev, rgb; // cur and prev hold the filter byte too
+};
+
+static unsigned on_inflated(void *user, const unsigned char *data, size_t size){
+	RowDecoder &d = *(RowDecoder*)user;
+	while(size > 0){
+		size_t n = d.cur.size() - d.fill;
+		if(n > size){ n = size; }
+		memcpy(&d.cur[d.fill], data, n);
+		d.fill += n;
+		data += n;
+		size -= n;
+		if(d.fill < d.cur.size()){ break; }
+
+		if(d.rows >= d.h){ return 91; } // more data than the image holds
+		unsigned error = lodepng_unfilter_scanline(&d.cur[1], &d.cur[1], d.rows > 0 ? &d.prev[1] : NULL, d.bytewidth, d.cur[0], d.linebytes);
+		if(error){ return error; }
+		if(d.direct_bpp){
+			d.scaler->push_row(&d.cur[1]);
+		}else{
+			error = lodepng_convert(&d.rgb[0], &d.cur[1], &d.mode_rgb, d.mode_in, d.w, 1);
+			if(error){ return error; }
+			d.scaler->push_row(&d.rgb[0]);
+		}
+		d.cur.swap(d.prev);
+		d.fill = 0;
+		++d.rows;
+	}
+	return 0;
+}
+
+struct ColorMode{
+	LodePNGColorMode mode;
+	ColorMode(){ lodepng_color_mode_init(&mode); }
+	~ColorMode(){ lodepng_color_mode_cleanup(&mode); }
+};
+
+unsigned PngReader::decode_rgb_fit(
+	std::vector<unsigned char> &rgb, unsigned &w, unsigned &h,
+	unsigned char *png, size_t pngsize, unsigned maxw, unsigned maxh
+){
+	unsigned sw, sh;
+	unsigned interlace;
+	ColorMode color;
+	LodePNGDecompressSettings zlibsettings;
+	{
+		LodePNGState state;
+		lodepng_state_init(&state);
+		unsigned error = lodepng_inspect(&sw, &sh, &state, png, pngsize);
+		color.mode.colortype = state.info_png.color.colortype;
+		color.mode.bitdepth = state.info_png.color.bitdepth;
+		interlace = state.info_png.interlace_method;
+		zlibsettings = state.decoder.zlibsettings;
+		lodepng_state_cleanup(&state);
+		if(error){ return error; }
+	}
+	if(sw > max_dimension || sh > max_dimension){ return 92; }
+
+	fit_size(sw, sh, maxw, maxh, w, h);
+	rgb.resize(3*(size_t)w*h);
+	if(interlace){
+		// Adam7 passes cannot be streamed into rows, so decode it all
+		unsigned char *full = NULL;
+		unsigned error = lodepng_decode24(&full, &sw, &sh, png, pngsize);
+		if(!error){
+			AreaScaler scaler(sw, sh, w, h, 3, &rgb[0]);
+			for(unsigned j = 0; j < sh; ++j){
+				scaler.push_row(full + 3*(size_t)sw*j);
+			}
+		}
+		free(full);
+		return error;
+	}
+
+	// Gather the IDAT payloads at the start of png, picking up the palette
+	// on the way. Everything before the current chunk has been read already.
+	size_t idat = 0;
+	const unsigned char *end = png + pngsize;
+	unsigned char *chunk = png + 33; // signature and IHDR
+	while(1){
+		if(end - chunk < 12){ return 30; }
+		const unsigned len = lodepng_chunk_length(chunk);
+		if(len > (size_t)(end - chunk) - 12){ return 30; }
+		const unsigned char *data = chunk + 8;
+		const bool is_idat = lodepng_chunk_type_equals(chunk, "IDAT");
+		// The zlib Adler-32 already covers the image data
+		if(!is_idat && lodepng_chunk_check_crc(chunk)){ return 57; }
+		if(is_idat){
+			memmove(png + idat, data, len);
+			idat += len;
+		}else if(lodepng_chunk_type_equals(chunk, "PLTE")){
+			for(unsigned i = 0; i + 2 < len; i += 3){
+				lodepng_palette_add(&color.mode, data[i], data[i+1], data[i+2], 255);
+			}
+		}else if(lodepng_chunk_type_equals(chunk, "IEND")){
+			break;
+		}
+		chunk += 12 + len;
+	}
+
+	RowDecoder d;
+	const unsigned bpp = lodepng_get_bpp(&color.mode);
+	d.mode_in = &color.mode;
+	lodepng_color_mode_init(&d.mode_rgb);
+	d.mode_rgb.colortype = LCT_RGB;
+	d.mode_rgb.bitdepth = 8;
+	d.w = sw;
+	d.h = sh;
+	d.rows = 0;
+	d.direct_bpp = 0;
+	if(8 == color.mode.bitdepth && LCT_RGB == color.mode.colortype){ d.direct_bpp = 3; }
+	if(8 == color.mode.bitdepth && LCT_RGBA == color.mode.colortype){ d.direct_bpp = 4; }
+	d.linebytes = ((size_t)sw * bpp + 7) / 8;
+	d.bytewidth = (bpp + 7) / 8;
+	d.fill = 0;
+	d.cur.resize(1 + d.linebytes);
+	d.prev.resize(1 + d.linebytes);
+	if(!d.direct_bpp){ d.rgb.resize(3*(size_t)sw); }
+	AreaScaler scaler(sw, sh, w, h, d.direct_bpp ? d.direct_bpp : 3, &rgb[0]);
+	d.scaler = &scaler;
+
+	unsigned error = lodepng_zlib_decompress_stream(png, idat, &zlibsettings, on_inflated, &d);
+	if(!error && (d.rows != sh || d.fill != 0)){ error = 91; }
+	return error;
+}
+
+unsigned PngReader::load_rgb_fit(
+	std::vector<unsigned char> &rgb, unsigned &w, unsigned &h,
+	const std::string &filename, unsigned maxw, unsigned maxh
+){
+	unsigned char *png = NULL;
+	size_t pngsize = 0;
+	unsigned error = lodepng_load_file(&png, &pngsize, filename.c_str());
+	if(!error){
+		error = decode_rgb_fit(rgb, w, h, png, pngsize, maxw, maxh);
+	}
+	free(png);
+	return error;
+}
@@ -0,0 +1,30 @@
+#ifndef PNG_READER_H_INCLUDED
+#define PNG_READER_H_INCLUDED
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// PNG decoding for pasting into a board. Scanlines are inflated, unfiltered
+// and shrunk one at a time, so only the compressed file, a couple of rows
+// and the result are ever in memory, however big the picture is.
+namespace PngReader{
+
+// Decodes png to tightly packed 8-bit RGB, shrunk with an area filter to fit
+// inside maxw x maxh. The aspect ratio is kept and images are never enlarged.
+// Alpha is dropped. w and h receive the size of the result. The IDAT data is
+// gathered in place, so png is clobbered. Returns 0 or a lodepng error code.
+unsigned decode_rgb_fit(
+	std::vector<unsigned char> &rgb, unsigned &w, unsigned &h,
+	unsigned char *png, size_t pngsize, unsigned maxw, unsigned maxh
+);
+
+// Like decode_rgb_fit, reading the PNG from filename.
+unsigned load_rgb_fit(
+	std::vector<unsigned char> &rgb, unsigned &w, unsigned &h,
+	const std::string &filename, unsigned maxw, unsigned maxh
+);
+
+} // namespace PngReader
+
+#endif // PNG_READER_H_INCLUDED
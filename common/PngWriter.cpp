@@ -0,0 +1,222 @@
+#include "PngWriter.h"
+#include "lodepng.h"
+#include "ThreadPool.h"
+#include <cstdlib>
+#include <cstring>
+
+// Target amount of filtered data per band. Every band starts over with an
+// empty deflate window, so much smaller bands start to cost ratio.
+static const size_t band_bytes = 512*1024;
+// Incremental trades some of that ratio for redoing less after a change
+static const size_t incremental_band_bytes = 128*1024;
+
+static void put_u32(std::vector<unsigned char> &out, unsigned v){
+	out.push_back(v >> 24);
+	out.push_back(v >> 16);
+	out.push_back(v >> 8);
+	out.push_back(v);
+}
+
+static const unsigned adler_base = 65521;
+
+static unsigned adler32(const unsigned char *data, size_t len){
+	unsigned s1 = 1, s2 = 0;
+	while(len > 0){
+		// 5552 is the most bytes that can be summed before s2 overflows
+		size_t n = (len > 5552 ? 5552 : len);
+		len -= n;
+		while(n--){
+			s1 += *data++;
+			s2 += s1;
+		}
+		s1 %= adler_base;
+		s2 %= adler_base;
+	}
+	return (s2 << 16) | s1;
+}
+
+// Adler-32 of A followed by B, from those of A and B and the length of B
+static unsigned adler32_combine(unsigned a, unsigned b, size_t len_b){
+	const unsigned rem = len_b % adler_base;
+	unsigned s1 = a & 0xffff;
+	unsigned s2 = (unsigned)(((unsigned long long)rem * s1) % adler_base);
+	s1 += (b & 0xffff) + adler_base - 1;
+	s2 += (a >> 16) + (b >> 16) + adler_base - rem;
+	if(s1 >= adler_base){ s1 -= adler_base; }
+	if(s1 >= adler_base){ s1 -= adler_base; }
+	if(s2 >= 2*adler_base){ s2 -= 2*adler_base; }
+	if(s2 >= adler_base){ s2 -= adler_base; }
+	return (s2 << 16) | s1;
+}
+
+// Appends a chunk whose data is already at the end of png, behind an
+// 8 byte gap for the length and type starting at off.
+static void finish_chunk(std::vector<unsigned char> &png, size_t off, const char *type){
+	const unsigned len = png.size() - off - 8;
+	png[off+0] = len >> 24;
+	png[off+1] = len >> 16;
+	png[off+2] = len >> 8;
+	png[off+3] = len;
+	memcpy(&png[off+4], type, 4);
+	put_u32(png, lodepng_crc32(&png[off+4], len+4));
+}
+
+// Rows per band of about target filtered bytes
+static unsigned band_rows(unsigned w, size_t target){
+	const size_t rows = target / (3*(size_t)w+1);
+	return (rows < 1 ? 1 : (unsigned)rows);
+}
+
+// Filters and deflates the rows of rgb from y0 up to rows of them
+static unsigned encode_band(PngWriter::Band &band, const unsigned char *rgb, unsigned w, unsigned h, unsigned y0, unsigned rows){
+	LodePNGColorMode color;
+	lodepng_color_mode_init(&color);
+	color.colortype = LCT_RGB;
+	color.bitdepth = 8;
+	LodePNGEncoderSettings settings;
+	lodepng_encoder_settings_init(&settings);
+
+	const size_t linebytes = 3*(size_t)w;
+	const unsigned hi = (y0 + rows > h ? h - y0 : rows);
+	// Filter the row above the band too, so the band's first row gets
+	// its real predecessor, then drop it again.
+	const unsigned above = (y0 > 0 ? 1 : 0);
+	std::vector<unsigned char> filtered((hi+above) * (linebytes+1));
+	unsigned error = lodepng_filter(&filtered[0], rgb + (y0-above)*linebytes, w, hi+above, &color, &settings);
+	if(error){ return error; }
+	const unsigned char *f = &filtered[above*(linebytes+1)];
+	band.length = hi*(linebytes+1);
+	band.adler = adler32(f, band.length);
+	unsigned char *data = NULL;
+	size_t size = 0;
+	error = lodepng_deflate_partial(&data, &size, f, band.length, &settings.zlibsettings, y0 + hi == h);
+	if(!error){
+		band.data.assign(data, data + size);
+	}
+	free(data);
+	return error;
+}
+
+static void write_png(std::vector<unsigned char> &png, unsigned w, unsigned h, const std::vector<PngWriter::Band> &bands){
+	size_t total = 0;
+	for(size_t i = 0; i < bands.size(); ++i){
+		total += bands[i].data.size();
+	}
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	png.assign(signature, signature+8);
+	size_t off = png.size();
+	png.resize(off+8);
+	put_u32(png, w);
+	put_u32(png, h);
+	png.push_back(8); // bit depth
+	png.push_back(LCT_RGB);
+	png.push_back(0); // compression method
+	png.push_back(0); // filter method
+	png.push_back(0); // interlace method
+	finish_chunk(png, off, "IHDR");
+
+	off = png.size();
+	png.reserve(off + 8 + 2 + total + 4 + 4 + 12);
+	png.resize(off+8);
+	png.push_back(120); // zlib header: deflate, 32K window
+	png.push_back(1);
+	unsigned adler = 0;
+	for(size_t i = 0; i < bands.size(); ++i){
+		png.insert(png.end(), bands[i].data.begin(), bands[i].data.end());
+		adler = (0 == i ? bands[i].adler : adler32_combine(adler, bands[i].adler, bands[i].length));
+	}
+	put_u32(png, adler);
+	finish_chunk(png, off, "IDAT");
+
+	off = png.size();
+	png.resize(off+8);
+	finish_chunk(png, off, "IEND");
+}
+
+unsigned PngWriter::encode_rgb(std::vector<unsigned char> &png, const unsigned char *rgb, unsigned w, unsigned h){
+	if(0 == w || 0 == h){ return 93; } // lodepng's zero width or height error
+	const unsigned rows = band_rows(w, band_bytes);
+	const unsigned nbands = (h + rows-1) / rows;
+	std::vector<Band> bands(nbands);
+	std::vector<unsigned> errors(nbands);
+	ThreadPool::shared().run(nbands, [&](unsigned i){
+		errors[i] = encode_band(bands[i], rgb, w, h, i*rows, rows);
+	});
+	for(unsigned i = 0; i < nbands; ++i){
+		if(errors[i]){ return errors[i]; }
+	}
+	write_png(png, w, h, bands);
+	return 0;
+}
+
+unsigned PngWriter::save_rgb(const std::string &filename, const unsigned char *rgb, unsigned w, unsigned h){
+	std::vector<unsigned char> png;
+	unsigned error = encode_rgb(png, rgb, w, h);
+	if(error){ return error; }
+	return lodepng_save_file(&png[0], png.size(), filename.c_str());
+}
+
+PngWriter::Incremental::Incremental():
+	width(0),
+	height(0),
+	changed(0)
+{
+}
+
+unsigned PngWriter::Incremental::encode_rgb(std::vector<unsigned char> &png, const unsigned char *rgb, unsigned w, unsigned h){
+	if(0 == w || 0 == h){ return 93; }
+	const size_t linebytes = 3*(size_t)w;
+	const unsigned rows = band_rows(w, incremental_band_bytes);
+	const unsigned nbands = (h + rows-1) / rows;
+	const bool fresh = (w != width || h != height);
+	if(fresh){
+		bands.assign(nbands, Band());
+		last.clear();
+	}
+
+	// A band also depends on the row above it, through the filters
+	std::vector<unsigned> redo;
+	for(unsigned i = 0; i < nbands; ++i){
+		const unsigned y0 = i*rows;
+		const unsigned hi = (y0 + rows > h ? h - y0 : rows);
+		const size_t off = (y0 > 0 ? y0-1 : 0) * linebytes;
+		const size_t len = (y0 + hi) * linebytes - off;
+		if(fresh || memcmp(&last[off], rgb + off, len)){
+			redo.push_back(i);
+		}
+	}
+	std::vector<unsigned> errors(redo.size());
+	ThreadPool::shared().run(redo.size(), [&](unsigned j){
+		errors[j] = encode_band(bands[redo[j]], rgb, w, h, redo[j]*rows, rows);
+	});
+	changed = redo.size();
+	for(size_t j = 0; j < redo.size(); ++j){
+		if(errors[j]){
+			// Start over next time, the failed band is gone
+			width = 0;
+			height = 0;
+			return errors[j];
+		}
+	}
+
+	if(fresh){
+		last.assign(rgb, rgb + linebytes*h);
+		width = w;
+		height = h;
+	}else{
+		for(size_t j = 0; j < redo.size(); ++j){
+			const unsigned y0 = redo[j]*rows;
+			const unsigned hi = (y0 + rows > h ? h - y0 : rows);
+			memcpy(&last[y0*linebytes], rgb + y0*linebytes, hi*linebytes);
+		}
+	}
+	write_png(png, w, h, bands);
+	return 0;
+}
+
+unsigned PngWriter::Incremental::save_rgb(const std::string &filename, const unsigned char *rgb, unsigned w, unsigned h){
+	std::vector<unsigned char> png;
+	unsigned error = encode_rgb(png, rgb, w, h);
+	if(error){ return error; }
+	return lodepng_save_file(&png[0], png.size(), filename.c_str());
+}
@@ -0,0 +1,50 @@
+#ifndef PNG_WRITER_H_INCLUDED
+#define PNG_WRITER_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+// PNG encoding that splits the image into horizontal bands and filters
+// and deflates them in parallel on the shared ThreadPool, pigz style: each
+// band is compressed on its own and ends on a sync flush, so the pieces
+// concatenate into one zlib stream. Safe to call from any thread.
+namespace PngWriter{
+
+// Encodes a tightly packed 8-bit RGB image. Returns 0 or a lodepng error
+// code (see lodepng_error_text).
+unsigned encode_rgb(std::vector<unsigned char> &png, const unsigned char *rgb, unsigned w, unsigned h);
+
+// Like encode_rgb, then writes the result to filename.
+unsigned save_rgb(const std::string &filename, const unsigned char *rgb, unsigned w, unsigned h);
+
+// A band of rows, filtered and deflated on its own
+struct Band{
+	std::vector<unsigned char> data; // ends on a sync flush, or the final block
+	size_t length; // filtered bytes
+	unsigned adler; // Adler-32 of the filtered bytes
+};
+
+// Encoder for an image that is exported again and again with few changes,
+// such as a board. It keeps the bands of the last image and a copy of its
+// pixels, and only filters and deflates the bands whose rows changed since.
+// Not safe to use from more than one thread at a time.
+class Incremental{
+	std::vector<Band> bands;
+	std::vector<unsigned char> last; // the pixels bands were made from
+	unsigned width, height;
+	unsigned changed;
+public:
+	Incremental();
+
+	// Like PngWriter::encode_rgb and save_rgb
+	unsigned encode_rgb(std::vector<unsigned char> &png, const unsigned char *rgb, unsigned w, unsigned h);
+	unsigned save_rgb(const std::string &filename, const unsigned char *rgb, unsigned w, unsigned h);
+
+	// Number of bands deflated by the last call, out of num_bands()
+	unsigned bands_changed() const{ return changed; }
+	unsigned num_bands() const{ return bands.size(); }
+};
+
+} // namespace PngWriter
+
+#endif // PNG_WRITER_H_INCLUDED
@@ -0,0 +1,43 @@
+#ifndef SPSC_QUEUE_H_INCLUDED
+#define SPSC_QUEUE_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Fixed size ring that hands items from one thread to one other without
+// locks: only the producer calls push, and only the consumer calls pop.
+template <typename T>
+class SpscQueue{
+	std::vector<T> items;
+	size_t mask;
+	// Each written by one side only, and kept on their own cache lines
+	alignas(64) std::atomic<size_t> head; // next to pop
+	alignas(64) std::atomic<size_t> tail; // next to push
+public:
+	// capacity is rounded up to a power of two
+	explicit SpscQueue(size_t capacity = 1024):head(0), tail(0){
+		size_t n = 1;
+		while(n < capacity){ n <<= 1; }
+		items.resize(n);
+		mask = n - 1;
+	}
+	// Returns false, leaving the queue as it is, if it is full
+	bool push(const T &item){
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if(t - head.load(std::memory_order_acquire) > mask){ return false; }
+		items[t & mask] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+	// Returns false if it is empty
+	bool pop(T &item){
+		const size_t h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire)){ return false; }
+		item = items[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+#endif // SPSC_QUEUE_H_INCLUDED
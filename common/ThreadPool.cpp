@@ -0,0 +1,82 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned nworkers):stopping(false){
+	if(0 == nworkers){
+		nworkers = std::thread::hardware_concurrency();
+		if(nworkers > 0){ --nworkers; }
+	}
+	threads.reserve(nworkers);
+	for(unsigned i = 0; i < nworkers; ++i){
+		threads.push_back(std::thread(&ThreadPool::worker, this));
+	}
+}
+
+ThreadPool::~ThreadPool(){
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cv_work.notify_all();
+	for(size_t i = 0; i < threads.size(); ++i){
+		threads[i].join();
+	}
+}
+
+unsigned ThreadPool::size() const{
+	return threads.size() + 1;
+}
+
+ThreadPool &ThreadPool::shared(){
+	static ThreadPool pool;
+	return pool;
+}
+
+// Takes the next job of a batch and runs it with the lock released.
+// Returns false if the batch had no jobs left to start.
+bool ThreadPool::run_one(ThreadPool::Batch &batch, std::unique_lock<std::mutex> &lock){
+	if(batch.next >= batch.n){ return false; }
+	unsigned i = batch.next++;
+	if(batch.next >= batch.n){
+		batches.remove(&batch);
+	}
+	lock.unlock();
+	(*batch.job)(i);
+	lock.lock();
+	if(++batch.done == batch.n){
+		cv_done.notify_all();
+	}
+	return true;
+}
+
+void ThreadPool::worker(){
+	std::unique_lock<std::mutex> lock(mutex);
+	while(1){
+		while(!stopping && batches.empty()){
+			cv_work.wait(lock);
+		}
+		if(stopping){ return; }
+		run_one(*batches.front(), lock);
+	}
+}
+
+void ThreadPool::run(unsigned njobs, const std::function<void(unsigned)> &job){
+	if(threads.empty() || njobs < 2){
+		for(unsigned i = 0; i < njobs; ++i){
+			job(i);
+		}
+		return;
+	}
+	Batch batch;
+	batch.job = &job;
+	batch.n = njobs;
+	batch.next = 0;
+	batch.done = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	batches.push_back(&batch);
+	cv_work.notify_all();
+	while(run_one(batch, lock)){
+	}
+	while(batch.done < batch.n){
+		cv_done.wait(lock);
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for splitting a piece of work into
+// independent jobs. The calling thread takes part in the work, so a pool
+// with no workers simply runs everything inline.
+class ThreadPool{
+	struct Batch{
+		const std::function<void(unsigned)> *job;
+		unsigned n, next, done;
+	};
+	std::mutex mutex;
+	std::condition_variable cv_work, cv_done;
+	std::list<Batch*> batches; // batches with jobs not yet started
+	std::vector<std::thread> threads;
+	bool stopping;
+
+	void worker();
+	bool run_one(Batch &batch, std::unique_lock<std::mutex> &lock);
+public:
+	// nworkers == 0 picks one less than the number of hardware threads
+	ThreadPool(unsigned nworkers = 0);
+	~ThreadPool();
+
+	// Number of threads that can work on a batch, including the caller.
+	unsigned size() const;
+
+	// Calls job(0) through job(njobs-1), spread across the pool, and
+	// returns once all of them have finished. May be called from several
+	// threads at once, and from within a job.
+	void run(unsigned njobs, const std::function<void(unsigned)> &job);
+
+	// Process-wide pool sized to the machine.
+	static ThreadPool &shared();
+};
+
+#endif // THREAD_POOL_H_INCLUDED
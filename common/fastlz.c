@@ -24,6 +24,7 @@
 #include "fastlz.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 
 /*
  * Always check for bound when decompressing.
@@ -52,6 +53,21 @@
 #define FLZ_ARCH64
 #endif
 
+/*
+ * Wide comparisons for extending matches: 16 bytes at a time with SSE2,
+ * 8 at a time on other little-endian 64-bit targets.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__SSE2__)
+#define FLZ_CMP_SSE2
+#include <emmintrin.h>
+#elif (defined(__aarch64__) || defined(__x86_64__)) && \
+    defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define FLZ_CMP_WORD
+#include <string.h>
+#endif
+#endif
+
 #if defined(FASTLZ_SAFE)
 #define FASTLZ_BOUND_CHECK(cond) \
   if (FASTLZ_UNLIKELY(!(cond))) return 0;
@@ -109,24 +125,6 @@ static void fastlz_memcpy(uint8_t* dest, const uint8_t* src, uint32_t count) {
 
 static uint32_t flz_readu32(const void* ptr) { return *(const uint32_t*)ptr; }
 
-static uint64_t flz_readu64(const void* ptr) { return *(const uint64_t*)ptr; }
-
-static uint32_t flz_cmp(const uint8_t* p, const uint8_t* q, const uint8_t* r) {
-  const uint8_t* start = p;
-
-  if (flz_readu64(p) == flz_readu64(q)) {
-    p += 8;
-    q += 8;
-  }
-  if (flz_readu32(p) == flz_readu32(q)) {
-    p += 4;
-    q += 4;
-  }
-  while (q < r)
-    if (*p++ != *q++) break;
-  return p - start;
-}
-
 static void flz_copy64(uint8_t* dest, const uint8_t* src, uint32_t count) {
   const uint64_t* p = (const uint64_t*)src;
   uint64_t* q = (uint64_t*)dest;
@@ -161,13 +159,6 @@ static uint32_t flz_readu32(const void* ptr) {
   return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
-static uint32_t flz_cmp(const uint8_t* p, const uint8_t* q, const uint8_t* r) {
-  const uint8_t* start = p;
-  while (q < r)
-    if (*p++ != *q++) break;
-  return p - start;
-}
-
 static void flz_copy64(uint8_t* dest, const uint8_t* src, uint32_t count) {
   const uint8_t* p = (const uint8_t*)src;
   uint8_t* q = (uint8_t*)dest;
@@ -188,6 +179,56 @@ static void flz_copy256(void* dest, const void* src) {
 
 #endif /* !FLZ_ARCH64 */
 
+/*
+ * Number of bytes p and q have in common, comparing no further than q
+ * reaching r. Never reads past r on the q side; p trails q.
+ */
+static uint32_t flz_match_len(const uint8_t* p, const uint8_t* q,
+                              const uint8_t* r) {
+  const uint8_t* start = q;
+#if defined(FLZ_CMP_SSE2)
+  while (q + 32 <= r) {
+    __m128i a0 = _mm_loadu_si128((const __m128i*)p);
+    __m128i b0 = _mm_loadu_si128((const __m128i*)q);
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(q + 16));
+    uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a0, b0)) |
+                  ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a1, b1)) << 16);
+    if (eq != 0xffffffff) return (q - start) + __builtin_ctz(~eq);
+    p += 32;
+    q += 32;
+  }
+  while (q + 16 <= r) {
+    __m128i a = _mm_loadu_si128((const __m128i*)p);
+    __m128i b = _mm_loadu_si128((const __m128i*)q);
+    uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+    if (eq != 0xffff) return (q - start) + __builtin_ctz(~eq);
+    p += 16;
+    q += 16;
+  }
+#elif defined(FLZ_CMP_WORD)
+  while (q + 8 <= r) {
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, q, 8);
+    if (a != b) return (q - start) + (__builtin_ctzll(a ^ b) >> 3);
+    p += 8;
+    q += 8;
+  }
+#endif
+  while (q < r && *p == *q) {
+    ++p;
+    ++q;
+  }
+  return q - start;
+}
+
+/* Like flz_match_len, but counts the mismatching byte too, if any. */
+static uint32_t flz_cmp(const uint8_t* p, const uint8_t* q, const uint8_t* r) {
+  uint32_t len = flz_match_len(p, q, r);
+  return (q + len < r) ? len + 1 : len;
+}
+
 #define MAX_COPY 32
 #define MAX_LEN 264 /* 256 + 8 */
 #define MAX_L1_DISTANCE 8192
@@ -409,19 +450,21 @@ static uint8_t* flz2_match(uint32_t len, uint32_t distance, uint8_t* op) {
   return op;
 }
 
-int fastlz2_compress(const void* input, int length, void* output) {
-  const uint8_t* ip = (const uint8_t*)input;
-  const uint8_t* ip_start = ip;
+/*
+ * Matches may reach back into window[0..input), using the positions
+ * (relative to window) already in htab. htab is updated as we go.
+ */
+static int flz2_compress_window(uint32_t* htab, const uint8_t* window,
+                                const uint8_t* input, int length,
+                                uint8_t* output) {
+  const uint8_t* ip = input;
+  const uint8_t* ip_start = window;
   const uint8_t* ip_bound = ip + length - 4; /* because readU32 */
   const uint8_t* ip_limit = ip + length - 12 - 1;
-  uint8_t* op = (uint8_t*)output;
+  uint8_t* op = output;
 
-  uint32_t htab[HASH_SIZE];
   uint32_t seq, hash;
 
-  /* initializes hash table */
-  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
-
   /* we start with literal copy */
   const uint8_t* anchor = ip;
   ip += 2;
@@ -476,17 +519,144 @@ int fastlz2_compress(const void* input, int length, void* output) {
     anchor = ip;
   }
 
-  uint32_t copy = (uint8_t*)input + length - anchor;
+  uint32_t copy = input + length - anchor;
   op = flz_finalize(copy, anchor, op);
 
+  /* marker for fastlz2 */
+  *output |= (1 << 5);
+
+  return op - output;
+}
+
+int fastlz2_compress(const void* input, int length, void* output) {
+  uint32_t htab[HASH_SIZE];
+  uint32_t hash;
+
+  /* initializes hash table */
+  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
+
+  return flz2_compress_window(htab, (const uint8_t*)input,
+                              (const uint8_t*)input, length,
+                              (uint8_t*)output);
+}
+
+/*
+ * Level 3: same stream format as level 2, but every position goes into a
+ * hash chain, up to FLZ3_MAX_CHAIN earlier candidates are tried for each
+ * match, and a match is put off by a byte when the next position has a
+ * longer one (lazy matching).
+ */
+#define FLZ3_CHAIN_LOG 17 /* must cover MAX_FARDISTANCE */
+#define FLZ3_CHAIN_SIZE (1 << FLZ3_CHAIN_LOG)
+#define FLZ3_CHAIN_MASK (FLZ3_CHAIN_SIZE - 1)
+#define FLZ3_MAX_CHAIN 32
+#define FLZ3_NICE_LEN 258
+#define FLZ3_EMPTY 0xffffffff
+
+typedef struct {
+  const uint8_t* base;
+  const uint8_t* bound; /* matches stop here */
+  uint32_t head[HASH_SIZE];
+  uint32_t prev[FLZ3_CHAIN_SIZE];
+} flz3_state;
+
+static void flz3_insert(flz3_state* st, uint32_t pos) {
+  uint32_t hash = flz_hash(flz_readu32(st->base + pos) & 0xffffff);
+  st->prev[pos & FLZ3_CHAIN_MASK] = st->head[hash];
+  st->head[hash] = pos;
+}
+
+/* Longest match for pos among the chain; returns its length, 0 if none */
+static uint32_t flz3_find(const flz3_state* st, uint32_t pos,
+                          uint32_t* distance) {
+  const uint8_t* ip = st->base + pos;
+  const uint32_t avail = st->bound - ip;
+  uint32_t seq = flz_readu32(ip) & 0xffffff;
+  uint32_t cand = st->head[flz_hash(seq)];
+  uint32_t best = 0;
+  int chain = FLZ3_MAX_CHAIN;
+
+  while (cand != FLZ3_EMPTY && cand < pos && chain-- > 0) {
+    const uint32_t dist = pos - cand;
+    const uint8_t* ref = st->base + cand;
+    if (dist >= MAX_FARDISTANCE) break;
+    if ((best < 3 || (best < avail && ref[best] == ip[best])) &&
+        (flz_readu32(ref) & 0xffffff) == seq) {
+      uint32_t len = 3 + flz_match_len(ref + 3, ip + 3, st->bound);
+      /* far matches cost 4 bytes, so they need at least 5 to pay off */
+      if (len > best && (dist < MAX_L2_DISTANCE || len >= 5)) {
+        best = len;
+        *distance = dist;
+        if (len >= FLZ3_NICE_LEN) break;
+      }
+    }
+    cand = st->prev[cand & FLZ3_CHAIN_MASK];
+  }
+  return best;
+}
+
+static int fastlz3_compress(const void* input, int length, void* output) {
+  const uint8_t* ip_start = (const uint8_t*)input;
+  const uint32_t limit = length - 12 - 1;
+  uint8_t* op = (uint8_t*)output;
+  flz3_state* st;
+  uint32_t pos, anchor, hash;
+
+  if (length < 16) return fastlz2_compress(input, length, output);
+  st = (flz3_state*)malloc(sizeof(flz3_state));
+  if (!st) return fastlz2_compress(input, length, output);
+  st->base = ip_start;
+  st->bound = ip_start + length - 4;
+  for (hash = 0; hash < HASH_SIZE; ++hash) st->head[hash] = FLZ3_EMPTY;
+
+  /* we start with literal copy */
+  anchor = 0;
+  flz3_insert(st, 0);
+  flz3_insert(st, 1);
+  pos = 2;
+
+  while (pos < limit) {
+    uint32_t distance = 0, next_distance = 0;
+    uint32_t len = flz3_find(st, pos, &distance);
+    uint32_t next, end;
+    flz3_insert(st, pos);
+    if (len < 3) {
+      /* speed up through incompressible stretches */
+      pos += 1 + ((pos - anchor) >> 5);
+      continue;
+    }
+    /* lazy evaluation: would a match one byte later be longer? */
+    while (pos + 1 < limit && len < FLZ3_NICE_LEN) {
+      next = flz3_find(st, pos + 1, &next_distance);
+      if (next <= len) break;
+      ++pos;
+      flz3_insert(st, pos);
+      len = next;
+      distance = next_distance;
+    }
+
+    if (pos > anchor) op = flz_literals(pos - anchor, ip_start + anchor, op);
+    op = flz2_match(len - 2, distance, op);
+
+    /* index the positions the match covered */
+    end = pos + len;
+    for (++pos; pos < end; ++pos) flz3_insert(st, pos);
+    anchor = pos;
+  }
+
+  op = flz_finalize(length - anchor, ip_start + anchor, op);
+  free(st);
+
   /* marker for fastlz2 */
   *(uint8_t*)output |= (1 << 5);
 
   return op - (uint8_t*)output;
 }
 
-int fastlz2_decompress(const void* input, int length, void* output,
-                       int maxout) {
+/* Matches may reach back as far as window, which precedes output. */
+static int flz2_decompress_window(const void* input, int length,
+                                  void* output, int maxout,
+                                  const uint8_t* window) {
   const uint8_t* ip = (const uint8_t*)input;
   const uint8_t* ip_limit = ip + length;
   const uint8_t* ip_bound = ip_limit - 2;
@@ -520,7 +690,7 @@ int fastlz2_decompress(const void* input, int length, void* output,
         }
 
       FASTLZ_BOUND_CHECK(op + len <= op_limit);
-      FASTLZ_BOUND_CHECK(ref >= (uint8_t*)output);
+      FASTLZ_BOUND_CHECK(ref >= window);
       fastlz_memmove(op, ref, len);
       op += len;
     } else {
@@ -539,6 +709,311 @@ int fastlz2_decompress(const void* input, int length, void* output,
   return op - (uint8_t*)output;
 }
 
+int fastlz2_decompress(const void* input, int length, void* output,
+                       int maxout) {
+  return flz2_decompress_window(input, length, output, maxout,
+                                (const uint8_t*)output);
+}
+
+/*
+ * Strided variants. The uncompressed side is a block of rows, each
+ * row_length bytes long, with consecutive rows starting row_stride bytes
+ * apart. The compressed stream describes the rows concatenated back to
+ * back, so it is interchangeable with that of the contiguous functions.
+ */
+
+static int flz_compress_strided(int level, const uint8_t* input,
+                                uint32_t row_length, uint32_t row_stride,
+                                uint32_t rows, uint8_t* output) {
+  const uint32_t max_distance =
+      (level == 1) ? MAX_L1_DISTANCE : MAX_FARDISTANCE;
+  uint8_t* op = output;
+
+  uint32_t htab[HASH_SIZE];
+  uint32_t seq, hash, row;
+
+  /* initializes hash table */
+  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
+
+  for (row = 0; row < rows; ++row) {
+    const uint8_t* row_start = input + (size_t)row * row_stride;
+    const uint8_t* row_end = row_start + row_length;
+    const uint32_t row_pos = row * row_length;
+    const uint8_t* anchor = row_start;
+    const uint8_t* ip = row_start;
+
+    /* we start with literal copy */
+    if (row == 0) ip += 2;
+
+    /* matches never straddle a row on either side */
+    while (row_length > 13 && FASTLZ_LIKELY(ip < row_end - 12 - 1)) {
+      const uint8_t* ip_limit = row_end - 12 - 1;
+      const uint8_t* ref = 0;
+      const uint8_t* ref_end = 0;
+      const uint8_t* bound;
+      uint32_t distance, cmp, ref_pos;
+
+      /* find potential match */
+      do {
+        seq = flz_readu32(ip) & 0xffffff;
+        hash = flz_hash(seq);
+        ref_pos = htab[hash];
+        htab[hash] = row_pos + (ip - row_start);
+        distance = row_pos + (ip - row_start) - ref_pos;
+        cmp = 0x1000000;
+        if (FASTLZ_LIKELY(distance < max_distance)) {
+          ref_end = input + (size_t)(ref_pos / row_length) * row_stride;
+          ref = ref_end + ref_pos % row_length;
+          ref_end += row_length;
+          cmp = flz_readu32(ref) & 0xffffff;
+        }
+        if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
+        ++ip;
+      } while (seq != cmp);
+
+      if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
+      --ip;
+
+      /* far, needs at least 5-byte match */
+      if (level == 2 && distance >= MAX_L2_DISTANCE) {
+        if (ref[3] != ip[3] || ref[4] != ip[4]) {
+          ++ip;
+          continue;
+        }
+      }
+
+      if (FASTLZ_LIKELY(ip > anchor)) {
+        op = flz_literals(ip - anchor, anchor, op);
+      }
+
+      bound = row_end - 4; /* because readU32 */
+      if (ref_end - ref < bound - ip) bound = ip + (ref_end - ref);
+      uint32_t len = flz_cmp(ref + 3, ip + 3, bound);
+      if (level == 1)
+        op = flz1_match(len, distance, op);
+      else
+        op = flz2_match(len, distance, op);
+
+      /* update the hash at match boundary */
+      ip += len;
+      seq = flz_readu32(ip);
+      hash = flz_hash(seq & 0xffffff);
+      htab[hash] = row_pos + (ip++ - row_start);
+      seq >>= 8;
+      hash = flz_hash(seq);
+      htab[hash] = row_pos + (ip++ - row_start);
+
+      anchor = ip;
+    }
+
+    /* literals never straddle a row either */
+    op = flz_finalize(row_end - anchor, anchor, op);
+  }
+
+  /* marker for fastlz2 */
+  if (level == 2) *output |= (1 << 5);
+
+  return op - output;
+}
+
+static void flz_strided_copy(uint8_t* output, uint32_t row_length,
+                             uint32_t row_stride, uint32_t from, uint32_t to,
+                             uint32_t count) {
+  uint32_t from_col = from % row_length;
+  uint32_t to_col = to % row_length;
+  const uint8_t* src = output + (size_t)(from / row_length) * row_stride + from_col;
+  uint8_t* dest = output + (size_t)(to / row_length) * row_stride + to_col;
+  while (1) {
+    uint32_t n = count;
+    if (n > row_length - from_col) n = row_length - from_col;
+    if (n > row_length - to_col) n = row_length - to_col;
+    fastlz_memmove(dest, src, n);
+    count -= n;
+    if (count == 0) break;
+    src += n;
+    dest += n;
+    from_col += n;
+    to_col += n;
+    if (from_col == row_length) {
+      from_col = 0;
+      src += row_stride - row_length;
+    }
+    if (to_col == row_length) {
+      to_col = 0;
+      dest += row_stride - row_length;
+    }
+  }
+}
+
+static void flz_strided_write(uint8_t* output, uint32_t row_length,
+                              uint32_t row_stride, uint32_t to,
+                              const uint8_t* src, uint32_t count) {
+  uint32_t to_col = to % row_length;
+  uint8_t* dest = output + (size_t)(to / row_length) * row_stride + to_col;
+  while (1) {
+    uint32_t n = count;
+    if (n > row_length - to_col) n = row_length - to_col;
+    fastlz_memcpy(dest, src, n);
+    count -= n;
+    if (count == 0) break;
+    src += n;
+    dest += row_stride - to_col;
+    to_col = 0;
+  }
+}
+
+int fastlz_compress_strided(int level, const void* input, int row_length,
+                            int row_stride, int rows, void* output) {
+  if (level != 1 && level != 2) return 0;
+  if (row_length <= 0 || rows <= 0 || row_stride < row_length) return 0;
+  return flz_compress_strided(level, (const uint8_t*)input, row_length,
+                              row_stride, rows, (uint8_t*)output);
+}
+
+int fastlz_decompress_strided(const void* input, int length, void* output,
+                              int row_length, int row_stride, int rows) {
+  const uint8_t* ip = (const uint8_t*)input;
+  const uint8_t* ip_limit = ip + length;
+  const uint8_t* ip_bound = ip_limit - 2;
+  uint8_t* out = (uint8_t*)output;
+  uint32_t op = 0;
+  uint32_t op_limit;
+  uint32_t ctrl;
+  int level;
+
+  if (length <= 0 || row_length <= 0 || rows <= 0 || row_stride < row_length)
+    return 0;
+  op_limit = (uint32_t)row_length * rows;
+
+  /* magic identifier for compression level */
+  level = ((*ip) >> 5) + 1;
+  if (level != 1 && level != 2) return 0;
+  ctrl = (*ip++) & 31;
+
+  while (1) {
+    if (ctrl >= 32) {
+      uint32_t len = (ctrl >> 5) - 1;
+      uint32_t ofs = (ctrl & 31) << 8;
+      uint32_t distance = ofs + 1;
+
+      uint8_t code;
+      if (level == 1) {
+        if (len == 7 - 1) {
+          FASTLZ_BOUND_CHECK(ip <= ip_bound);
+          len += *ip++;
+        }
+        FASTLZ_BOUND_CHECK(ip < ip_limit);
+        distance += *ip++;
+      } else {
+        if (len == 7 - 1) do {
+            FASTLZ_BOUND_CHECK(ip <= ip_bound);
+            code = *ip++;
+            len += code;
+          } while (code == 255);
+        FASTLZ_BOUND_CHECK(ip < ip_limit);
+        code = *ip++;
+        distance += code;
+
+        /* match from 16-bit distance */
+        if (FASTLZ_UNLIKELY(code == 255))
+          if (FASTLZ_LIKELY(ofs == (31 << 8))) {
+            FASTLZ_BOUND_CHECK(ip < ip_bound);
+            ofs = (*ip++) << 8;
+            ofs += *ip++;
+            distance = ofs + MAX_L2_DISTANCE + 1;
+          }
+      }
+      len += 3;
+
+      FASTLZ_BOUND_CHECK(op + len <= op_limit);
+      FASTLZ_BOUND_CHECK(distance <= op);
+      flz_strided_copy(out, row_length, row_stride, op - distance, op, len);
+      op += len;
+    } else {
+      ctrl++;
+      FASTLZ_BOUND_CHECK(op + ctrl <= op_limit);
+      FASTLZ_BOUND_CHECK(ip + ctrl <= ip_limit);
+      flz_strided_write(out, row_length, row_stride, op, ip, ctrl);
+      ip += ctrl;
+      op += ctrl;
+    }
+
+    if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
+    ctrl = *ip++;
+  }
+
+  return op;
+}
+
+/*
+ * Streams keep the last data blocks in a window, along with the hash table
+ * of positions in it, so that each block can refer back to earlier ones.
+ * Once the window fills up, everything but the last FASTLZ_STREAM_WINDOW
+ * bytes is dropped. Both ends do this at the same points, so their windows
+ * always hold the same bytes.
+ */
+
+#define STREAM_BUFFER (4 * FASTLZ_STREAM_WINDOW)
+
+struct fastlz_stream {
+  uint32_t htab[HASH_SIZE];
+  uint32_t length;
+  /* padded because the match finder may read a few bytes past the end */
+  uint8_t window[STREAM_BUFFER + 16];
+};
+
+fastlz_stream* fastlz_stream_create(void) {
+  fastlz_stream* s = (fastlz_stream*)malloc(sizeof(fastlz_stream));
+  if (s) fastlz_stream_reset(s);
+  return s;
+}
+
+void fastlz_stream_destroy(fastlz_stream* s) { free(s); }
+
+void fastlz_stream_reset(fastlz_stream* s) {
+  uint32_t hash;
+  for (hash = 0; hash < HASH_SIZE; ++hash) s->htab[hash] = 0;
+  s->length = 0;
+}
+
+static void flz_stream_make_room(fastlz_stream* s) {
+  uint32_t shift, hash;
+  if (s->length + FASTLZ_STREAM_MAX_BLOCK <= STREAM_BUFFER) return;
+  shift = s->length - FASTLZ_STREAM_WINDOW;
+  memmove(s->window, s->window + shift, FASTLZ_STREAM_WINDOW);
+  for (hash = 0; hash < HASH_SIZE; ++hash)
+    s->htab[hash] = (s->htab[hash] >= shift) ? s->htab[hash] - shift : 0;
+  s->length = FASTLZ_STREAM_WINDOW;
+}
+
+int fastlz_stream_compress(fastlz_stream* s, const void* input, int length,
+                           void* output) {
+  uint8_t* start;
+  if (length <= 0 || length > FASTLZ_STREAM_MAX_BLOCK) return 0;
+  flz_stream_make_room(s);
+  start = s->window + s->length;
+  memcpy(start, input, length);
+  s->length += length;
+  return flz2_compress_window(s->htab, s->window, start, length,
+                              (uint8_t*)output);
+}
+
+int fastlz_stream_decompress(fastlz_stream* s, const void* input, int length,
+                             void* output, int maxout) {
+  uint8_t* start;
+  int n;
+  if (length <= 0) return 0;
+  if (((*(const uint8_t*)input) >> 5) != 1) return 0;
+  if (maxout > FASTLZ_STREAM_MAX_BLOCK) maxout = FASTLZ_STREAM_MAX_BLOCK;
+  flz_stream_make_room(s);
+  start = s->window + s->length;
+  n = flz2_decompress_window(input, length, start, maxout, s->window);
+  if (n <= 0) return 0;
+  memcpy(output, start, n);
+  s->length += n;
+  return n;
+}
+
 int fastlz_compress(const void* input, int length, void* output) {
   /* for short block, choose fastlz1 */
   if (length < 65536) return fastlz1_compress(input, length, output);
@@ -562,6 +1037,7 @@ int fastlz_compress_level(int level, const void* input, int length,
                           void* output) {
   if (level == 1) return fastlz1_compress(input, length, output);
   if (level == 2) return fastlz2_compress(input, length, output);
+  if (level == 3) return fastlz3_compress(input, length, output);
 
   return 0;
 }
@@ -50,9 +50,11 @@ extern "C" {
   The input buffer and the output buffer can not overlap.
 
   Compression level can be specified in parameter level. At the moment,
-  only level 1 and level 2 are supported.
+  only level 1, level 2 and level 3 are supported.
   Level 1 is the fastest compression and generally useful for short data.
   Level 2 is slightly slower but it gives better compression ratio.
+  Level 3 searches hash chains with lazy matching for a much better ratio
+  at several times the cost of level 2. It produces level 2 streams.
 
   Note that the compressed data, regardless of the level, can always be
   decompressed using the function fastlz_decompress below.
@@ -79,6 +81,61 @@ int fastlz_compress_level(int level, const void* input, int length,
 
 int fastlz_decompress(const void* input, int length, void* output, int maxout);
 
+/**
+  Strided versions of the above, for compressing from or decompressing into
+  a sub-rectangle of a larger image without an intermediate copy.
+
+  The uncompressed data is made up of rows, each row_length bytes long,
+  with the start of consecutive rows row_stride bytes apart. The compressed
+  block is the same as that of the row data laid out back to back, so a
+  block produced by fastlz_compress_strided can be decompressed with
+  fastlz_decompress and vice versa.
+
+  For fastlz_compress_strided, the output buffer must be at least 5% larger
+  than the total row data plus one byte per row, and can not be smaller
+  than 66 bytes. Only level 1 and level 2 are supported.
+
+  fastlz_decompress_strided writes at most row_length*rows bytes of row
+  data and never touches the bytes between rows. It returns the number of
+  row data bytes written, or 0 on error.
+*/
+
+int fastlz_compress_strided(int level, const void* input, int row_length,
+                            int row_stride, int rows, void* output);
+
+int fastlz_decompress_strided(const void* input, int length, void* output,
+                              int row_length, int row_stride, int rows);
+
+/**
+  Streaming compression, where each block may refer back to the data of
+  the blocks compressed before it in the same stream, up to
+  FASTLZ_STREAM_WINDOW bytes back. This pays off for a series of small,
+  similar blocks, e.g. the messages sent over a connection.
+
+  A stream is created with fastlz_stream_create (NULL when out of memory).
+  Blocks must be decompressed in the order they were compressed, with a
+  stream of its own on the receiving end. Each block holds at most
+  FASTLZ_STREAM_MAX_BLOCK bytes of data; fastlz_stream_compress has the
+  same requirements on the output buffer as fastlz_compress_level.
+  fastlz_stream_decompress returns the size of the block, or 0 on error,
+  after which the stream is no longer usable.
+*/
+
+#define FASTLZ_STREAM_WINDOW 65536
+#define FASTLZ_STREAM_MAX_BLOCK 65536
+
+typedef struct fastlz_stream fastlz_stream;
+
+fastlz_stream* fastlz_stream_create(void);
+void fastlz_stream_destroy(fastlz_stream* stream);
+void fastlz_stream_reset(fastlz_stream* stream);
+
+int fastlz_stream_compress(fastlz_stream* stream, const void* input,
+                           int length, void* output);
+
+int fastlz_stream_decompress(fastlz_stream* stream, const void* input,
+                             int length, void* output, int maxout);
+
 /**
   DEPRECATED.
 
@@ -1295,13 +1295,14 @@ static unsigned inflateHuffmanBlock(ucvector* out, size_t* pos, LodePNGBitReader
   while(!error) /*decode all symbols until end reached, breaks at end code*/ {
     /*code_ll is literal, length or end code*/
     unsigned code_ll;
+    /*keep room for the longest match, so symbols can be written without resizing each time*/
+    if(out->allocsize < (*pos) + 258) {
+      if(!ucvector_resize(out, (*pos) + 258)) ERROR_BREAK(83 /*alloc fail*/);
+    }
     ensureBits25(reader, 20); /* up to 15 for the huffman symbol, up to 5 for the length extra bits */
     code_ll = huffmanDecodeSymbol(reader, &tree_ll);
     if(code_ll <= 255) /*literal symbol*/ {
-      /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
-      if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
-      out->data[*pos] = (unsigned char)code_ll;
-      ++(*pos);
+      out->data[(*pos)++] = (unsigned char)code_ll;
     } else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/ {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
@@ -1341,7 +1342,6 @@ static unsigned inflateHuffmanBlock(ucvector* out, size_t* pos, LodePNGBitReader
       if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
       backward = start - distance;
 
-      if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
       if (distance < length) {
         size_t forward;
         lodepng_memcpy(out->data + *pos, out->data + backward, distance);
@@ -1367,6 +1367,8 @@ static unsigned inflateHuffmanBlock(ucvector* out, size_t* pos, LodePNGBitReader
     }
   }
 
+  out->size = *pos; /*drop the room kept past the end*/
+
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
 
@@ -1406,11 +1408,18 @@ static unsigned inflateNoCompression(ucvector* out, size_t* pos,
   return error;
 }
 
+/*with a sink, output is handed over after every block, and once this much has
+piled up, all but the last 32K (the most a distance can reach back) is dropped*/
+static const size_t INFLATE_STREAM_KEEP = 32768;
+static const size_t INFLATE_STREAM_SLIDE = 262144;
+
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings) {
+                                 const LodePNGDecompressSettings* settings,
+                                 LodePNGInflateSink sink, void* sink_user) {
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
+  size_t flushed = 0; /*out bytes already given to the sink*/
   LodePNGBitReader reader;
   unsigned error = LodePNGBitReader_init(&reader, in, insize);
 
@@ -1427,6 +1436,18 @@ static unsigned lodepng_inflatev(ucvector* out,
     else error = inflateHuffmanBlock(out, &pos, &reader, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
+
+    if(sink) {
+      if(pos > flushed) {
+        error = sink(sink_user, out->data + flushed, pos - flushed);
+        if(error) return error;
+        flushed = pos;
+      }
+      if(pos >= INFLATE_STREAM_SLIDE) {
+        lodepng_memcpy(out->data, out->data + pos - INFLATE_STREAM_KEEP, INFLATE_STREAM_KEEP);
+        pos = flushed = out->size = INFLATE_STREAM_KEEP;
+      }
+    }
   }
 
   return error;
@@ -1438,7 +1459,7 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_inflatev(&v, in, insize, settings);
+  error = lodepng_inflatev(&v, in, insize, settings, 0, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -1753,7 +1774,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned last) {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
@@ -1763,7 +1784,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = last && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1u) << 1u) + ((BTYPE & 2u) << 1u));
@@ -2082,8 +2103,10 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
+/*if last is 0, no block is marked final and the data is ended with an empty stored
+block instead (a sync flush), so that another deflate stream can be appended*/
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+                                 const LodePNGCompressSettings* settings, unsigned last) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   Hash hash;
@@ -2092,7 +2115,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   LodePNGBitWriter_init(&writer, out);
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize, last);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/ {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2108,7 +2131,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
+      unsigned final = last && (i == numdeflateblocks - 1);
       size_t start = i * blocksize;
       size_t end = start + blocksize;
       if(end > insize) end = insize;
@@ -2120,6 +2143,16 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   hash_cleanup(&hash);
 
+  if(!error && !last) {
+    /*empty non-final stored block: 3 header bits, pad to the byte boundary, LEN and NLEN*/
+    writeBits(&writer, 0, 3);
+    writer.bp = (writer.bp + 7u) & ~(size_t)7u;
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    ucvector_push_back(out, 255);
+  }
+
   return error;
 }
 
@@ -2129,7 +2162,19 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = lodepng_deflatev(&v, in, insize, settings, 1);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+unsigned lodepng_deflate_partial(unsigned char** out, size_t* outsize,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings, unsigned last) {
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_deflatev(&v, in, insize, settings, last);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -2222,6 +2267,42 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
   return 0; /*no error*/
 }
 
+typedef struct ZlibStreamSink {
+  LodePNGInflateSink sink;
+  void* user;
+  unsigned adler;
+} ZlibStreamSink;
+
+static unsigned zlib_stream_sink(void* user, const unsigned char* data, size_t size) {
+  ZlibStreamSink* z = (ZlibStreamSink*)user;
+  z->adler = update_adler32(z->adler, data, (unsigned)size);
+  return z->sink(z->user, data, size);
+}
+
+unsigned lodepng_zlib_decompress_stream(const unsigned char* in, size_t insize,
+                                        const LodePNGDecompressSettings* settings,
+                                        LodePNGInflateSink sink, void* user) {
+  unsigned error;
+  ZlibStreamSink z;
+  ucvector v;
+
+  if(insize < 6) return 53; /*error, size of zlib data too small*/
+  if((in[0] * 256 + in[1]) % 31 != 0) return 24;
+  if((in[0] & 15) != 8 || ((in[0] >> 4) & 15) > 7) return 25;
+  if((in[1] >> 5) & 1) return 26;
+
+  z.sink = sink;
+  z.user = user;
+  z.adler = 1u;
+  ucvector_init_buffer(&v, 0, 0);
+  error = lodepng_inflatev(&v, in + 2, insize - 2, settings, zlib_stream_sink, &z);
+  lodepng_free(v.data);
+  if(error) return error;
+
+  if(!settings->ignore_adler32 && z.adler != lodepng_read32bitInt(&in[insize - 4])) return 58;
+  return 0;
+}
+
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings) {
   if(settings->custom_zlib) {
@@ -3933,6 +4014,87 @@ static unsigned char paethPredictor(short a, short b, short c) {
   return (pc < pa) ? c : a;
 }
 
+/*
+Vector versions of the filter predictors. SSE2 is part of x86-64, so it is used
+whenever the compiler targets it. The AVX2 encoder kernels are compiled with a
+target attribute and only called if the CPU reports AVX2 at run time, so the same
+binary still runs on older CPUs. Everything else uses the portable code.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LODEPNG_SSE2
+#include <emmintrin.h>
+#if (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+#define LODEPNG_AVX2
+#define LODEPNG_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef LODEPNG_SSE2
+/*(a + b) >> 1 per byte, the Average predictor*/
+static LODEPNG_INLINE __m128i avgPredictor_sse2(__m128i a, __m128i b) {
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static LODEPNG_INLINE __m128i abs16_sse2(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/*paethPredictor on 8 values widened to 16 bits, with the same tie breaking*/
+static LODEPNG_INLINE __m128i paethPredictor16_sse2(__m128i a, __m128i b, __m128i c) {
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = abs16_sse2(_mm_add_epi16(pa, pb));
+  __m128i m;
+  pa = abs16_sse2(pa);
+  pb = abs16_sse2(pb);
+  m = _mm_cmplt_epi16(pb, pa);
+  a = _mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, a));
+  pa = _mm_min_epi16(pa, pb);
+  m = _mm_cmplt_epi16(pc, pa);
+  return _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, a));
+}
+
+static LODEPNG_INLINE __m128i paethPredictor_sse2(__m128i a, __m128i b, __m128i c) {
+  const __m128i z = _mm_setzero_si128();
+  __m128i lo = paethPredictor16_sse2(_mm_unpacklo_epi8(a, z), _mm_unpacklo_epi8(b, z), _mm_unpacklo_epi8(c, z));
+  __m128i hi = paethPredictor16_sse2(_mm_unpackhi_epi8(a, z), _mm_unpackhi_epi8(b, z), _mm_unpackhi_epi8(c, z));
+  return _mm_packus_epi16(lo, hi);
+}
+#endif /*LODEPNG_SSE2*/
+
+#ifdef LODEPNG_AVX2
+static int lodepng_cpu_has_avx2(void) {
+  static const int has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  return has_avx2;
+}
+
+LODEPNG_TARGET_AVX2 static LODEPNG_INLINE __m256i avgPredictor_avx2(__m256i a, __m256i b) {
+  return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
+
+LODEPNG_TARGET_AVX2 static LODEPNG_INLINE __m256i paethPredictor16_avx2(__m256i a, __m256i b, __m256i c) {
+  __m256i pa = _mm256_sub_epi16(b, c);
+  __m256i pb = _mm256_sub_epi16(a, c);
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+  pa = _mm256_abs_epi16(pa);
+  pb = _mm256_abs_epi16(pb);
+  a = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi16(pa, pb));
+  pa = _mm256_min_epi16(pa, pb);
+  return _mm256_blendv_epi8(a, c, _mm256_cmpgt_epi16(pa, pc));
+}
+
+/*the unpacks and the pack all work within 128-bit lanes, so the byte order comes out right*/
+LODEPNG_TARGET_AVX2 static LODEPNG_INLINE __m256i paethPredictor_avx2(__m256i a, __m256i b, __m256i c) {
+  const __m256i z = _mm256_setzero_si256();
+  __m256i lo = paethPredictor16_avx2(_mm256_unpacklo_epi8(a, z), _mm256_unpacklo_epi8(b, z),
+                                     _mm256_unpacklo_epi8(c, z));
+  __m256i hi = paethPredictor16_avx2(_mm256_unpackhi_epi8(a, z), _mm256_unpackhi_epi8(b, z),
+                                     _mm256_unpackhi_epi8(c, z));
+  return _mm256_packus_epi16(lo, hi);
+}
+#endif /*LODEPNG_AVX2*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -4051,6 +4213,94 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SSE2
+/*a 3 or 4 byte pixel in the low lane*/
+static LODEPNG_INLINE __m128i loadPixel_sse2(const unsigned char* p, size_t bytewidth) {
+  unsigned v = (unsigned)p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u);
+  if(bytewidth == 4) v |= (unsigned)p[3] << 24u;
+  return _mm_cvtsi32_si128((int)v);
+}
+
+static LODEPNG_INLINE void storePixel_sse2(unsigned char* p, __m128i x, size_t bytewidth) {
+  unsigned v = (unsigned)_mm_cvtsi128_si32(x);
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8u);
+  p[2] = (unsigned char)(v >> 16u);
+  if(bytewidth == 4) p[3] = (unsigned char)(v >> 24u);
+}
+
+/*
+unfilterScanline for 8-bit RGB and RGBA rows that have a previous row. Up works on
+16 bytes at a time. Sub does a prefix sum over 4 pixels per step. Average and Paeth
+depend on the pixel just decoded, so they go one pixel at a time, with the channels
+in parallel. Works in place like unfilterScanline: each step reads its input before
+writing, and never writes past the bytes it has read.
+*/
+static void unfilterScanline_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                  size_t bytewidth, unsigned char filterType, size_t length) {
+  const __m128i z = _mm_setzero_si128();
+  size_t i = 0;
+  __m128i a, c;
+  switch(filterType) {
+    case 1:
+      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
+      a = loadPixel_sse2(recon, bytewidth);
+      if(bytewidth == 4) {
+        for(; i + 16 <= length; i += 16) {
+          __m128i d = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(scanline + i)), a);
+          d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+          d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+          _mm_storeu_si128((__m128i*)(recon + i), d);
+          a = _mm_srli_si128(d, 12);
+        }
+      } else {
+        /*4 pixels in the low 12 bytes, the top 4 bytes are ignored*/
+        const __m128i mask = _mm_cvtsi32_si128(0xffffff);
+        for(; i + 16 <= length; i += 12) {
+          __m128i d = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(scanline + i)), a);
+          d = _mm_add_epi8(d, _mm_slli_si128(d, 3));
+          d = _mm_add_epi8(d, _mm_slli_si128(d, 6));
+          _mm_storel_epi64((__m128i*)(recon + i), d);
+          storePixel_sse2(recon + i + 8, _mm_srli_si128(d, 8), 4);
+          a = _mm_and_si128(_mm_srli_si128(d, 9), mask);
+        }
+      }
+      for(; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
+      break;
+    case 2:
+      for(; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+        _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+      }
+      for(; i < length; ++i) recon[i] = scanline[i] + precon[i];
+      break;
+    case 3:
+      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i] + (precon[i] >> 1u);
+      a = loadPixel_sse2(recon, bytewidth);
+      for(; i + bytewidth <= length; i += bytewidth) {
+        __m128i b = loadPixel_sse2(precon + i, bytewidth);
+        a = _mm_add_epi8(loadPixel_sse2(scanline + i, bytewidth), avgPredictor_sse2(a, b));
+        storePixel_sse2(recon + i, a, bytewidth);
+      }
+      break;
+    case 4:
+      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i] + precon[i];
+      a = _mm_unpacklo_epi8(loadPixel_sse2(recon, bytewidth), z);
+      c = _mm_unpacklo_epi8(loadPixel_sse2(precon, bytewidth), z);
+      for(; i + bytewidth <= length; i += bytewidth) {
+        __m128i b = _mm_unpacklo_epi8(loadPixel_sse2(precon + i, bytewidth), z);
+        __m128i p = paethPredictor16_sse2(a, b, c);
+        __m128i d = _mm_add_epi8(loadPixel_sse2(scanline + i, bytewidth), _mm_packus_epi16(p, p));
+        storePixel_sse2(recon + i, d, bytewidth);
+        a = _mm_unpacklo_epi8(d, z);
+        c = b;
+      }
+      break;
+  }
+}
+#endif /*LODEPNG_SSE2*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length) {
   /*
@@ -4063,6 +4313,13 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_SSE2
+  if(precon && filterType >= 1 && filterType <= 4 &&
+     (filterType == 2 || bytewidth == 3 || bytewidth == 4) && length % bytewidth == 0) {
+    unfilterScanline_sse2(recon, scanline, precon, bytewidth, filterType, length);
+    return 0;
+  }
+#endif /*LODEPNG_SSE2*/
   switch(filterType) {
     case 0:
       for(i = 0; i != length; ++i) recon[i] = scanline[i];
@@ -4148,6 +4405,12 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   return 0;
 }
 
+unsigned lodepng_unfilter_scanline(unsigned char* recon, const unsigned char* scanline,
+                                   const unsigned char* precon, size_t bytewidth,
+                                   unsigned char filterType, size_t length) {
+  return unfilterScanline(recon, scanline, precon, bytewidth, filterType, length);
+}
+
 static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp) {
   /*
   For PNG filter method 0
@@ -5324,9 +5587,201 @@ static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, LodePNGCom
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*
+Adds up the LFS_MINSUM cost of each filter type over bytes [begin, end) of a
+scanline, without storing any filtered bytes: the plain byte sum for type 0, and
+the sum of absolute values of the differences as signed bytes for types 1 to 4.
+A missing prevline counts as zeros, like in filterScanline.
+*/
+static void filterCostsRange(size_t cost[5], const unsigned char* scanline, const unsigned char* prevline,
+                             size_t bytewidth, size_t begin, size_t end) {
+  size_t i;
+  for(i = begin; i < end; ++i) {
+    unsigned char x = scanline[i];
+    unsigned char a = i >= bytewidth ? scanline[i - bytewidth] : 0;
+    unsigned char b = prevline ? prevline[i] : 0;
+    unsigned char c = (prevline && i >= bytewidth) ? prevline[i - bytewidth] : 0;
+    unsigned char r;
+    cost[0] += x;
+    r = (unsigned char)(x - a);
+    cost[1] += r < 128 ? r : 255u - r;
+    r = (unsigned char)(x - b);
+    cost[2] += r < 128 ? r : 255u - r;
+    r = (unsigned char)(x - ((a + b) >> 1));
+    cost[3] += r < 128 ? r : 255u - r;
+    r = (unsigned char)(x - paethPredictor(a, b, c));
+    cost[4] += r < 128 ? r : 255u - r;
+  }
+}
+
+#ifdef LODEPNG_SSE2
+/*
+Stores bytes [begin, end) of filterScanline's output. Unlike filterScanline this
+takes any range, so the vector versions below can leave the ends to it.
+*/
+static void filterScanlineRange(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                size_t bytewidth, unsigned char filterType, size_t begin, size_t end) {
+  size_t i;
+  for(i = begin; i < end; ++i) {
+    unsigned char x = scanline[i];
+    unsigned char a = i >= bytewidth ? scanline[i - bytewidth] : 0;
+    unsigned char b = prevline ? prevline[i] : 0;
+    unsigned char c = (prevline && i >= bytewidth) ? prevline[i - bytewidth] : 0;
+    switch(filterType) {
+      case 1: out[i] = (unsigned char)(x - a); break;
+      case 2: out[i] = (unsigned char)(x - b); break;
+      case 3: out[i] = (unsigned char)(x - ((a + b) >> 1)); break;
+      case 4: out[i] = (unsigned char)(x - paethPredictor(a, b, c)); break;
+      default: out[i] = x; break;
+    }
+  }
+}
+
+static size_t sum64_sse2(__m128i v) {
+  return (size_t)_mm_cvtsi128_si32(v) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+
+/*the signed magnitude cost of 16 filtered bytes, as two partial sums*/
+static LODEPNG_INLINE __m128i cost_sse2(__m128i r) {
+  return _mm_sad_epu8(_mm_min_epu8(r, _mm_xor_si128(r, _mm_set1_epi8(-1))), _mm_setzero_si128());
+}
+
+/*filterCostsRange over a whole scanline that has a previous line, 16 bytes at a time*/
+static void filterCosts_sse2(size_t cost[5], const unsigned char* scanline, const unsigned char* prevline,
+                             size_t length, size_t bytewidth) {
+  const __m128i z = _mm_setzero_si128();
+  __m128i s0 = z, s1 = z, s2 = z, s3 = z, s4 = z;
+  size_t i = bytewidth;
+  for(; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    __m128i c = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+    s0 = _mm_add_epi64(s0, _mm_sad_epu8(x, z));
+    s1 = _mm_add_epi64(s1, cost_sse2(_mm_sub_epi8(x, a)));
+    s2 = _mm_add_epi64(s2, cost_sse2(_mm_sub_epi8(x, b)));
+    s3 = _mm_add_epi64(s3, cost_sse2(_mm_sub_epi8(x, avgPredictor_sse2(a, b))));
+    s4 = _mm_add_epi64(s4, cost_sse2(_mm_sub_epi8(x, paethPredictor_sse2(a, b, c))));
+  }
+  cost[0] += sum64_sse2(s0);
+  cost[1] += sum64_sse2(s1);
+  cost[2] += sum64_sse2(s2);
+  cost[3] += sum64_sse2(s3);
+  cost[4] += sum64_sse2(s4);
+  filterCostsRange(cost, scanline, prevline, bytewidth, 0, bytewidth);
+  filterCostsRange(cost, scanline, prevline, bytewidth, i, length);
+}
+
+/*filterScanline with filter type 1 to 4 for a scanline that has a previous line*/
+static void filterScanline_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                size_t length, size_t bytewidth, unsigned char filterType) {
+  size_t i = bytewidth;
+  for(; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    __m128i p;
+    if(filterType == 1) p = a;
+    else if(filterType == 2) p = b;
+    else if(filterType == 3) p = avgPredictor_sse2(a, b);
+    else p = paethPredictor_sse2(a, b, _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth)));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, p));
+  }
+  filterScanlineRange(out, scanline, prevline, bytewidth, filterType, 0, bytewidth);
+  filterScanlineRange(out, scanline, prevline, bytewidth, filterType, i, length);
+}
+#endif /*LODEPNG_SSE2*/
+
+#ifdef LODEPNG_AVX2
+LODEPNG_TARGET_AVX2 static size_t sum64_avx2(__m256i v) {
+  return sum64_sse2(_mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+LODEPNG_TARGET_AVX2 static LODEPNG_INLINE __m256i cost_avx2(__m256i r) {
+  return _mm256_sad_epu8(_mm256_min_epu8(r, _mm256_xor_si256(r, _mm256_set1_epi8(-1))), _mm256_setzero_si256());
+}
+
+/*filterCosts_sse2, 32 bytes at a time*/
+LODEPNG_TARGET_AVX2 static void filterCosts_avx2(size_t cost[5], const unsigned char* scanline,
+                                                 const unsigned char* prevline, size_t length, size_t bytewidth) {
+  const __m256i z = _mm256_setzero_si256();
+  __m256i s0 = z, s1 = z, s2 = z, s3 = z, s4 = z;
+  size_t i = bytewidth;
+  for(; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(prevline + i - bytewidth));
+    s0 = _mm256_add_epi64(s0, _mm256_sad_epu8(x, z));
+    s1 = _mm256_add_epi64(s1, cost_avx2(_mm256_sub_epi8(x, a)));
+    s2 = _mm256_add_epi64(s2, cost_avx2(_mm256_sub_epi8(x, b)));
+    s3 = _mm256_add_epi64(s3, cost_avx2(_mm256_sub_epi8(x, avgPredictor_avx2(a, b))));
+    s4 = _mm256_add_epi64(s4, cost_avx2(_mm256_sub_epi8(x, paethPredictor_avx2(a, b, c))));
+  }
+  cost[0] += sum64_avx2(s0);
+  cost[1] += sum64_avx2(s1);
+  cost[2] += sum64_avx2(s2);
+  cost[3] += sum64_avx2(s3);
+  cost[4] += sum64_avx2(s4);
+  filterCostsRange(cost, scanline, prevline, bytewidth, 0, bytewidth);
+  filterCostsRange(cost, scanline, prevline, bytewidth, i, length);
+}
+
+/*filterScanline_sse2, 32 bytes at a time*/
+LODEPNG_TARGET_AVX2 static void filterScanline_avx2(unsigned char* out, const unsigned char* scanline,
+                                                    const unsigned char* prevline, size_t length,
+                                                    size_t bytewidth, unsigned char filterType) {
+  size_t i = bytewidth;
+  for(; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+    __m256i p;
+    if(filterType == 1) p = a;
+    else if(filterType == 2) p = b;
+    else if(filterType == 3) p = avgPredictor_avx2(a, b);
+    else p = paethPredictor_avx2(a, b, _mm256_loadu_si256((const __m256i*)(prevline + i - bytewidth)));
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_sub_epi8(x, p));
+  }
+  filterScanlineRange(out, scanline, prevline, bytewidth, filterType, 0, bytewidth);
+  filterScanlineRange(out, scanline, prevline, bytewidth, filterType, i, length);
+}
+#endif /*LODEPNG_AVX2*/
+
+/*the LFS_MINSUM cost of each filter type for a whole scanline, using the fastest kernel available*/
+static void filterCosts(size_t cost[5], const unsigned char* scanline, const unsigned char* prevline,
+                        size_t length, size_t bytewidth) {
+  cost[0] = cost[1] = cost[2] = cost[3] = cost[4] = 0;
+#ifdef LODEPNG_AVX2
+  if(prevline && lodepng_cpu_has_avx2()) {
+    filterCosts_avx2(cost, scanline, prevline, length, bytewidth);
+    return;
+  }
+#endif /*LODEPNG_AVX2*/
+#ifdef LODEPNG_SSE2
+  if(prevline) {
+    filterCosts_sse2(cost, scanline, prevline, length, bytewidth);
+    return;
+  }
+#endif /*LODEPNG_SSE2*/
+  filterCostsRange(cost, scanline, prevline, bytewidth, 0, length);
+}
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType) {
   size_t i;
+#ifdef LODEPNG_AVX2
+  if(prevline && filterType >= 1 && filterType <= 4 && lodepng_cpu_has_avx2()) {
+    filterScanline_avx2(out, scanline, prevline, length, bytewidth, filterType);
+    return;
+  }
+#endif /*LODEPNG_AVX2*/
+#ifdef LODEPNG_SSE2
+  if(prevline && filterType >= 1 && filterType <= 4) {
+    filterScanline_sse2(out, scanline, prevline, length, bytewidth, filterType);
+    return;
+  }
+#endif /*LODEPNG_SSE2*/
   switch(filterType) {
     case 0: /*None*/
       for(i = 0; i != length; ++i) out[i] = scanline[i];
@@ -5435,52 +5890,27 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[inindex];
     }
   } else if(strategy == LFS_MINSUM) {
-    /*adaptive filtering*/
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) error = 83; /*alloc fail*/
-    }
-
-    if(!error) {
-      for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
+    /*adaptive filtering: only the sums are worked out for each filter type, and
+    the scanline is filtered once, with the type that has the smallest sum*/
+    size_t cost[5];
+    unsigned char type, bestType;
 
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum < smallest) {
-            bestType = type;
-            smallest = sum;
-          }
-        }
-
-        prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+    for(y = 0; y != h; ++y) {
+      const unsigned char* scanline = &in[y * linebytes];
+      filterCosts(cost, scanline, prevline, linebytes, bytewidth);
+
+      /*For differences, each byte is treated as signed, values above 127 are negative
+      (converted to signed char). Filtertype 0 isn't a difference though, so it uses
+      unsigned. This means filtertype 0 is almost never chosen, but that is justified.*/
+      bestType = 0;
+      for(type = 1; type != 5; ++type) {
+        if(cost[type] < cost[bestType]) bestType = type;
       }
-    }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      filterScanline(&out[y * (linebytes + 1) + 1], scanline, prevline, linebytes, bytewidth, bestType);
+      prevline = scanline;
+    }
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
@@ -5582,6 +6012,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+unsigned lodepng_filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                        const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  return filter(out, in, w, h, color, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -283,6 +283,9 @@ struct LodePNGDecompressSettings {
   const void* custom_context; /*optional custom settings for custom functions*/
 };
 
+/*receives inflated data in pieces, see lodepng_zlib_decompress_stream*/
+typedef unsigned (*LodePNGInflateSink)(void* user, const unsigned char* data, size_t size);
+
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
 void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -645,6 +648,16 @@ typedef struct LodePNGDecoderSettings {
 } LodePNGDecoderSettings;
 
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings);
+
+/*
+Undoes PNG filter method 0 on one scanline, for decoding row by row. scanline
+excludes the filter type byte, which is given as filterType. precon is the
+previous unfiltered scanline, or NULL for the first one. bytewidth is the bytes
+per pixel, rounded up to 1. recon and scanline may be the same buffer.
+*/
+unsigned lodepng_unfilter_scanline(unsigned char* recon, const unsigned char* scanline,
+                                   const unsigned char* precon, size_t bytewidth,
+                                   unsigned char filterType, size_t length);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -731,6 +744,15 @@ typedef struct LodePNGEncoderSettings {
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+
+/*
+Applies PNG filter method 0 to the h scanlines of in, choosing filter types as set
+in settings. out must hold h * (1 + raw bytes per scanline). The first scanline is
+filtered as the top of an image, so to filter a band in the middle of an image,
+pass it with one row above it included and skip that row's output.
+*/
+unsigned lodepng_filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                        const LodePNGColorMode* color, const LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -913,6 +935,16 @@ buffer and *outsize its size in bytes. out must be freed by user after usage.
 unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings);
+
+/*
+Like lodepng_zlib_decompress, but instead of keeping the whole output, hands it
+to sink in consecutive pieces as it is inflated, so only about 256K of output is
+buffered at any time. Custom zlib and inflate settings are not used. A nonzero
+return from sink stops decompression and is returned as the error code.
+*/
+unsigned lodepng_zlib_decompress_stream(const unsigned char* in, size_t insize,
+                                        const LodePNGDecompressSettings* settings,
+                                        LodePNGInflateSink sink, void* user);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -939,6 +971,15 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Like lodepng_deflate, but for one piece of a larger deflate stream. Unless last is
+true, no block is marked final and the output ends byte aligned on an empty stored
+block, so pieces compressed independently (e.g. in parallel) can be concatenated.
+*/
+unsigned lodepng_deflate_partial(unsigned char** out, size_t* outsize,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings, unsigned last);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -69,6 +69,7 @@ App::App(){
 	hovered_board = NULL;
 	marker_mode = false;
 	hide_splash = false;
+	set_pixel_bytes(BoardContent::PIXEL_BYTES);
 }
 App::~App(){
 }
@@ -494,10 +495,14 @@ void App::on_update(board_index iboard, int method, const unsigned char *buffer,
 	
 	Whiteboard *board = content_remote[iboard];
 	unsigned width = 2048;
-	ImageCoder::decode(method,
+	written.resize((size_t)w*h + 1);
+	const int ret = ImageCoder::decode(method,
 		buffer, buflen,
-		&board->image[3*(x+y*width)], width, w, h
+		&board->image[BoardContent::PIXEL_BYTES*(x+y*width)], width, w, h, BoardContent::PIXEL_BYTES,
+		&written[0]
 	);
+	// A failed decode may have written anything
+	board->image_replaced(BoardContent::Region(x, y, w, h), 0 == ret ? &written[0] : NULL);
 	board->UpdateTexture(&board->image[0], width, x, y, w, h);
 }
 void App::on_board_list_update(const std::vector<std::string> &boards_){
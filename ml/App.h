@@ -60,6 +60,7 @@ class App : BoardClient{
 	std::vector<std::string> users;
 	std::vector<Whiteboard*> content_remote;
 	std::vector<Whiteboard*> content_local;
+	std::vector<unsigned char> written; // pixels on_update decoded, as for image_replaced
 	Whiteboard *active_board; // the board that the user is currently pointing at
 	Whiteboard *hovered_board; // the board that is being hovered over in the GUI list
 
@@ -11,6 +11,9 @@
 const char APP_TAG[] = "vklBoards::Whiteboard";
 #include <ml_logging.h>
 
+// Upload format matching BoardContent::image
+static const GLenum board_format = (4 == BoardContent::PIXEL_BYTES ? GL_RGBA : GL_RGB);
+
 Whiteboard::Whiteboard(BoardClient *client_, bool is_remote_, int board_index, const std::string &name_):
 	BoardContent(),
 	client(client_),
@@ -27,7 +30,7 @@ Whiteboard::Whiteboard(BoardClient *client_, bool is_remote_, int board_index, c
 	UpdateTransform();
 
 	// Set up GUI
-	draw_gui(&image[3*(width - 64)], width, 64, height);
+	draw_gui(&image[PIXEL_BYTES*(width - 64)], width, 64, height);
 }
 
 Whiteboard::~Whiteboard(){
@@ -44,7 +47,7 @@ void Whiteboard::ApplyShader(Shader& shader) {
 
 	glGenTextures(1, &_texId);
 	glBindTexture(GL_TEXTURE_2D, _texId);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, &image[0]);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, board_format, GL_UNSIGNED_BYTE, &image[0]);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -161,7 +164,7 @@ void Whiteboard::px2coord(int x, int y, glm::vec2 &p) const {
 	p[1] = 0.5f - (float)y / height;
 }
 
-void Whiteboard::UpdateTexture(const unsigned char *data, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h){
+void Whiteboard::UpdateTexture(const unsigned char *data, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h, bool mipmap){
 	if(0 == _texId){ return; }
 	if(x >= width || y >= height){ return; }
 	if(x+w >  width){ w =  width-x; }
@@ -170,13 +173,15 @@ void Whiteboard::UpdateTexture(const unsigned char *data, unsigned stride, unsig
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
 	glTexSubImage2D(GL_TEXTURE_2D, 0,
 		x, y, w, h,
-		GL_RGB, GL_UNSIGNED_BYTE,
-		&data[3*(x+y*stride)]
+		board_format, GL_UNSIGNED_BYTE,
+		&data[PIXEL_BYTES*(x+y*stride)]
 	);
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 	// If we don't have GL_UNPACK_ROW_LENGTH, we must send entire width
 	//glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, h, GL_RGB, GL_UNSIGNED_BYTE, &image[3 * (x + y*stride)]);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	if(mipmap){
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -193,6 +198,15 @@ void Whiteboard::on_image_update(Region *touched){
 		UpdateTexture(&image[0], width, touched->x, touched->y, touched->w, touched->h);
 	}
 }
+void Whiteboard::on_image_update_list(const std::vector<Region> &touched){
+	for(size_t i = 0; i < touched.size(); ++i){
+		const Region &r = touched[i];
+		if(NULL != client){
+			client->send_update(iboard, &image[0], width, r.x, r.y, r.w, r.h, &changed[0]);
+		}
+		UpdateTexture(&image[0], width, r.x, r.y, r.w, r.h, i+1 == touched.size());
+	}
+}
 
 
 void Whiteboard::set_position(const glm::vec3 &pos, const glm::quat &rot){
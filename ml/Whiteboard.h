@@ -58,6 +58,8 @@ public:
 	void px2coord(int x, int y, glm::vec2 &p) const;
 	
 	void on_image_update(Region *touched = NULL);
+	void on_image_update_list(const std::vector<Region> &touched);
 public:
-	void UpdateTexture(const unsigned char *data, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h);
+	// Pass mipmap = false for all but the last of a batch of uploads
+	void UpdateTexture(const unsigned char *data, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h, bool mipmap = true);
 };
@@ -0,0 +1,39 @@
+#include "BoardClient.h"
+#include "lodepng.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+// Saves a PNG of a board, or of a region of it, as encoded by the server:
+//   board_snapshot host:port board file.png [x y w h]
+int main(int argc, char *argv[]){
+	if(argc != 4 && argc != 8){
+		fprintf(stderr, "usage: %s host:port board file.png [x y w h]\n", argv[0]);
+		return 1;
+	}
+	unsigned iboard = atoi(argv[2]);
+	unsigned x = 0, y = 0, w = 0, h = 0;
+	if(argc == 8){
+		x = atoi(argv[4]);
+		y = atoi(argv[5]);
+		w = atoi(argv[6]);
+		h = atoi(argv[7]);
+	}
+
+	BoardClient client;
+	if(client.connect(argv[1], "snapshot")){
+		fprintf(stderr, "Could not connect to %s\n", argv[1]);
+		return 1;
+	}
+	std::vector<unsigned char> png;
+	if(client.get_snapshot(iboard, png, x, y, w, h)){
+		fprintf(stderr, "No snapshot of board %u\n", iboard);
+		return 1;
+	}
+	unsigned error = lodepng_save_file(&png[0], png.size(), argv[3]);
+	if(error){
+		fprintf(stderr, "Could not save %s: %s\n", argv[3], lodepng_error_text(error));
+		return 1;
+	}
+	return 0;
+}
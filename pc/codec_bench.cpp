@@ -0,0 +1,703 @@
+// Benchmark for ImageCoder on board-sized content.
+// Encodes partial updates straight out of a 2048-wide board and decodes
+// them back into another board, the same way BoardClient and BoardServer
+// do, and reports throughput along with heap allocations per update.
+
+#include "ImageCoder.h"
+#include "EntropyCoder.h"
+#include "BoardContent.h"
+#include "PixelOps.h"
+#include "PngReader.h"
+#include "PngWriter.h"
+#include "lodepng.h"
+#include "fastlz.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+static unsigned long num_allocs = 0;
+
+void *operator new(size_t n){
+	++num_allocs;
+	void *p = malloc(n ? n : 1);
+	if(NULL == p){ throw std::bad_alloc(); }
+	return p;
+}
+void operator delete(void *p) noexcept{
+	free(p);
+}
+
+static double now(){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// White board with a few hundred short dark strokes, roughly what a
+// board looks like after a meeting.
+static void make_board(std::vector<unsigned char> &img, unsigned width, unsigned height){
+	img.assign(3*width*height, 0xff);
+	srand(1);
+	for(int s = 0; s < 400; ++s){
+		int x = rand() % (width-64);
+		int y = rand() % height;
+		int dx = rand() % 5 - 2;
+		int dy = rand() % 5 - 2;
+		unsigned char c = rand() % 128;
+		for(int k = 0; k < 60; ++k){
+			for(int j = -2; j <= 2; ++j){
+				for(int i = -2; i <= 2; ++i){
+					int px = x + i, py = y + j;
+					if(px < 0 || py < 0 || px >= (int)width || py >= (int)height){ continue; }
+					memset(&img[3*(px+py*width)], c, 3);
+				}
+			}
+			x += dx; y += dy;
+		}
+	}
+}
+
+// Smooth random field plus grain, standing in for a pasted photograph.
+static void make_photo(std::vector<unsigned char> &img, unsigned width, unsigned height){
+	img.resize(3*width*height);
+	srand(1);
+	float phase[3][4];
+	for(int k = 0; k < 3; ++k){
+		for(int f = 0; f < 4; ++f){ phase[k][f] = (rand() % 1000) * 0.00628f; }
+	}
+	for(unsigned j = 0; j < height; ++j){
+		for(unsigned i = 0; i < width; ++i){
+			for(int k = 0; k < 3; ++k){
+				float v = 128;
+				for(int f = 0; f < 4; ++f){
+					float s = (f+1) * 0.004f;
+					v += 30.f/(f+1) * sinf(s*i*(k+2) + phase[k][f]) * cosf(s*j*(5-k) + phase[k][3-f]);
+				}
+				v += (rand() % 17) - 8;
+				img[3*(i+j*width)+k] = (v < 0 ? 0 : (v > 255 ? 255 : (unsigned char)v));
+			}
+		}
+	}
+}
+
+struct Case{
+	const char *name;
+	unsigned w, h;
+	unsigned count;
+};
+
+// Draws strokes through BoardContent and sends every resulting update
+// through a connection stream compressor, to compare bytes per stroke
+// with and without a dictionary shared across messages.
+struct StrokeBench : public BoardContent{
+	fastlz_stream *zfastlz, *zraw;
+	size_t updates, bytes_fastlz, bytes_fastlz_stream, bytes_raw_stream;
+	std::vector<unsigned char> buffer, packed;
+	StrokeBench():updates(0), bytes_fastlz(0), bytes_fastlz_stream(0), bytes_raw_stream(0){
+		zfastlz = fastlz_stream_create();
+		zraw = fastlz_stream_create();
+		packed.resize(2*FASTLZ_STREAM_MAX_BLOCK);
+	}
+	~StrokeBench(){
+		fastlz_stream_destroy(zfastlz);
+		fastlz_stream_destroy(zraw);
+	}
+	size_t send(fastlz_stream *z, int method, const Region &r){
+		buffer.resize(10); // message header
+		ImageCoder::encode(method, &image[PIXEL_BYTES*(r.x+r.y*width)], width, r.w, r.h, buffer, PIXEL_BYTES);
+		if(NULL == z){ return buffer.size(); }
+		if(buffer.size() > FASTLZ_STREAM_MAX_BLOCK){ return buffer.size(); }
+		return fastlz_stream_compress(z, &buffer[0], buffer.size(), &packed[0]);
+	}
+	void on_image_update(Region *touched){
+		if(NULL == touched){ return; }
+		++updates;
+		bytes_fastlz += send(NULL, ImageCoder::METHOD_FASTLZ, *touched);
+		bytes_fastlz_stream += send(zfastlz, ImageCoder::METHOD_FASTLZ, *touched);
+		bytes_raw_stream += send(zraw, ImageCoder::METHOD_RAW, *touched);
+	}
+};
+
+static int stream_bench(){
+	StrokeBench board;
+	srand(3);
+	const int nstrokes = 300;
+	for(int s = 0; s < nstrokes; ++s){
+		board.pen_set_color(board.color_palette[rand() % board.color_palette.size()]);
+		board.pen_set_size(s % 3 == 0 ? 20.f : (s % 3 == 1 ? 10.f : 5.f));
+		float x = 100 + rand() % 1700, y = 100 + rand() % 800;
+		float dx = (rand() % 11) - 5, dy = (rand() % 11) - 5;
+		board.pen_move(x, y);
+		board.pen_down(x, y);
+		for(int k = 0; k < 40; ++k){
+			x += dx; y += dy;
+			dx += ((rand() % 5) - 2) * 0.5f;
+			dy += ((rand() % 5) - 2) * 0.5f;
+			board.pen_move(x, y);
+		}
+		board.pen_up(x, y);
+	}
+	printf("%d strokes, %zu updates\n", nstrokes, board.updates);
+	printf("%-24s %12s %12s\n", "mode", "bytes/upd", "bytes/stroke");
+	printf("%-24s %12.1f %12.1f\n", "fastlz", (double)board.bytes_fastlz/board.updates, (double)board.bytes_fastlz/nstrokes);
+	printf("%-24s %12.1f %12.1f\n", "fastlz + stream", (double)board.bytes_fastlz_stream/board.updates, (double)board.bytes_fastlz_stream/nstrokes);
+	printf("%-24s %12.1f %12.1f\n", "raw + stream", (double)board.bytes_raw_stream/board.updates, (double)board.bytes_raw_stream/nstrokes);
+	return 0;
+}
+
+// Throughput of the EntropyCoder stage alone, on whole-board payloads of
+// the methods it gets chained after.
+static int entropy_bench(){
+	const unsigned width = 2048, height = 1024;
+	std::vector<unsigned char> img;
+	printf("%-16s %10s %10s %12s %12s\n", "payload", "bytes", "ratio", "enc MB/s", "dec MB/s");
+	for(int k = 0; k < 2; ++k){
+		const int method = (0 == k ? ImageCoder::METHOD_FASTLZ : ImageCoder::METHOD_LOSSY);
+		if(0 == k){
+			make_board(img, width, height);
+		}else{
+			make_photo(img, width, height);
+		}
+		std::vector<unsigned char> payload, coded, decoded;
+		ImageCoder::encode(method, &img[0], width, width, height, payload);
+		decoded.resize(payload.size());
+		const int reps = 20;
+		double tenc = 0, tdec = 0;
+		bool ok = true;
+		for(int r = 0; r < reps; ++r){
+			coded.clear();
+			double t0 = now();
+			EntropyCoder::encode(&payload[0], payload.size(), coded);
+			double t1 = now();
+			if(0 != EntropyCoder::decode(&coded[0], coded.size(), &decoded[0], decoded.size())){ ok = false; }
+			double t2 = now();
+			tenc += t1-t0;
+			tdec += t2-t1;
+		}
+		if(decoded != payload){ ok = false; }
+		const double mb = (double)payload.size()*reps*1e-6;
+		printf("%-16s %10zu %10.3f %12.1f %12.1f%s\n",
+			0 == k ? "fastlz drawing" : "lossy photo",
+			coded.size(), (double)coded.size()/payload.size(), mb/tenc, mb/tdec,
+			ok ? "" : "  FAILED"
+		);
+	}
+	return 0;
+}
+
+// fastlz levels on their own, on whole boards and on stroke-sized pieces
+static int fastlz_bench(){
+	const unsigned width = 2048, height = 1024;
+	std::vector<unsigned char> img;
+	printf("%-16s %6s %10s %10s %12s %12s\n", "content", "level", "bytes", "ratio", "comp MB/s", "decomp MB/s");
+	for(int k = 0; k < 3; ++k){
+		const char *name;
+		unsigned piece;
+		if(2 == k){
+			make_photo(img, width, height);
+			name = "photo";
+			piece = 3*width*height;
+		}else{
+			make_board(img, width, height);
+			name = (0 == k ? "drawing" : "drawing 36KB");
+			piece = (0 == k ? 3*width*height : 3*300*40);
+		}
+		const unsigned npieces = img.size() / piece;
+		std::vector<unsigned char> packed(piece + piece/16 + 66), unpacked(piece);
+		for(int level = 1; level <= 3; ++level){
+			const int reps = (0 == k ? 10 : (1 == k ? 4 : 2));
+			double tcomp = 0, tdecomp = 0;
+			size_t nbytes = 0;
+			bool ok = true;
+			for(int r = 0; r < reps; ++r){
+				for(unsigned i = 0; i < npieces; ++i){
+					const unsigned char *src = &img[(size_t)i*piece];
+					double t0 = now();
+					int sz = fastlz_compress_level(level, src, piece, &packed[0]);
+					double t1 = now();
+					int n = fastlz_decompress(&packed[0], sz, &unpacked[0], piece);
+					double t2 = now();
+					tcomp += t1-t0;
+					tdecomp += t2-t1;
+					nbytes += sz;
+					if(n != (int)piece || 0 != memcmp(src, &unpacked[0], piece)){ ok = false; }
+				}
+			}
+			const double raw = (double)piece*npieces*reps;
+			printf("%-16s %6d %10.0f %10.3f %12.1f %12.1f%s\n",
+				name, level, (double)nbytes/reps, nbytes/raw, raw/tcomp*1e-6, raw/tdecomp*1e-6,
+				ok ? "" : "  FAILED"
+			);
+		}
+	}
+	return 0;
+}
+
+// PNG scanline filtering and unfiltering on their own, then whole encodes
+// and decodes, on board-sized content
+static int png_filter_bench(){
+	const unsigned width = 2048, height = 1024;
+	const size_t linebytes = 3*width;
+	std::vector<unsigned char> img, filtered((linebytes+1)*height), recon(linebytes*height), png;
+	LodePNGColorMode color;
+	lodepng_color_mode_init(&color);
+	color.colortype = LCT_RGB;
+	color.bitdepth = 8;
+	LodePNGEncoderSettings settings;
+	lodepng_encoder_settings_init(&settings);
+	printf("%-10s %12s %12s %12s %12s\n", "content", "filter MB/s", "unfilt MB/s", "encode ms", "decode ms");
+	for(int k = 0; k < 2; ++k){
+		if(0 == k){
+			make_board(img, width, height);
+		}else{
+			make_photo(img, width, height);
+		}
+		double tf = 1e9, tu = 1e9, te = 1e9, td = 1e9;
+		bool ok = true;
+		for(int r = 0; r < 5; ++r){
+			double t0 = now();
+			lodepng_filter(&filtered[0], &img[0], width, height, &color, &settings);
+			double t1 = now();
+			for(unsigned j = 0; j < height; ++j){
+				const unsigned char *line = &filtered[j*(linebytes+1)];
+				lodepng_unfilter_scanline(&recon[j*linebytes], line+1, j > 0 ? &recon[(j-1)*linebytes] : NULL, 3, line[0], linebytes);
+			}
+			double t2 = now();
+			PngWriter::encode_rgb(png, &img[0], width, height);
+			double t3 = now();
+			unsigned char *decoded = NULL;
+			unsigned dw, dh;
+			lodepng_decode24(&decoded, &dw, &dh, &png[0], png.size());
+			double t4 = now();
+			if(NULL == decoded || 0 != memcmp(decoded, &img[0], img.size())){ ok = false; }
+			free(decoded);
+			if(0 != memcmp(&recon[0], &img[0], img.size())){ ok = false; }
+			if(t1-t0 < tf){ tf = t1-t0; }
+			if(t2-t1 < tu){ tu = t2-t1; }
+			if(t3-t2 < te){ te = t3-t2; }
+			if(t4-t3 < td){ td = t4-t3; }
+		}
+		printf("%-10s %12.1f %12.1f %12.1f %12.1f%s\n", 0 == k ? "drawing" : "photo",
+			img.size()/tf*1e-6, img.size()/tu*1e-6, te*1e3, td*1e3, ok ? "" : "  FAILED");
+	}
+	return 0;
+}
+
+// Exporting a board again after each of a few small strokes, encoding it
+// from scratch against reusing the unchanged bands
+static int png_export_bench(){
+	const unsigned width = 2048, height = 1024;
+	std::vector<unsigned char> img, png;
+	make_board(img, width, height);
+	PngWriter::Incremental incremental;
+	double t0 = now();
+	incremental.encode_rgb(png, &img[0], width, height);
+	const double first = now() - t0;
+	const size_t first_size = png.size();
+	double full = 0, incr = 0;
+	size_t full_size = 0, incr_size = 0, changed = 0;
+	bool ok = true;
+	const int strokes = 20;
+	srand(2);
+	for(int s = 0; s < strokes; ++s){
+		const unsigned x = rand() % (width-64), y = rand() % (height-8);
+		for(unsigned j = 0; j < 8; ++j){
+			memset(&img[3*(x+(y+j)*width)], rand() % 128, 3*64);
+		}
+		t0 = now();
+		PngWriter::encode_rgb(png, &img[0], width, height);
+		double t1 = now();
+		full += t1 - t0;
+		full_size += png.size();
+		incremental.encode_rgb(png, &img[0], width, height);
+		incr += now() - t1;
+		incr_size += png.size();
+		changed += incremental.bands_changed();
+		unsigned char *decoded = NULL;
+		unsigned dw, dh;
+		lodepng_decode24(&decoded, &dw, &dh, &png[0], png.size());
+		if(NULL == decoded || 0 != memcmp(decoded, &img[0], img.size())){ ok = false; }
+		free(decoded);
+	}
+	printf("%-14s %10s %10s %14s\n", "export", "ms", "bytes", "bands redone");
+	printf("%-14s %10.1f %10zu %14s\n", "full", full/strokes*1e3, full_size/strokes, "");
+	printf("%-14s %10.1f %10zu %14u\n", "incr first", first*1e3, first_size, incremental.num_bands());
+	printf("%-14s %10.1f %10zu %14.1f%s\n", "incr repeat", incr/strokes*1e3, incr_size/strokes, (double)changed/strokes, ok ? "" : "  FAILED");
+	return 0;
+}
+
+// Solid fills: the per-pixel loop clear() used, the same loop with the
+// colour worked out once, and PixelOps, over a whole board and over spans
+// the width of a pen stroke
+static int fill_bench(){
+	const unsigned width = 2048, height = 1024;
+	std::vector<unsigned char> img(3*width*height), ref(img.size());
+	const float color[3] = { 0.2f, 0.6f, 0.9f };
+	const unsigned char rgb[3] = { (unsigned char)(255*color[0]), (unsigned char)(255*color[1]), (unsigned char)(255*color[2]) };
+	const unsigned spans[2] = { width, 20 };
+	printf("%-10s %-10s %12s\n", "span", "kernel", "MB/s");
+	for(int s = 0; s < 2; ++s){
+		const unsigned n = spans[s];
+		const unsigned per_row = width / n;
+		for(int kernel = 0; kernel < 3; ++kernel){
+			double best = 1e9;
+			for(int r = 0; r < 5; ++r){
+				double t0 = now();
+				for(unsigned y = 0; y < height; ++y){
+					for(unsigned k = 0; k < per_row; ++k){
+						unsigned char *p = &img[3*(k*n + y*width)];
+						if(0 == kernel){
+							for(unsigned i = 0; i < n; ++i){
+								p[3*i + 0] = 255*color[0];
+								p[3*i + 1] = 255*color[1];
+								p[3*i + 2] = 255*color[2];
+							}
+						}else if(1 == kernel){
+							for(unsigned i = 0; i < n; ++i){
+								p[0] = rgb[0];
+								p[1] = rgb[1];
+								p[2] = rgb[2];
+								p += 3;
+							}
+						}else{
+							PixelOps::fill_rgb(p, n, rgb);
+						}
+					}
+				}
+				double t = now() - t0;
+				if(t < best){ best = t; }
+			}
+			if(0 == kernel){ ref = img; }
+			const char *names[3] = { "per-pixel", "hoisted", "PixelOps" };
+			char name[16];
+			snprintf(name, sizeof(name), "%u px", n);
+			printf("%-10s %-10s %12.0f%s\n", name, names[kernel], img.size() / best / 1e6, img == ref ? "" : "  FAILED");
+			std::fill(img.begin(), img.end(), 0);
+		}
+	}
+	return 0;
+}
+
+// Pasting a board-sized image in each source layout, with the generic
+// per-byte loop paste_image used to have and with its kernels now. Each
+// paste is timed once the undo history's worker has compressed the last.
+static int paste_bench(){
+	BoardContent board;
+	const unsigned w = board.drawable_region.w, h = board.drawable_region.h;
+	struct Layout{ const char *name; unsigned format, bpp; };
+	const Layout layouts[4] = {
+		{ "RGB", BoardContent::PASTE_FORMAT_RGBA, 3 },
+		{ "RGBA", BoardContent::PASTE_FORMAT_RGBA, 4 },
+		{ "BGRA", BoardContent::PASTE_FORMAT_BGR, 4 },
+		{ "gray", BoardContent::PASTE_FORMAT_BW, 1 }
+	};
+	std::vector<unsigned char> src(4*(size_t)w*h);
+	srand(3);
+	for(size_t i = 0; i < src.size(); ++i){ src[i] = rand(); }
+	std::vector<unsigned char> ref(3*(size_t)w*h);
+	printf("%-8s %12s %12s\n", "layout", "loop MB/s", "paste MB/s");
+	for(int l = 0; l < 4; ++l){
+		const Layout &L = layouts[l];
+		const unsigned stride = L.bpp*w;
+		double best[2] = { 1e9, 1e9 };
+		for(int r = 0; r < 5; ++r){
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			double t0 = now();
+			for(unsigned j = 0; j < h; ++j){
+				for(unsigned i = 0; i < w; ++i){
+					for(unsigned k = 0; k < 3; ++k){
+						unsigned c = k;
+						if(BoardContent::PASTE_FORMAT_BGR == L.format){ c = 2 - k; }
+						if(BoardContent::PASTE_FORMAT_BW == L.format){ c = 0; }
+						ref[3*(i+j*w)+k] = src[L.bpp*i + j*stride + c];
+					}
+				}
+			}
+			double t1 = now();
+			board.paste_image(BoardContent::PASTE_LOC_LEFT | BoardContent::PASTE_LOC_TOP, L.format, &src[0], stride, L.bpp, w, h);
+			double t2 = now();
+			if(t1 - t0 < best[0]){ best[0] = t1 - t0; }
+			if(t2 - t1 < best[1]){ best[1] = t2 - t1; }
+		}
+		bool ok = true;
+		for(unsigned j = 0; j < h && ok; ++j){
+			ok = (0 == memcmp(&board.background[3*j*board.width], &ref[3*j*w], 3*w));
+		}
+		// Counted as bytes read plus bytes written
+		const double bytes = (double)(L.bpp + 3)*w*h;
+		printf("%-8s %12.0f %12.0f%s\n", L.name, bytes/best[0]/1e6, bytes/best[1]/1e6, ok ? "" : "  FAILED");
+	}
+	return 0;
+}
+
+// Strokes over a pasted photograph, sent as whole dirty rectangles and as
+// just the pixels the ink changed. The sparse updates are also decoded
+// into a copy of the board, which has to end up the same.
+// A wandering stroke of 40 samples, with the colour, size and antialiasing
+// varying from one to the next
+static void random_stroke(BoardContent &board, int s){
+	board.pen_set_color(board.color_palette[rand() % board.color_palette.size()]);
+	board.pen_set_size(s % 3 == 0 ? 20.f : (s % 3 == 1 ? 10.f : 5.f));
+	board.pen_set_antialias(s % 2 == 0);
+	float x = 100 + rand() % 1700, y = 100 + rand() % 800;
+	float dx = (rand() % 11) - 5, dy = (rand() % 11) - 5;
+	board.pen_move(x, y);
+	board.pen_down(x, y);
+	for(int k = 0; k < 40; ++k){
+		x += dx; y += dy;
+		dx += ((rand() % 5) - 2) * 0.5f;
+		dy += ((rand() % 5) - 2) * 0.5f;
+		board.pen_move(x, y);
+	}
+	board.pen_up(x, y);
+}
+
+struct InkBench : public BoardContent{
+	size_t updates, bytes_dense, bytes_sparse;
+	std::vector<unsigned char> buffer, mirror;
+	InkBench():updates(0), bytes_dense(0), bytes_sparse(0){}
+	void on_image_update_list(const std::vector<Region> &touched){
+		for(size_t i = 0; i < touched.size(); ++i){
+			const Region &r = touched[i];
+			const size_t k = r.x + r.y*(size_t)width;
+			++updates;
+			buffer.clear();
+			ImageCoder::encode(ImageCoder::METHOD_FASTLZ, &image[PIXEL_BYTES*k], width, r.w, r.h, buffer, PIXEL_BYTES);
+			bytes_dense += buffer.size();
+			buffer.clear();
+			ImageCoder::encode_sparse(&image[PIXEL_BYTES*k], width, r.w, r.h, &changed[k], buffer, PIXEL_BYTES);
+			bytes_sparse += buffer.size();
+			ImageCoder::decode(ImageCoder::METHOD_SPARSE, &buffer[0], buffer.size(), &mirror[PIXEL_BYTES*k], width, r.w, r.h, PIXEL_BYTES);
+		}
+	}
+};
+
+static int ink_bench(){
+	InkBench board;
+	const unsigned w = board.drawable_region.w, h = board.drawable_region.h;
+	std::vector<unsigned char> photo;
+	make_photo(photo, w, h);
+	board.paste_image(BoardContent::PASTE_LOC_LEFT | BoardContent::PASTE_LOC_TOP, BoardContent::PASTE_FORMAT_RGBA, &photo[0], 3*w, 3, w, h);
+	board.mirror = board.image;
+	srand(3);
+	const int nstrokes = 300;
+	double t0 = now();
+	for(int s = 0; s < nstrokes; ++s){
+		board.pen_set_eraser(s % 10 == 9);
+		random_stroke(board, s);
+	}
+	double t1 = now();
+	const bool ok = (board.mirror == board.image);
+	printf("%d strokes, %zu updates, %.1f us per stroke\n", nstrokes, board.updates, 1e6*(t1 - t0)/nstrokes);
+	printf("%-24s %12s %12s\n", "mode", "bytes/upd", "bytes/stroke");
+	printf("%-24s %12.1f %12.1f\n", "dirty rectangles", (double)board.bytes_dense/board.updates, (double)board.bytes_dense/nstrokes);
+	printf("%-24s %12.1f %12.1f%s\n", "changed pixels", (double)board.bytes_sparse/board.updates, (double)board.bytes_sparse/nstrokes, ok ? "" : "  FAILED");
+	return 0;
+}
+
+// Costs that depend on the layout of BoardContent::image, for the one this
+// was built with; build codec_bench_rgbx for the other. Strokes are drawn
+// and composited, their rectangles encoded for the network, and turned
+// into the RGBA of a GL_RGBA8 texture, which is what a driver does on the
+// CPU when it is given GL_RGB.
+struct LayoutBench : public BoardContent{
+	std::vector<Region> rects;
+	void on_image_update_list(const std::vector<Region> &touched){
+		rects.insert(rects.end(), touched.begin(), touched.end());
+	}
+};
+
+static int layout_bench(){
+	LayoutBench board;
+	const unsigned w = board.drawable_region.w, h = board.drawable_region.h;
+	std::vector<unsigned char> photo;
+	make_photo(photo, w, h);
+	board.paste_image(BoardContent::PASTE_LOC_LEFT | BoardContent::PASTE_LOC_TOP, BoardContent::PASTE_FORMAT_RGBA, &photo[0], 3*w, 3, w, h);
+	srand(3);
+	const int nstrokes = 300;
+	double t0 = now();
+	for(int s = 0; s < nstrokes; ++s){
+		random_stroke(board, s);
+	}
+	double t1 = now();
+
+	size_t pixels = 0, bytes = 0;
+	std::vector<unsigned char> buffer;
+	for(size_t i = 0; i < board.rects.size(); ++i){
+		const BoardContent::Region &r = board.rects[i];
+		buffer.clear();
+		ImageCoder::encode(ImageCoder::METHOD_FASTLZ, &board.image[BoardContent::PIXEL_BYTES*(r.x + r.y*board.width)], board.width, r.w, r.h, buffer, BoardContent::PIXEL_BYTES);
+		pixels += (size_t)r.w*r.h;
+		bytes += buffer.size();
+	}
+	double t2 = now();
+
+	std::vector<unsigned char> texture(4*(size_t)board.width*board.height);
+	for(size_t i = 0; i < board.rects.size(); ++i){
+		const BoardContent::Region &r = board.rects[i];
+		for(int j = r.y; j < r.y + r.h; ++j){
+			const size_t k = r.x + (size_t)j*board.width;
+			if(4 == BoardContent::PIXEL_BYTES){
+				memcpy(&texture[4*k], &board.image[4*k], 4*(size_t)r.w);
+			}else{
+				PixelOps::rgbx_from_rgb(&texture[4*k], &board.image[3*k], r.w);
+			}
+		}
+	}
+	double t3 = now();
+
+	printf("%s image: %.1f MB per %ux%u board, %zu updates of %.1f px\n",
+		4 == BoardContent::PIXEL_BYTES ? "RGBX" : "RGB",
+		board.image.size() / 1048576.0, board.width, board.height,
+		board.rects.size(), (double)pixels / board.rects.size()
+	);
+	printf("%-24s %12.1f us/stroke\n", "draw and composite", 1e6*(t1 - t0)/nstrokes);
+	printf("%-24s %12.0f Mpx/s  %zu bytes\n", "encode", pixels/(t2 - t1)/1e6, bytes);
+	printf("%-24s %12.0f Mpx/s\n", "texture upload copy", pixels/(t3 - t2)/1e6);
+	return 0;
+}
+
+// Importing a big PNG into a board: full decode and crop against
+// PngReader's row by row decode and shrink
+static int png_bench(){
+	const unsigned sizes[2][2] = { { 3840, 2160 }, { 6000, 4000 } };
+	printf("%-12s %-10s %10s %14s\n", "image", "path", "ms", "result");
+	for(int k = 0; k < 2; ++k){
+		const unsigned w = sizes[k][0], h = sizes[k][1];
+		std::vector<unsigned char> img, png, scratch, rgb;
+		make_photo(img, w, h);
+		PngWriter::encode_rgb(png, &img[0], w, h);
+		img.clear();
+		BoardContent board;
+		char name[32];
+		snprintf(name, sizeof(name), "%ux%u", w, h);
+		for(int path = 0; path < 2; ++path){
+			double best = 1e9;
+			unsigned rw = 0, rh = 0, error = 0;
+			for(int r = 0; r < 3; ++r){
+				double t0 = now();
+				if(0 == path){
+					unsigned char *full = NULL;
+					error = lodepng_decode24(&full, &rw, &rh, &png[0], png.size());
+					if(!error){
+						board.paste_image(BoardContent::PASTE_LOC_CENTERED, BoardContent::PASTE_FORMAT_RGBA, full, 3*rw, 3, rw, rh);
+					}
+					free(full);
+				}else{
+					scratch = png; // decode_rgb_fit reuses its input
+					error = PngReader::decode_rgb_fit(rgb, rw, rh, &scratch[0], scratch.size(), board.drawable_region.w, board.drawable_region.h);
+					if(!error){
+						board.paste_image(BoardContent::PASTE_LOC_CENTERED, BoardContent::PASTE_FORMAT_RGBA, &rgb[0], 3*rw, 3, rw, rh);
+					}
+				}
+				double t = now() - t0;
+				if(t < best){ best = t; }
+			}
+			char result[32];
+			snprintf(result, sizeof(result), "%ux%u", rw, rh);
+			printf("%-12s %-10s %10.1f %14s%s\n", name, 0 == path ? "crop" : "fit", best*1e3, result, error ? "  FAILED" : "");
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	if(argc > 1 && 0 == strcmp(argv[1], "stream")){
+		return stream_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "entropy")){
+		return entropy_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "fastlz")){
+		return fastlz_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "png")){
+		return png_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "pngfilter")){
+		return png_filter_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "pngexport")){
+		return png_export_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "fill")){
+		return fill_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "paste")){
+		return paste_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "ink")){
+		return ink_bench();
+	}
+	if(argc > 1 && 0 == strcmp(argv[1], "layout")){
+		return layout_bench();
+	}
+	const unsigned width = 2048, height = 1024;
+	const int method = (argc > 1 ? atoi(argv[1]) : 1);
+	const bool photo = (argc > 2 && 0 == strcmp(argv[2], "photo"));
+	if(argc > 3){ ImageCoder::set_lossy_quality(atoi(argv[3])); }
+	std::vector<unsigned char> src, dst;
+	if(photo){
+		make_photo(src, width, height);
+	}else{
+		make_board(src, width, height);
+	}
+	dst.assign(src.size(), 0);
+
+	const Case cases[] = {
+		{ "pen 5px",    12,   12, 20000 },
+		{ "pen 20px",   64,   24, 10000 },
+		{ "stroke",    300,  120,  2000 },
+		{ "paste",    1200,  900,    50 },
+		{ "board",   width, height,  20 },
+	};
+	printf("method %d, %s content", method, photo ? "photo" : "drawing");
+	if(ImageCoder::is_lossy(method)){ printf(", quality %d", ImageCoder::get_lossy_quality()); }
+	printf("\n%-10s %10s %10s %10s %12s %12s %12s %8s\n", "case", "updates", "bytes/upd", "ratio", "enc MB/s", "dec MB/s", "allocs/upd", "PSNR");
+
+	std::vector<unsigned char> buffer;
+	buffer.reserve(2*src.size());
+	for(unsigned c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c){
+		const Case &cs = cases[c];
+		double tenc = 0, tdec = 0;
+		size_t nbytes = 0;
+		double sqerr = 0;
+		unsigned long allocs_before = num_allocs;
+		bool ok = true;
+		srand(2);
+		for(unsigned n = 0; n < cs.count; ++n){
+			unsigned x = (cs.w < width ? rand() % (width - cs.w) : 0);
+			unsigned y = (cs.h < height ? rand() % (height - cs.h) : 0);
+			buffer.clear();
+			double t0 = now();
+			ImageCoder::encode(method, &src[3*(x+y*width)], width, cs.w, cs.h, buffer);
+			double t1 = now();
+			int ret = ImageCoder::decode(method, &buffer[0], buffer.size(), &dst[3*(x+y*width)], width, cs.w, cs.h);
+			double t2 = now();
+			tenc += t1-t0;
+			tdec += t2-t1;
+			nbytes += buffer.size();
+			if(0 != ret){ ok = false; }
+			for(unsigned j = 0; j < cs.h; ++j){
+				const unsigned char *a = &src[3*(x+(y+j)*width)];
+				const unsigned char *b = &dst[3*(x+(y+j)*width)];
+				for(unsigned i = 0; i < 3*cs.w; ++i){
+					double d = (double)a[i] - (double)b[i];
+					sqerr += d*d;
+				}
+			}
+		}
+		unsigned long allocs = num_allocs - allocs_before;
+		double raw = 3.0*cs.w*cs.h*cs.count;
+		double psnr = (sqerr > 0 ? 10*log10(255.0*255.0*raw/sqerr) : INFINITY);
+		printf("%-10s %10u %10.0f %10.3f %12.1f %12.1f %12.3f %8.2f%s\n",
+			cs.name, cs.count, (double)nbytes/cs.count, nbytes/raw,
+			raw/tenc*1e-6, raw/tdec*1e-6, (double)allocs/cs.count, psnr,
+			ok ? "" : "  FAILED"
+		);
+	}
+	return 0;
+}
@@ -8,9 +8,14 @@
 #include "BoardClient.h"
 #include "BoardContent.h"
 #include "ImageCoder.h"
+#include "JobQueue.h"
+#include "PixelOps.h"
+#include "PngReader.h"
+#include "PngWriter.h"
 #include "lodepng.h"
 #include "QrCode.hpp"
 #include <cstdio>
+#include <memory>
 #include <sstream>
 
 // Clipboard support
@@ -74,6 +79,9 @@ static unsigned rounduppow2(unsigned v){ // compute the next highest power of 2
 // BoardClient is the client interface to the server which manages data interchange for all boards residing on the server.
 // BoardContent is the management interface for a single locally cached board.
 // Our intent here is to have the BoardContent be a "view" into a single board obtained from the BoardClient.
+// Upload format matching BoardContent::image
+static const GLenum board_format = (4 == BoardContent::PIXEL_BYTES ? GL_RGBA : GL_RGB);
+
 struct MyBoard : public BoardClient, public BoardContent{
 	std::vector<std::string> boards;
 	std::vector<std::string> users;
@@ -84,11 +92,26 @@ struct MyBoard : public BoardClient, public BoardContent{
 	qrcodegen::QrCode qr;
 	unsigned qrsize, qrtexsize;
 
+	// Only touched by export jobs, which run one at a time
+	PngWriter::Incremental exporter;
+
+	// Pen input is written here as "pressed x y" lines when not NULL, for
+	// raster_bench to replay
+	FILE *trace;
+
+	// Which pixels of the last update on_update decoded were written
+	std::vector<unsigned char> written;
+
+	// Declared last so the worker stops before the rest of the board goes
+	JobQueue jobs;
+
 	MyBoard():
 		iboard(-1),
 		texID(0),
+		trace(NULL),
 		qr(qrcodegen::QrCode::encodeText("none", qrcodegen::QrCode::Ecc::HIGH))
 	{
+		set_pixel_bytes(PIXEL_BYTES);
 	}
 	int connect(const std::string &server_uri, const std::string &name){
 		int ret = BoardClient::connect(server_uri, name);
@@ -101,10 +124,12 @@ struct MyBoard : public BoardClient, public BoardContent{
 		if(boards.size() > 0){
 			iboard = 0;
 			BoardClient::get_size(iboard, width, height);
-			image.resize(3*width*height);
+			image.resize(PIXEL_BYTES*width*height);
 			get_contents(iboard, &image[0]);
+			image_replaced(Region(0, 0, width, height));
+			history.clear();
 			updatetex(&image[0], width, 0, 0, width, height);
-			draw_gui(&image[3*(width - 64)], width, 64, height);
+			draw_gui(&image[PIXEL_BYTES*(width - 64)], width, 64, height);
 		}
 		
 		//std::string uri1 = this->connection.socket.address().toString();
@@ -122,7 +147,7 @@ struct MyBoard : public BoardClient, public BoardContent{
 		// Generate texture for the board content
 		glGenTextures(1, &texID);
 		glBindTexture(GL_TEXTURE_2D, texID);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, &image[0]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, board_format, GL_UNSIGNED_BYTE, &image[0]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -165,6 +190,23 @@ struct MyBoard : public BoardClient, public BoardContent{
 			updatetex(&image[0], width, touched->x, touched->y, touched->w, touched->h);
 		}
 	}
+	void on_image_update_list(const std::vector<Region> &touched){
+		for(size_t i = 0; i < touched.size(); ++i){
+			const Region &r = touched[i];
+			send_update(iboard, &image[0], width, r.x, r.y, r.w, r.h, &changed[0]);
+			updatetex(&image[0], width, r.x, r.y, r.w, r.h, i+1 == touched.size());
+		}
+	}
+	void on_image_fill(const Region &r, pixel_coord x, pixel_coord y, const unsigned char rgb[3], unsigned tolerance){
+		send_fill(iboard, r.x, r.y, r.w, r.h, x, y, rgb, tolerance);
+		updatetex(&image[0], width, r.x, r.y, r.w, r.h);
+	}
+	void gui_input(bool pressed, int x, int y){
+		if(trace){
+			fprintf(trace, "%d %d %d\n", pressed ? 1 : 0, x, y);
+		}
+		BoardContent::gui_input(pressed, x, y);
+	}
 	void on_user_connected(const std::string &name){
 		users.push_back(name);
 	}
@@ -175,7 +217,8 @@ struct MyBoard : public BoardClient, public BoardContent{
 		}
 	}
 	
-	void updatetex(const unsigned char *data, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h){
+	// Pass mipmap = false for all but the last of a batch of uploads
+	void updatetex(const unsigned char *data, unsigned stride, unsigned x, unsigned y, unsigned w, unsigned h, bool mipmap = true){
 		if(0 == texID){ return; }
 		if(x >= width || y >= height){ return; }
 		if(x+w >  width){ w =  width-x; }
@@ -184,23 +227,29 @@ struct MyBoard : public BoardClient, public BoardContent{
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
 		glTexSubImage2D(GL_TEXTURE_2D, 0,
 			x, y, w, h,
-			GL_RGB, GL_UNSIGNED_BYTE,
-			&data[3*(x+y*stride)]
+			board_format, GL_UNSIGNED_BYTE,
+			&data[PIXEL_BYTES*(x+y*stride)]
 		);
 		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 		// If we don't have GL_UNPACK_ROW_LENGTH, we must send entire width
 		//glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, h, GL_RGB, GL_UNSIGNED_BYTE, &image[3 * (x + y*stride)]);
-		glGenerateMipmap(GL_TEXTURE_2D);
+		if(mipmap){
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
 		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 	
 	// This is called when we have network data
 	void on_update(board_index iboard_, int method, const unsigned char *buffer, unsigned buflen, unsigned x, unsigned y, unsigned w, unsigned h){
 		if(iboard != iboard_){ return; }
-		ImageCoder::decode(method,
+		written.resize((size_t)w*h + 1);
+		const int ret = ImageCoder::decode(method,
 			buffer, buflen,
-			&image[3*(x+y*width)], width, w, h
+			&image[PIXEL_BYTES*(x+y*width)], width, w, h, PIXEL_BYTES,
+			&written[0]
 		);
+		// A failed decode may have written anything
+		image_replaced(Region(x, y, w, h), 0 == ret ? &written[0] : NULL);
 		updatetex(&image[0], width, x, y, w, h);
 	}
 	
@@ -208,9 +257,11 @@ struct MyBoard : public BoardClient, public BoardContent{
 		if(0 <= i && i < boards.size()){
 			iboard = i;
 			BoardClient::get_size(iboard, width, height);
-			image.resize(3*width*height);
+			image.resize(PIXEL_BYTES*width*height);
 			get_contents(iboard, &image[0]);
-			draw_gui(&image[3*(width - 64)], width, 64, height);
+			image_replaced(Region(0, 0, width, height));
+			history.clear();
+			draw_gui(&image[PIXEL_BYTES*(width - 64)], width, 64, height);
 			updatetex(&image[0], width, 0, 0, width, height);
 		}
 	}
@@ -277,6 +328,17 @@ static void mouse_button_callback(GLFWwindow* window, int button, int action, in
 	int py = (int)(y+0.5);
 	board.gui_input(true, px, py);
 }
+// Completion that pastes a prepared image into the board on the main thread.
+static JobQueue::Completion paste_rgb(MyBoard &board, std::shared_ptr<std::vector<unsigned char> > rgb, unsigned w, unsigned h){
+	if(rgb->empty()){ return JobQueue::Completion(); }
+	return [&board, rgb, w, h](){
+		board.paste_image(
+			BoardContent::PASTE_LOC_CENTERED, BoardContent::PASTE_FORMAT_RGBA,
+			&(*rgb)[0], 3*w, 3,
+			w, h
+		);
+	};
+}
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods){
 	MyBoard &board = *(MyBoard*)glfwGetWindowUserPointer(window);
 	if(GLFW_PRESS == action){
@@ -284,60 +346,56 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 			glfwSetWindowShouldClose(window, GLFW_TRUE);
 		}else if(key == GLFW_KEY_V){
 			if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL)){
+				// paste_image converts the pixels as it copies them, at about
+				// the speed of a memcpy, so there is nothing to hand off
 				clip::image clipimg;
-				if(clip::get_image(clipimg)){ // got image from clipboard
-					unsigned w = clipimg.spec().width;
-					unsigned h = clipimg.spec().height;
-					std::vector<unsigned char> img(3*w*h);
-					if(clipimg.spec().bits_per_pixel == 32){
-						unsigned rawstride = clipimg.spec().bytes_per_row;
-						unsigned char *dstrow = &img[0];
-						unsigned char *srcrow = (unsigned char *)clipimg.data();
-						for(unsigned j = 0; j < h; ++j){
-							unsigned char *dstptr = dstrow;
-							unsigned char *srcptr = srcrow;
-							for(unsigned int i = 0; i < w; ++i){
-								dstptr[0] = srcptr[0];
-								dstptr[1] = srcptr[1];
-								dstptr[2] = srcptr[2];
-								dstptr += 3;
-								srcptr += 4;
-							}
-							srcrow += rawstride;
-							dstrow += 3*w;
-						}
-						board.paste_image(
-							BoardContent::PASTE_LOC_CENTERED, BoardContent::PASTE_FORMAT_RGBA,
-							&img[0], 3*w, 3,
-							w, h
-						);
+				if(clip::get_image(clipimg) && clipimg.spec().bits_per_pixel == 32){ // got image from clipboard
+					const clip::image_spec &spec = clipimg.spec();
+					unsigned format;
+					if(0 == spec.red_shift && 16 == spec.blue_shift){
+						format = BoardContent::PASTE_FORMAT_RGBA;
+					}else if(16 == spec.red_shift && 0 == spec.blue_shift){
+						format = BoardContent::PASTE_FORMAT_BGR;
+					}else{
+						return;
 					}
+					board.paste_image(
+						BoardContent::PASTE_LOC_CENTERED, format,
+						(const unsigned char *)clipimg.data(), spec.bytes_per_row, 4,
+						spec.width, spec.height
+					);
 				}
 			}
+		}else if(key == GLFW_KEY_Z && (mods & GLFW_MOD_CONTROL)){
+			if(mods & GLFW_MOD_SHIFT){
+				board.redo();
+			}else{
+				board.undo();
+			}
+		}else if(key == GLFW_KEY_Y && (mods & GLFW_MOD_CONTROL)){
+			board.redo();
 		}
 	}
 }
 static void drop_callback(GLFWwindow* window, int count, const char** paths){
 	MyBoard &board = *(MyBoard*)glfwGetWindowUserPointer(window);
+	const unsigned maxw = board.drawable_region.w, maxh = board.drawable_region.h;
 	int i;
 	for (i = 0;  i < count;  i++){
-		unsigned error;
-		unsigned char* image = 0;
-		unsigned width, height;
-//printf("file: %s\n", paths[i]);
-		error = lodepng_decode32_file(&image, &width, &height, paths[i]);
-		if(!error){
-			board.paste_image(
-				BoardContent::PASTE_LOC_CENTERED, BoardContent::PASTE_FORMAT_RGBA,
-				image, 4*width, 4,
-				width, height
-			);
-			free(image);
-		}
+		std::string path(paths[i]);
+		board.jobs.post([&board, path, maxw, maxh]() -> JobQueue::Completion{
+			std::shared_ptr<std::vector<unsigned char> > rgb(new std::vector<unsigned char>);
+			unsigned width, height;
+			unsigned error = PngReader::load_rgb_fit(*rgb, width, height, path, maxw, maxh);
+			if(error){
+				fprintf(stderr, "Could not load %s: %s\n", path.c_str(), lodepng_error_text(error));
+				return JobQueue::Completion();
+			}
+			return paste_rgb(board, rgb, width, height);
+		});
 	}
 }
 
-
 static const char *shader_vert = 
 "#version 330 core\n"
 "\n"
@@ -373,6 +431,13 @@ int main(int argc, char *argv[]){
 		myname = argv[2];
 	}
 	MyBoard board;
+	if(argc > 3){
+		board.trace = fopen(argv[3], "w");
+		if(NULL == board.trace){
+			fprintf(stderr, "Could not write %s\n", argv[3]);
+			return 1;
+		}
+	}
 	if(0 != board.connect(uri, myname)){
 		fprintf(stderr, "Could not connect to server\n");
 		return 1;
@@ -499,6 +564,8 @@ int main(int argc, char *argv[]){
 	board.BoardContent::get_size(width, height);
 	//printf("board size %u %u\n", width, height);
 	board.gentex();
+	// Mice can report many times per frame; draw and send once a frame
+	board.pen_set_deferred(true);
 
 	glGenVertexArrays(1, &vaoID);
 	glBindVertexArray(vaoID);
@@ -522,16 +589,21 @@ int main(int argc, char *argv[]){
 	glBindVertexArray(0);
 	glUseProgram(0);
 
+	// Set while an export job is queued; its completion clears it
+	bool exporting = false;
+
 	// Main loop
 	while (!glfwWindowShouldClose(window))
 	{
 		board.poll();
+		board.jobs.poll();
 		// Poll and handle events (inputs, window resize, etc.)
 		// You can read the io.WantCaptureMouse, io.WantCaptureKeyboard flags to tell if dear imgui wants to use your inputs.
 		// - When io.WantCaptureMouse is true, do not dispatch mouse input data to your main application.
 		// - When io.WantCaptureKeyboard is true, do not dispatch keyboard input data to your main application.
 		// Generally you may always pass all inputs to dear imgui, and hide them from your application based on those two flags.
 		glfwPollEvents();
+		board.flush_pen();
 
 		// Start the Dear ImGui frame
 		ImGui_ImplOpenGL3_NewFrame();
@@ -560,14 +632,70 @@ int main(int argc, char *argv[]){
 				title << "Board " << board.boards.size();
 				board.add_board(title.str());
 			}
-			if(ImGui::Button("Export board")){
+			if(exporting){
+				ImGui::Text("Exporting...");
+			}else if(ImGui::Button("Export board")){
 				char filename[32];
 				time_t rawtime;
 				struct tm *timeinfo;
 				time(&rawtime);
 				timeinfo = localtime(&rawtime);
 				strftime(filename, 32, "board-%Y-%m-%d-%H-%M-%S.png", timeinfo);
-				lodepng_encode24_file(filename, &board.image[0], width, height);
+				exporting = true;
+				std::string name(filename);
+				// PNGs are written from RGB
+				std::shared_ptr<std::vector<unsigned char> > image;
+				if(4 == BoardContent::PIXEL_BYTES){
+					image.reset(new std::vector<unsigned char>(3*(size_t)width*height));
+					PixelOps::rgb_from_rgbx(&(*image)[0], &board.image[0], (size_t)width*height);
+				}else{
+					image.reset(new std::vector<unsigned char>(board.image));
+				}
+				board.jobs.post([&board, &exporting, name, image, width, height](){
+					unsigned error = board.exporter.save_rgb(name, &(*image)[0], width, height);
+					return [&exporting, name, error](){
+						if(error){
+							fprintf(stderr, "Could not export %s: %s\n", name.c_str(), lodepng_error_text(error));
+						}
+						exporting = false;
+					};
+				});
+			}
+			if(ImGui::Button("Undo")){
+				board.undo();
+			}
+			ImGui::SameLine();
+			if(ImGui::Button("Redo")){
+				board.redo();
+			}
+			{
+				bool smooth = board.pen.antialias;
+				if(ImGui::Checkbox("Smooth strokes", &smooth)){
+					board.pen_set_antialias(smooth);
+				}
+				bool eraser = board.pen.eraser;
+				if(ImGui::Checkbox("Eraser", &eraser)){
+					board.pen_set_eraser(eraser);
+				}
+				bool fill = board.pen.fill;
+				if(ImGui::Checkbox("Fill", &fill)){
+					board.pen_set_fill(fill);
+				}
+				int tolerance = board.pen.fill_tolerance;
+				if(ImGui::SliderInt("Fill tolerance", &tolerance, 0, 255)){
+					board.pen_set_fill_tolerance(tolerance);
+				}
+				float steady = board.pen.smoothing;
+				if(ImGui::SliderFloat("Steady hand", &steady, 0.f, 0.9f)){
+					board.pen_set_smoothing(steady);
+				}
+			}
+			{
+				// 0 always sends pasted images losslessly
+				int quality = ImageCoder::get_lossy_quality();
+				if(ImGui::SliderInt("Photo quality", &quality, 0, 100)){
+					ImageCoder::set_lossy_quality(quality);
+				}
 			}
 			if(ImGui::Button("Exit")){
 				break;
@@ -632,5 +760,8 @@ int main(int argc, char *argv[]){
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
+	if(board.trace){
+		fclose(board.trace);
+	}
 	return 0;
 }
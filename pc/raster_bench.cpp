@@ -0,0 +1,237 @@
+// Benchmark for BoardContent on its own, with no window or server.
+// Replays pen traces at every brush size through pen_down, pen_move and
+// pen_up, and once more deferred with a flush every few events as the
+// desktop client does once a frame, then clears, fills and pastes, on one
+// board per thread, and
+// reports how many pixels changed per second, the updates sent out through
+// on_image_update, and how much of the area they cover did not change.
+//   raster_bench [-j boards] [trace ...]
+// A trace is a text file of "pressed x y" lines, the input guiclient
+// writes when given a third argument. Without any, synthetic traces are
+// used.
+
+#include "BoardContent.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+static double now(){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct PenEvent{
+	bool pressed;
+	int x, y;
+};
+
+struct Trace{
+	std::string name;
+	std::vector<PenEvent> events;
+};
+
+static bool load_trace(const char *filename, Trace &trace){
+	FILE *fp = fopen(filename, "r");
+	if(NULL == fp){ return false; }
+	trace.name = filename;
+	trace.events.clear();
+	char line[128];
+	while(fgets(line, sizeof(line), fp)){
+		int pressed, x, y;
+		if(3 == sscanf(line, "%d %d %d", &pressed, &x, &y)){
+			PenEvent e = { 0 != pressed, x, y };
+			trace.events.push_back(e);
+		}
+	}
+	fclose(fp);
+	return !trace.events.empty();
+}
+
+// Strokes of n samples step pixels apart, turning a little at each one.
+// Small steps are a slow hand, large ones a quick line.
+static void make_trace(Trace &trace, const char *name, int nstrokes, int n, float step, float turn){
+	trace.name = name;
+	trace.events.clear();
+	for(int s = 0; s < nstrokes; ++s){
+		float x = 100 + rand() % 1700, y = 100 + rand() % 800;
+		float a = (rand() % 628) * 0.01f;
+		PenEvent hover = { false, (int)x, (int)y };
+		trace.events.push_back(hover);
+		for(int k = 0; k < n; ++k){
+			PenEvent e = { true, (int)(x + 0.5f), (int)(y + 0.5f) };
+			trace.events.push_back(e);
+			a += ((rand() % 201) - 100) * 0.01f * turn;
+			x += step * cosf(a);
+			y += step * sinf(a);
+		}
+		PenEvent up = { false, (int)(x + 0.5f), (int)(y + 0.5f) };
+		trace.events.push_back(up);
+	}
+}
+
+// Counts what the board reports. Strokes and fills go through
+// on_image_update_list with changed filled in, clears and pastes through
+// on_image_update.
+struct RasterBoard : public BoardContent{
+	size_t updates, area, changed_px;
+	RasterBoard(){ reset(); }
+	void reset(){
+		updates = area = changed_px = 0;
+	}
+	void on_image_update(Region *touched){
+		const Region &r = (NULL == touched ? drawable_region : *touched);
+		++updates;
+		area += (size_t)r.w * r.h;
+		changed_px += (size_t)r.w * r.h;
+	}
+	void on_image_update_list(const std::vector<Region> &touched){
+		for(size_t i = 0; i < touched.size(); ++i){
+			const Region &r = touched[i];
+			++updates;
+			area += (size_t)r.w * r.h;
+			for(pixel_coord j = 0; j < r.h; ++j){
+				const unsigned char *c = &changed[r.x + (r.y + j) * (size_t)width];
+				for(pixel_coord k = 0; k < r.w; ++k){
+					changed_px += c[k];
+				}
+			}
+		}
+	}
+	// What gui_input does, less the sidebar buttons. With per_frame, the
+	// pen is deferred and flushed after that many events.
+	void replay(const Trace &trace, unsigned per_frame = 0){
+		pen_set_deferred(0 != per_frame);
+		for(size_t i = 0; i < trace.events.size(); ++i){
+			const PenEvent &e = trace.events[i];
+			if(e.pressed){
+				pen_down(e.x, e.y);
+			}else{
+				pen_up(e.x, e.y);
+			}
+			pen_move(e.x, e.y);
+			if(per_frame && 0 == (i+1) % per_frame){
+				flush_pen();
+			}
+		}
+		pen_set_deferred(false);
+	}
+};
+
+// Runs job on every board at once and prints a line for it
+static void run(ThreadPool &pool, std::vector<RasterBoard> &boards, const char *name, const std::function<void(RasterBoard&)> &job){
+	for(size_t i = 0; i < boards.size(); ++i){
+		boards[i].reset();
+	}
+	double t0 = now();
+	pool.run(boards.size(), [&](unsigned i){ job(boards[i]); });
+	double t1 = now();
+	size_t updates = 0, area = 0, changed_px = 0;
+	for(size_t i = 0; i < boards.size(); ++i){
+		updates += boards[i].updates;
+		area += boards[i].area;
+		changed_px += boards[i].changed_px;
+	}
+	printf("%-24s %9.1f %10.1f %9zu %9.0f %8.2f\n", name,
+		1e3*(t1 - t0), 1e-6*changed_px/(t1 - t0), updates,
+		updates ? (double)area/updates : 0.0, changed_px ? (double)area/changed_px : 0.0);
+}
+
+int main(int argc, char *argv[]){
+	unsigned nboards = ThreadPool::shared().size();
+	std::vector<Trace> traces;
+	for(int i = 1; i < argc; ++i){
+		if(0 == strcmp(argv[i], "-j") && i+1 < argc){
+			nboards = atoi(argv[++i]);
+			if(nboards < 1){ nboards = 1; }
+			continue;
+		}
+		Trace trace;
+		if(!load_trace(argv[i], trace)){
+			fprintf(stderr, "Could not read a trace from %s\n", argv[i]);
+			return 1;
+		}
+		traces.push_back(trace);
+	}
+	if(traces.empty()){
+		srand(1);
+		traces.resize(3);
+		make_trace(traces[0], "writing", 400, 30, 1.5f, 0.6f);
+		make_trace(traces[1], "scribble", 200, 40, 6.f, 0.3f);
+		make_trace(traces[2], "lines", 60, 40, 24.f, 0.02f);
+	}
+
+	ThreadPool pool(nboards - 1);
+	std::vector<RasterBoard> boards(nboards);
+	std::vector<unsigned char> photo;
+	{
+		const unsigned w = boards[0].drawable_region.w, h = boards[0].drawable_region.h;
+		// RGBA with an opaque alpha byte. The gray paste reads its first
+		// w*h bytes as one byte per pixel.
+		photo.resize(4*(size_t)w*h);
+		for(size_t i = 0; i < photo.size(); ++i){
+			photo[i] = 3 == i%4 ? 255 : (unsigned char)((i/4 % w + i/(4*w)) * (1 + i%4) + rand() % 16);
+		}
+	}
+
+	printf("%u boards of %ux%u\n", nboards, boards[0].width, boards[0].height);
+	printf("%-24s %9s %10s %9s %9s %8s\n", "", "ms", "Mpx/s", "updates", "px/upd", "overhead");
+	static const float sizes[] = { 3.f, 5.f, 10.f, 20.f };
+	const std::function<void(unsigned)> wipe = [&](unsigned i){
+		boards[i].clear(BoardContent::PenColor(1, 1, 1));
+	};
+	char name[64];
+	for(size_t t = 0; t < traces.size(); ++t){
+		for(unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s){
+			for(int aa = 0; aa < 2; ++aa){
+				pool.run(nboards, wipe); // so every run draws on white
+				snprintf(name, sizeof(name), "%.10s %2.0f%s", traces[t].name.c_str(), sizes[s], aa ? " smooth" : "");
+				run(pool, boards, name, [&](RasterBoard &b){
+					b.pen_set_size(sizes[s]);
+					b.pen_set_antialias(aa);
+					b.replay(traces[t]);
+				});
+			}
+		}
+		// A mouse reporting at 240 Hz under a 60 Hz frame
+		pool.run(nboards, wipe);
+		snprintf(name, sizeof(name), "%.10s 10 deferred", traces[t].name.c_str());
+		run(pool, boards, name, [&](RasterBoard &b){
+			b.pen_set_size(10);
+			b.pen_set_antialias(true);
+			b.replay(traces[t], 4);
+		});
+	}
+	run(pool, boards, "clear x10", [](RasterBoard &b){
+		for(int k = 0; k < 10; ++k){
+			b.clear(k % 2 ? BoardContent::PenColor(1, 1, 1) : BoardContent::PenColor(0, 0, 0));
+		}
+	});
+	run(pool, boards, "fill x10", [](RasterBoard &b){
+		for(int k = 0; k < 10; ++k){
+			b.pen_set_color(k % 2 ? BoardContent::PenColor(1, 1, 1) : BoardContent::PenColor(0, 0, 0));
+			b.fill(b.drawable_region.x + b.drawable_region.w/2, b.drawable_region.y + b.drawable_region.h/2);
+		}
+	});
+	// Each source layout paste_image has a kernel for
+	struct Layout{ const char *name; unsigned format, bpp; };
+	static const Layout layouts[] = {
+		{ "paste RGBA x10", BoardContent::PASTE_FORMAT_RGBA, 4 },
+		{ "paste BGRA x10", BoardContent::PASTE_FORMAT_BGR, 4 },
+		{ "paste gray x10", BoardContent::PASTE_FORMAT_BW, 1 }
+	};
+	for(unsigned l = 0; l < sizeof(layouts)/sizeof(layouts[0]); ++l){
+		const Layout &L = layouts[l];
+		run(pool, boards, L.name, [&](RasterBoard &b){
+			const unsigned w = b.drawable_region.w, h = b.drawable_region.h;
+			for(int k = 0; k < 10; ++k){
+				b.paste_image(BoardContent::PASTE_LOC_LEFT | BoardContent::PASTE_LOC_TOP, L.format, &photo[0], L.bpp*w, L.bpp, w, h);
+			}
+		});
+	}
+	return 0;
+}